@@ -0,0 +1,238 @@
+/* End-to-end benchmarks: scripts of many commands run through "SHELL script",
+* or written into the shell's stdin through a pipe ("generator | SHELL").
+* Each scenario writes a script into a temporary directory, runs it once with
+* SMALLSH_TRACE pointing at a file, and reports commands per second from the
+* wall time and the p50 / p99 spawn latency from the trace records. The
+* shell's stderr (background job reports) is sent to /dev/null.
+* A scenario that checks the line cache ends with the "cache" builtin, its
+* output goes to a file and the run fails if more lines missed than it has
+* distinct ones. spawn_script runs a file without a "#!" line, which has to
+* fall back to /bin/sh as execvp() does (the run fails if it doesn't).
+* One JSON record per scenario is written to stdout.
+*
+* Usage: e2e [-n COMMANDS] shell
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+struct scenario {
+    const char *name;
+    const char *line;   // repeated for every command, %s is the temporary directory
+    int divisor;        // runs COMMANDS / divisor lines
+    const char *tail;   // run once at the end, or NULL
+    int piped;          // 1 to feed the script through a pipe instead of naming it
+    int distinct;       // lines the line cache may miss, 0 for no cache check
+};
+
+static const struct scenario scenarios[] = {
+    { .name = "builtin_true", .line = "true\n", .divisor = 1 },
+    { .name = "spawn_true", .line = "/bin/true\n", .divisor = 1 },
+    { .name = "spawn_script", .line = "%s/plain\n", .divisor = 5 },
+    { .name = "redirect", .line = "/bin/cat < %s/in > %s/out\n", .divisor = 5 },
+    { .name = "builtin_redirect", .line = "echo $$ > %s/out\n", .divisor = 1 },
+    { .name = "bg_fanout", .line = "/bin/true &\n", .divisor = 10, .tail = "wait\n" },
+    { .name = "piped_true", .line = "true\n", .divisor = 1, .piped = 1 },
+    { .name = "piped_assign", .line = "X=$?\n", .divisor = 1, .piped = 1 },
+    { .name = "test_loop", .line = "for x in 1 2 3 4 5 6 7 8 9 10; do [ $x -lt 50 ]; done\n", .divisor = 10,
+      .distinct = 2 },
+};
+
+/* Function to write the file at path into fd, then close fd */
+static void feed(const char *path, int fd)
+{
+    char buf[1 << 16];
+    ssize_t n;
+    int in = open(path, O_RDONLY);
+    while (in >= 0 && (n = read(in, buf, sizeof buf)) > 0) {
+        if (write(fd, buf, n) != n) break;
+    }
+    if (in >= 0) close(in);
+    close(fd);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+    return (x > y) - (x < y);
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Function to collect every "spawn_ns" value from the trace at path, returns how many */
+static size_t read_spawn_ns(const char *path, unsigned long long **out)
+{
+    FILE *f = fopen(path, "r");
+    char *line = NULL;
+    size_t cap = 0, n = 0, out_cap = 0;
+    *out = NULL;
+    if (f == NULL) return 0;
+    while (getline(&line, &cap, f) != -1) {
+        for (char *p = line; (p = strstr(p, "\"spawn_ns\":")) != NULL; ) {
+            p += strlen("\"spawn_ns\":");
+            if (n == out_cap) {
+                out_cap = out_cap ? out_cap * 2 : 1024;
+                *out = realloc(*out, out_cap * sizeof **out);
+                if (*out == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            (*out)[n++] = strtoull(p, &p, 10);
+        }
+    }
+    free(line);
+    fclose(f);
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    int commands = 10000;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        commands = atoi(argv[2]);
+        first = 3;
+    }
+    if (first != argc - 1 || commands <= 0) {
+        fprintf(stderr, "usage: %s [-n COMMANDS] shell\n", argv[0]);
+        return 2;
+    }
+    const char *shell = argv[first];
+
+    char dir[] = "/tmp/smallsh-bench.XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char script[64], trace[64], in[64], out[64], plain[64];
+    snprintf(script, sizeof script, "%s/script", dir);
+    snprintf(trace, sizeof trace, "%s/trace", dir);
+    snprintf(in, sizeof in, "%s/in", dir);
+    snprintf(out, sizeof out, "%s/out", dir);
+    snprintf(plain, sizeof plain, "%s/plain", dir);
+    FILE *f = fopen(in, "w");
+    if (f == NULL) {
+        perror(in);
+        return 1;
+    }
+    fputs("some input for cat\n", f);
+    fclose(f);
+    f = fopen(plain, "w");
+    if (f == NULL) {
+        perror(plain);
+        return 1;
+    }
+    fputs(":\n", f);  // no "#!" line
+    fclose(f);
+    chmod(plain, 0755);
+    setenv("SMALLSH_TRACE", trace, 1);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+    for (size_t s = 0; s < sizeof scenarios / sizeof scenarios[0]; s++) {
+        const struct scenario *sc = &scenarios[s];
+        int lines = commands / sc->divisor;
+
+        f = fopen(script, "w");
+        if (f == NULL) {
+            perror(script);
+            return 1;
+        }
+        for (int i = 0; i < lines; i++) fprintf(f, sc->line, dir, dir);
+        if (sc->tail != NULL) fputs(sc->tail, f);
+        if (sc->distinct) fputs("cache\n", f);
+        fclose(f);
+        unlink(trace);
+
+        char *shell_argv[] = { (char *) shell, sc->piped ? NULL : script, NULL };
+        posix_spawn_file_actions_t *fa = &actions, piped_actions, cache_actions;
+        int pipe_fds[2] = { -1, -1 };
+        if (sc->distinct) {
+            posix_spawn_file_actions_init(&cache_actions);
+            posix_spawn_file_actions_addopen(&cache_actions, 2, "/dev/null", O_WRONLY, 0);
+            posix_spawn_file_actions_addopen(&cache_actions, 1, out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            fa = &cache_actions;
+        }
+        if (sc->piped) {
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                perror("pipe");
+                return 1;
+            }
+            posix_spawn_file_actions_init(&piped_actions);
+            posix_spawn_file_actions_addopen(&piped_actions, 2, "/dev/null", O_WRONLY, 0);
+            posix_spawn_file_actions_adddup2(&piped_actions, pipe_fds[0], 0);
+            fa = &piped_actions;
+        }
+        pid_t pid;
+        int status;
+        double start = now_s();
+        if (posix_spawnp(&pid, shell, fa, NULL, shell_argv, environ) != 0) {
+            perror(shell);
+            return 1;
+        }
+        if (sc->piped) {
+            close(pipe_fds[0]);
+            feed(script, pipe_fds[1]);
+            posix_spawn_file_actions_destroy(&piped_actions);
+        }
+        waitpid(pid, &status, 0);
+        double elapsed = now_s() - start;
+        if (sc->distinct) posix_spawn_file_actions_destroy(&cache_actions);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("{\"bench\":\"e2e\",\"scenario\":\"%s\",\"error\":\"exit status %d\"}\n", sc->name, status);
+            continue;
+        }
+        unsigned long hits = 0, misses = 0;
+        if (sc->distinct) {
+            f = fopen(out, "r");
+            if (f == NULL || fscanf(f, "hits %lu misses %lu", &hits, &misses) != 2 || misses > (unsigned long) sc->distinct) {
+                printf("{\"bench\":\"e2e\",\"scenario\":\"%s\",\"error\":\"line cache hits %lu misses %lu\"}\n",
+                       sc->name, hits, misses);
+                if (f != NULL) fclose(f);
+                continue;
+            }
+            fclose(f);
+        }
+
+        unsigned long long *spawn_ns;
+        size_t n = read_spawn_ns(trace, &spawn_ns);
+        printf("{\"bench\":\"e2e\",\"scenario\":\"%s\",\"commands\":%d,\"secs\":%.3f,\"cmds_per_sec\":%.0f",
+               sc->name, lines, elapsed, lines / elapsed);
+        if (n > 0) {
+            qsort(spawn_ns, n, sizeof *spawn_ns, cmp_u64);
+            printf(",\"spawns\":%zu,\"spawn_p50_us\":%.1f,\"spawn_p99_us\":%.1f", n,
+                   spawn_ns[n / 2] / 1e3, spawn_ns[(size_t) (n * 0.99)] / 1e3);
+        }
+        if (sc->distinct) printf(",\"cache_hits\":%lu,\"cache_misses\":%lu", hits, misses);
+        printf("}\n");
+        fflush(stdout);
+        free(spawn_ns);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    unlink(script);
+    unlink(trace);
+    unlink(in);
+    unlink(out);
+    unlink(plain);
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,198 @@
+/* Microbenchmarks for word splitting and expansion.
+* Synthetic lines (many short tokens, long words, dense "$$" / "$?") are run
+* through lex_line(), the one-pass splitter and expander the shell uses,
+* through lex_expand(), which re-expands a line the line cache has seen before
+* from its recorded segments, and through str_gsub(), the replace-in-place
+* helper lex_line() was built to replace.
+* With -g N, N empty files are made in a temporary directory and glob patterns
+* over it are expanded with the directory cache empty (a getdents64 scan per
+* pattern) and with the listing cached.
+* Each case runs for about TIME seconds (default 0.5) and one JSON record per
+* case is written to stdout.
+*
+* Usage: lex [-t TIME] [-g N]
+*/
+
+#define _GNU_SOURCE
+#include "../smallsh.h"
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a synthetic line: repeat unit count times
+struct lex_case {
+    const char *name;
+    const char *unit;
+    int count;
+};
+
+static const struct lex_case cases[] = {
+    { "many_tokens", "a ", 500 },
+    { "long_words", "abcdefghijklmnopqrstuvwxyz0123456789", 200 },
+    { "dense_dollar", "$$x$? ", 200 },
+    { "typical", "ls -l ~/src/$$/out > /tmp/log.$? ", 4 },
+};
+
+static char *make_line(const struct lex_case *c, size_t *len)
+{
+    size_t unit_len = strlen(c->unit);
+    char *line = malloc(unit_len * c->count + 1);
+    if (line == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < c->count; i++) memcpy(line + i * unit_len, c->unit, unit_len);
+    line[unit_len * c->count] = '\0';
+    *len = unit_len * c->count;
+    return line;
+}
+
+/* Function to time glob_expand() on patterns over a directory of nfiles files */
+static int bench_glob(struct lexer *lexer, long nfiles, double budget)
+{
+    char dir[] = "/tmp/smallsh-glob-XXXXXX", path[64];
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return -1;
+    }
+    for (long i = 0; i < nfiles; i++) {
+        snprintf(path, sizeof path, "%s/file%07ld.dat", dir, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            perror(path);
+            return -1;
+        }
+        close(fd);
+    }
+    // a directory changed moments ago isn't cached, make it look settled
+    struct timespec old[2] = { { time(NULL) - 3600, 0 }, { time(NULL) - 3600, 0 } };
+    utimensat(AT_FDCWD, dir, old, 0);
+
+    const char *patterns[] = { "*", "*7.dat", "file00001??.dat", "file[0-4]*[13579].dat" };
+    for (size_t p = 0; p < sizeof patterns / sizeof patterns[0]; p++) {
+        snprintf(path, sizeof path, "%s/%s", dir, patterns[p]);
+        for (int cached = 0; cached <= 1; cached++) {
+            long globs = 0;
+            ssize_t matches = 0;
+            char **list;
+            double start = now_s(), elapsed;
+            do {
+                if (!cached) glob_cache_reset();
+                arena_reset(&lexer->arena);
+                matches = glob_expand(&lexer->arena, path, &list);
+                if (matches == -1) {
+                    perror("glob_expand");
+                    return -1;
+                }
+                globs++;
+            } while ((elapsed = now_s() - start) < budget);
+            printf("{\"bench\":\"glob\",\"case\":\"%s\",\"files\":%ld,\"cached\":%d,\"matches\":%zd,"
+                   "\"globs_per_sec\":%.1f,\"files_per_sec\":%.0f}\n",
+                   patterns[p], nfiles, cached, matches, globs / elapsed, globs * nfiles / elapsed);
+        }
+    }
+
+    for (long i = 0; i < nfiles; i++) {
+        snprintf(path, sizeof path, "%s/file%07ld.dat", dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double budget = 0.5;
+    long glob_files = 0;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-t") == 0) budget = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "-g") == 0) glob_files = atol(argv[i + 1]);
+        else budget = 0;
+    }
+    if (budget <= 0 || glob_files < 0 || argc % 2 == 0) {
+        fprintf(stderr, "usage: %s [-t TIME] [-g N]\n", argv[0]);
+        return 2;
+    }
+
+    static struct lexer lexer;
+    struct expand_ctx ctx = { .home = "/home/user", .shell_pid = 12345, .last_status = 0 };
+    lex_set_delim(&lexer, " \t\n");
+
+    for (size_t k = 0; k < sizeof cases / sizeof cases[0]; k++) {
+        size_t len;
+        char *line = make_line(&cases[k], &len);
+
+        // lex_line(): split and expand, the arena is reset per line as in the shell
+        long lines = 0;
+        int words = 0;
+        double start = now_s(), elapsed;
+        do {
+            for (int i = 0; i < 256; i++) {
+                arena_reset(&lexer.arena);
+                if (lex_line(&lexer, line, len, &ctx, &words) == NULL) {
+                    perror("lex_line");
+                    return 1;
+                }
+            }
+            lines += 256;
+        } while ((elapsed = now_s() - start) < budget);
+        printf("{\"bench\":\"lex\",\"case\":\"%s\",\"bytes\":%zu,\"words\":%d,\"lines\":%ld,\"lines_per_sec\":%.0f,\"mb_per_sec\":%.1f}\n",
+               cases[k].name, len, words, lines, lines / elapsed, lines * len / elapsed / 1e6);
+
+        // lex_expand(): the same line expanded again from the segments recorded for it
+        lexer.record = 1;
+        arena_reset(&lexer.arena);
+        if (lex_line(&lexer, line, len, &ctx, &words) == NULL) {
+            perror("lex_line");
+            return 1;
+        }
+        size_t nsegs = lexer.nsegs;
+        struct lex_seg *segs = malloc(nsegs * sizeof *segs);  // a copy, as the line cache keeps
+        if (segs == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        memcpy(segs, lexer.segs, nsegs * sizeof *segs);
+        lexer.record = 0;
+        lines = 0;
+        start = now_s();
+        do {
+            for (int i = 0; i < 256; i++) {
+                arena_reset(&lexer.arena);
+                if (lex_expand(&lexer, line, segs, nsegs, &ctx, &words) == NULL) {
+                    perror("lex_expand");
+                    return 1;
+                }
+            }
+            lines += 256;
+        } while ((elapsed = now_s() - start) < budget);
+        printf("{\"bench\":\"lex_expand\",\"case\":\"%s\",\"bytes\":%zu,\"words\":%d,\"lines\":%ld,\"lines_per_sec\":%.0f,\"mb_per_sec\":%.1f}\n",
+               cases[k].name, len, words, lines, lines / elapsed, lines * len / elapsed / 1e6);
+        free(segs);
+
+        // str_gsub(): the same expansions done as one malloc'd string per needle
+        long ops = 0;
+        start = now_s();
+        do {
+            for (int i = 0; i < 256; i++) {
+                char *s = strdup(line);
+                if (s == NULL || str_gsub(&s, "$$", "12345") == NULL || str_gsub(&s, "$?", "0") == NULL ||
+                    str_gsub(&s, "~/", "/home/user/") == NULL) {
+                    perror("str_gsub");
+                    return 1;
+                }
+                free(s);
+            }
+            ops += 256;
+        } while ((elapsed = now_s() - start) < budget);
+        printf("{\"bench\":\"str_gsub\",\"case\":\"%s\",\"bytes\":%zu,\"lines\":%ld,\"lines_per_sec\":%.0f,\"mb_per_sec\":%.1f}\n",
+               cases[k].name, len, ops, ops / elapsed, ops * len / elapsed / 1e6);
+        free(line);
+    }
+    if (glob_files > 0 && bench_glob(&lexer, glob_files, budget) == -1) return 1;
+    return 0;
+}
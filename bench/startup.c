@@ -0,0 +1,78 @@
+/* Startup-time measurement: exec-to-exit latency of "SHELL -c true".
+* Each shell named on the command line is spawned RUNS times (default 1000)
+* and the time from posix_spawn() to the end of waitpid() is recorded.
+* One JSON record per shell is written to stdout, so results can be compared
+* between builds and against other shells such as dash.
+*
+* Usage: startup [-n RUNS] shell...
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = 1000;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        runs = atoi(argv[2]);
+        first = 3;
+    }
+    if (first >= argc || runs <= 0) {
+        fprintf(stderr, "usage: %s [-n RUNS] shell...\n", argv[0]);
+        return 2;
+    }
+
+    double *samples = malloc(runs * sizeof *samples);
+    if (samples == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (int s = first; s < argc; s++) {
+        char *shell_argv[] = { argv[s], "-c", "true", NULL };
+        double total = 0;
+        int failed = 0;
+        for (int i = 0; i < runs; i++) {
+            pid_t pid;
+            int status;
+            double start = now_us();
+            if (posix_spawnp(&pid, argv[s], NULL, NULL, shell_argv, environ) != 0) {
+                failed = 1;
+                break;
+            }
+            waitpid(pid, &status, 0);
+            samples[i] = now_us() - start;
+            total += samples[i];
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+        }
+        if (failed) {
+            printf("{\"bench\":\"startup\",\"shell\":\"%s\",\"error\":\"spawn or exit status failed\"}\n", argv[s]);
+            continue;
+        }
+        qsort(samples, runs, sizeof *samples, cmp_double);
+        printf("{\"bench\":\"startup\",\"shell\":\"%s\",\"runs\":%d,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+               argv[s], runs, total / runs, samples[runs / 2], samples[(int) (runs * 0.99)]);
+    }
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,679 @@
+/* Builtin commands.
+* Builtins run inside the shell instead of paying for a fork and exec. They are
+* found through a table sorted by name, and "<" / ">" are honored by pointing
+* the shell's own stdin / stdout at the files for the duration of the builtin.
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+#include <ctype.h>
+
+static int builtin_cd(char **argv);
+static int builtin_echo(char **argv);
+static int builtin_exit(char **argv);
+static int builtin_false(char **argv);
+static int builtin_kill(char **argv);
+static int builtin_printf(char **argv);
+static int builtin_pwd(char **argv);
+static int builtin_test(char **argv);
+static int builtin_true(char **argv);
+static int builtin_wait(char **argv);
+
+// dispatch table, kept sorted by name for bsearch()
+static const struct builtin builtins[] = {
+    { "[",        builtin_test },
+    { "cache",    builtin_cache },
+    { "cd",       builtin_cd },
+    { "echo",     builtin_echo },
+    { "exit",     builtin_exit },
+    { "export",   builtin_export },
+    { "false",    builtin_false },
+    { "hash",     builtin_hash },
+    { "jobs",     builtin_jobs },
+    { "kill",     builtin_kill },
+    { "memo",     builtin_memo },
+    { "parallel", builtin_parallel },
+    { "printf",   builtin_printf },
+    { "pwd",      builtin_pwd },
+    { "stats",    builtin_stats },
+    { "test",     builtin_test },
+    { "true",     builtin_true },
+    { "unset",    builtin_unset },
+    { "wait",     builtin_wait },
+};
+
+static int builtin_cmp(const void *key, const void *elem)
+{
+    return strcmp(key, ((const struct builtin *) elem)->name);
+}
+
+/* Function to look up a builtin by name, NULL if name is not a builtin */
+const struct builtin *builtin_find(const char *name)
+{
+    return bsearch(name, builtins, sizeof builtins / sizeof builtins[0], sizeof builtins[0], builtin_cmp);
+}
+
+const struct command *builtin_command = NULL;
+
+#define FD_UNTOUCHED (-2)  // in the saved fds of a builtin: not changed by its redirection
+
+/* Function to save fd before a builtin's redirection first changes it (-1 if it was closed) */
+static void save_fd(int fd, int *saved)
+{
+    if (saved[fd] == FD_UNTOUCHED) saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+}
+
+/*
+* Function to apply a builtin's here-document (here_fd, or -1) and redirection
+* steps to the shell's own fds 0..9, saving each one it changes in saved.
+* Returns 0 on success, -1 if a file could not be opened or an fd copied.
+*/
+static int redirect_fds(const struct command *cmd, int here_fd, int *saved)
+{
+    if (here_fd >= 0) {
+        save_fd(0, saved);
+        dup2(here_fd, 0);
+    }
+    for (int i = 0; i < cmd->nredirs; i++) {
+        const struct redir *r = &cmd->redirs[i];
+        save_fd(r->fd, saved);
+        if (r->op == REDIR_CLOSE) {
+            close(r->fd);
+        } else if (r->op == REDIR_OPEN) {
+            int file_fd = open(r->path, r->flags | O_CLOEXEC, REDIR_MODE);
+            if (file_fd == -1) {
+                fprintf(stderr, "%s: %s\n", r->path, strerror(errno));
+                return -1;
+            }
+            if (file_fd == r->fd) {
+                fcntl(file_fd, F_SETFD, 0);  // commands the builtin launches inherit it
+            } else {
+                dup2(file_fd, r->fd);
+                close(file_fd);
+            }
+        } else if (dup2(r->src, r->fd) == -1) {
+            fprintf(stderr, "%d: %s\n", r->src, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Function to put back the fds saved by redirect_fds() */
+static void restore_fds(const int *saved)
+{
+    for (int fd = 0; fd < 10; fd++) {
+        if (saved[fd] == FD_UNTOUCHED) continue;
+        if (saved[fd] == -1) {
+            close(fd);
+            continue;
+        }
+        dup2(saved[fd], fd);
+        close(saved[fd]);
+    }
+}
+
+/*
+* Function to run a builtin with the command's redirection applied to the shell's own fds.
+* Output sent to several files is captured and copied to each of them afterwards.
+* Returns the builtin's exit status.
+*/
+int run_builtin(const struct builtin *b, struct command *cmd)
+{
+    int saved[10] = { FD_UNTOUCHED, FD_UNTOUCHED, FD_UNTOUCHED, FD_UNTOUCHED, FD_UNTOUCHED,
+                      FD_UNTOUCHED, FD_UNTOUCHED, FD_UNTOUCHED, FD_UNTOUCHED, FD_UNTOUCHED };
+    int status = 1, here_fd = -1;
+    struct fanout *fan = NULL;
+
+    fflush(stdout);
+    if (cmd->here_doc != NULL || cmd->here_string != NULL) {
+        here_fd = here_input_fd(cmd);
+        if (here_fd == -1) return status;
+    }
+    if (fanout_targets(cmd) > 1 && (fan = fanout_capture(cmd)) == NULL) goto restore;
+    if (redirect_fds(cmd, here_fd, saved) == -1) goto restore;
+
+    builtin_command = cmd;
+    status = b->fn(cmd->argv);
+    builtin_command = NULL;
+    fflush(stdout);
+
+restore:
+    restore_fds(saved);
+    if (here_fd >= 0) close(here_fd);
+    if (fan != NULL) fanout_release(fan);
+    return status;
+}
+
+/* Builtin exit [n]: kill the background jobs and exit with n, or with $? */
+static int builtin_exit(char **argv)
+{
+    int status = argv[1] == NULL ? stat_code : atoi(argv[1]);
+    fprintf(stderr, "\nexit\n");
+    // send SIGINT signal to child processes
+    jobs_signal_bg(SIGINT);
+    fflush(stdout);
+    exit(status);
+}
+
+/* Builtin cd [dir]: change to dir, or to HOME */
+static int builtin_cd(char **argv)
+{
+    const char *dir = argv[1] != NULL ? argv[1] : var_get("HOME");
+    if (dir == NULL) {
+        fprintf(stderr, "cd: HOME not set\n");
+        return 1;
+    }
+    if (chdir(dir) == -1) {
+        fprintf(stderr, "%s does not exist\n", dir);
+        return 1;
+    }
+    return 0;
+}
+
+static int builtin_true(char **argv)
+{
+    (void) argv;
+    return 0;
+}
+
+static int builtin_false(char **argv)
+{
+    (void) argv;
+    return 1;
+}
+
+/* Builtin pwd: print the current directory */
+static int builtin_pwd(char **argv)
+{
+    (void) argv;
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    puts(cwd);
+    free(cwd);
+    return 0;
+}
+
+/*
+* Function to print the backslash escape at *s (just past the backslash), as
+* echo -e and printf do, and move *s past it.
+* Returns 1 for \c (stop all output), 0 otherwise.
+*/
+static int print_escape(const char **s)
+{
+    const char *p = *s;
+    int value = 0, n = 0;
+    switch (*p) {
+        case 'a': putchar('\a'); break;
+        case 'b': putchar('\b'); break;
+        case 'c': return 1;
+        case 'e': putchar('\033'); break;
+        case 'f': putchar('\f'); break;
+        case 'n': putchar('\n'); break;
+        case 'r': putchar('\r'); break;
+        case 't': putchar('\t'); break;
+        case 'v': putchar('\v'); break;
+        case '\\': putchar('\\'); break;
+        case '0':  // \0nnn, up to three octal digits
+            for (; n < 3 && p[1] >= '0' && p[1] <= '7'; n++) value = value * 8 + (*++p - '0');
+            putchar(value);
+            break;
+        case 'x':  // \xHH, up to two hex digits
+            for (; n < 2 && isxdigit((unsigned char) p[1]); n++) {
+                char h = *++p;
+                value = value * 16 + (h <= '9' ? h - '0' : (h | 0x20) - 'a' + 10);
+            }
+            if (n == 0) fputs("\\x", stdout);
+            else putchar(value);
+            break;
+        default:
+            putchar('\\');
+            if (*p == '\0') {  // trailing backslash
+                *s = p;
+                return 0;
+            }
+            putchar(*p);
+    }
+    *s = p + 1;
+    return 0;
+}
+
+/* Function to print s with its backslash escapes interpreted, returns 1 if output was stopped by \c */
+static int print_escaped(const char *s)
+{
+    while (*s) {
+        if (*s != '\\') {
+            putchar(*s++);
+            continue;
+        }
+        s++;
+        if (print_escape(&s)) return 1;
+    }
+    return 0;
+}
+
+/* Builtin echo [-neE] [args]: same options as coreutils echo */
+static int builtin_echo(char **argv)
+{
+    int newline = 1, escapes = 0;
+    int i = 1;
+
+    // leading option words made only of n, e and E
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1)) break;
+        for (const char *opt = argv[i] + 1; *opt; opt++) {
+            if (*opt == 'n') newline = 0;
+            else escapes = *opt == 'e';
+        }
+    }
+    for (int first = i; argv[i] != NULL; i++) {
+        if (i > first) putchar(' ');
+        if (!escapes) fputs(argv[i], stdout);
+        else if (print_escaped(argv[i])) return 0;
+    }
+    if (newline) putchar('\n');
+    return 0;
+}
+
+/* Function to convert a printf argument to a number, warning when it isn't one */
+static long long printf_num(const char *arg, int *status)
+{
+    char *end;
+    if (arg == NULL) return 0;
+    if ((arg[0] == '\'' || arg[0] == '"') && arg[1] != '\0') return (unsigned char) arg[1];  // 'c is the character code
+    errno = 0;
+    long long value = strtoll(arg, &end, 0);
+    if (end == arg || *end != '\0' || errno != 0) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+/*
+* Builtin printf FORMAT [args]: supports the flags, width and precision of
+* printf(3) with the conversions d i o u x X c s b and %%. The format is reused
+* until every argument has been consumed.
+*/
+static int builtin_printf(char **argv)
+{
+    if (argv[1] == NULL) {
+        fprintf(stderr, "printf: missing format\n");
+        return 2;
+    }
+    const char *format = argv[1];
+    char **args = argv + 2;
+    int status = 0;
+
+    do {
+        char **args_start = args;
+        for (const char *f = format; *f; f++) {
+            if (*f == '\\') {  // escapes in the format itself
+                f++;
+                if (print_escape(&f)) return status;
+                f--;
+                continue;
+            }
+            if (*f != '%') {
+                putchar(*f);
+                continue;
+            }
+            if (f[1] == '%') {
+                putchar('%');
+                f++;
+                continue;
+            }
+
+            // copy "%[flags][width][.precision]" into spec, * takes the width from an argument
+            // (room leaves space for "ll", the conversion and the NUL)
+            char spec[32];
+            size_t n = 0, room = sizeof spec - 4;
+            spec[n++] = *f++;
+            while (*f && strchr("-+ #0", *f)) {
+                if (n == room) goto too_long;
+                spec[n++] = *f++;
+            }
+            while (*f && (isdigit((unsigned char) *f) || *f == '.' || *f == '*')) {
+                char num[16];
+                const char *piece = f;
+                size_t len = 1;
+                if (*f == '*') {
+                    len = snprintf(num, sizeof num, "%d", (int) printf_num(*args, &status));
+                    piece = num;
+                    if (*args) args++;
+                }
+                if (n + len > room) goto too_long;
+                memcpy(spec + n, piece, len);
+                n += len;
+                f++;
+            }
+            char conv = *f;
+            const char *arg = *args;
+            if (arg != NULL) args++;
+
+            switch (conv) {
+                case 'd': case 'i':
+                    spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = conv; spec[n] = '\0';
+                    printf(spec, printf_num(arg, &status));
+                    break;
+                case 'o': case 'u': case 'x': case 'X':
+                    spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = conv; spec[n] = '\0';
+                    printf(spec, (unsigned long long) printf_num(arg, &status));
+                    break;
+                case 'c':
+                    spec[n++] = 'c'; spec[n] = '\0';
+                    if (arg != NULL) printf(spec, arg[0]);  // no argument prints nothing, not a NUL
+                    break;
+                case 's':
+                    spec[n++] = 's'; spec[n] = '\0';
+                    printf(spec, arg != NULL ? arg : "");
+                    break;
+                case 'b':
+                    if (arg != NULL && print_escaped(arg)) return status;
+                    break;
+                default:
+                    fprintf(stderr, "printf: %%%c: invalid conversion\n", conv ? conv : ' ');
+                    return 1;
+            }
+        }
+        if (args == args_start) break;  // format used no arguments, don't loop forever
+    } while (*args != NULL);
+    return status;
+
+too_long:
+    fprintf(stderr, "printf: %s: conversion specification too long\n", format);
+    return 1;
+}
+
+/*
+* Function to parse a signal given as a name (with or without "SIG") or a number.
+* Returns the signal number, or -1 if it isn't one.
+*/
+static const struct { const char *name; int signo; } signal_names[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "ILL", SIGILL },
+    { "TRAP", SIGTRAP }, { "ABRT", SIGABRT }, { "BUS", SIGBUS }, { "FPE", SIGFPE },
+    { "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "SEGV", SIGSEGV }, { "USR2", SIGUSR2 },
+    { "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM }, { "CHLD", SIGCHLD },
+    { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN },
+    { "TTOU", SIGTTOU }, { "URG", SIGURG }, { "XCPU", SIGXCPU }, { "XFSZ", SIGXFSZ },
+    { "VTALRM", SIGVTALRM }, { "PROF", SIGPROF }, { "WINCH", SIGWINCH }, { "SYS", SIGSYS },
+};
+
+static int parse_signal(const char *s)
+{
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (end != s && *end == '\0') return n >= 0 && n < NSIG ? (int) n : -1;
+    if (strncmp(s, "SIG", 3) == 0) s += 3;
+    for (size_t i = 0; i < sizeof signal_names / sizeof signal_names[0]; i++) {
+        if (strcasecmp(s, signal_names[i].name) == 0) return signal_names[i].signo;
+    }
+    return -1;
+}
+
+/* Builtin kill [-s SIG | -SIG] pid... and kill -l */
+static int builtin_kill(char **argv)
+{
+    int sig = SIGTERM;
+    int i = 1;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-l") == 0) {
+        for (size_t j = 0; j < sizeof signal_names / sizeof signal_names[0]; j++) {
+            printf("%2d) SIG%s\n", signal_names[j].signo, signal_names[j].name);
+        }
+        return 0;
+    }
+    if (argv[1] != NULL && (strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "-n") == 0)) {
+        if (argv[2] == NULL || (sig = parse_signal(argv[2])) == -1) {
+            fprintf(stderr, "kill: %s: invalid signal\n", argv[2] ? argv[2] : "");
+            return 2;
+        }
+        i = 3;
+    } else if (argv[1] != NULL && argv[1][0] == '-' && argv[1][1] != '\0' && strcmp(argv[1], "--") != 0) {
+        if ((sig = parse_signal(argv[1] + 1)) == -1) {
+            fprintf(stderr, "kill: %s: invalid signal\n", argv[1] + 1);
+            return 2;
+        }
+        i = 2;
+    }
+    if (argv[i] != NULL && strcmp(argv[i], "--") == 0) i++;
+    if (argv[i] == NULL) {
+        fprintf(stderr, "kill: usage: kill [-s SIG | -SIG] pid...\n");
+        return 2;
+    }
+
+    int status = 0;
+    for (; argv[i] != NULL; i++) {
+        char *end;
+        long pid = strtol(argv[i], &end, 10);
+        if (end == argv[i] || *end != '\0') {
+            fprintf(stderr, "kill: %s: arguments must be process IDs\n", argv[i]);
+            status = 1;
+        } else if (kill((pid_t) pid, sig) == -1) {
+            fprintf(stderr, "kill: (%ld) - %s\n", pid, strerror(errno));
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/*
+* Builtin wait [-n | pid...]: wait for every background job, for the next one
+* to finish, or for the given ones. Returns the status of the last job waited for,
+* 127 if a pid is not a job of this shell.
+*/
+static int builtin_wait(char **argv)
+{
+    int status = 0, wait_status;
+
+    if (argv[1] == NULL) {
+        jobs_wait_all_bg();
+        return 0;
+    }
+    if (strcmp(argv[1], "-n") == 0) {
+        if (job_wait_next_bg(&wait_status) == -1) return 127;
+        return job_status_code(wait_status);
+    }
+    for (int i = 1; argv[i] != NULL; i++) {
+        char *end;
+        long pid = strtol(argv[i], &end, 10);
+        if (end == argv[i] || *end != '\0' || pid <= 0) {
+            fprintf(stderr, "wait: %s: not a pid\n", argv[i]);
+            status = 2;
+        } else if (job_wait_bg((pid_t) pid, &wait_status) == -1) {
+            fprintf(stderr, "wait: pid %ld is not a child of this shell\n", pid);
+            status = 127;
+        } else {
+            status = job_status_code(wait_status);
+        }
+    }
+    return status;
+}
+
+/*
+* test EXPRESSION / [ EXPRESSION ]
+* A recursive descent parser over the arguments:
+*   expr    := and ( -o and )*
+*   and     := not ( -a not )*
+*   not     := ! not | primary
+*   primary := ( expr ) | -UNARY arg | arg BINARY arg | arg
+* There are no "<" / ">" string comparisons: without quoting the parser always
+* takes them as redirections.
+*/
+struct test_state {
+    char **args;
+    int pos;
+    int count;
+    int error;
+};
+
+static int test_expr(struct test_state *t);
+
+static const char *test_peek(struct test_state *t, int ahead)
+{
+    return t->pos + ahead < t->count ? t->args[t->pos + ahead] : NULL;
+}
+
+static int test_unary(const char *op, const char *arg)
+{
+    struct stat st;
+    if (strcmp(op, "-z") == 0) return arg[0] == '\0';
+    if (strcmp(op, "-n") == 0) return arg[0] != '\0';
+    if (strcmp(op, "-t") == 0) return isatty(atoi(arg));
+    if (strcmp(op, "-L") == 0 || strcmp(op, "-h") == 0) return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    if (strcmp(op, "-r") == 0) return access(arg, R_OK) == 0;
+    if (strcmp(op, "-w") == 0) return access(arg, W_OK) == 0;
+    if (strcmp(op, "-x") == 0) return access(arg, X_OK) == 0;
+    if (stat(arg, &st) == -1) return 0;
+    switch (op[1]) {
+        case 'e': return 1;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'k': return (st.st_mode & S_ISVTX) != 0;
+    }
+    return 0;
+}
+
+static int is_unary_op(const char *s)
+{
+    return s != NULL && s[0] == '-' && s[1] != '\0' && s[2] == '\0' && strchr("bcdefghknprstuwxzLS", s[1]) != NULL;
+}
+
+static int is_binary_op(const char *s)
+{
+    static const char *ops[] = { "=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+    for (int i = 0; s != NULL && ops[i] != NULL; i++) {
+        if (strcmp(s, ops[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+static long long test_int(struct test_state *t, const char *s)
+{
+    char *end;
+    long long value = strtoll(s, &end, 10);
+    if (end == s || *end != '\0') {
+        fprintf(stderr, "test: %s: integer expression expected\n", s);
+        t->error = 1;
+    }
+    return value;
+}
+
+static int test_binary(struct test_state *t, const char *a, const char *op, const char *b)
+{
+    struct stat sa, sb;
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        int ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+        if (op[1] == 'e') return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        if (!ha || !hb) return op[1] == 'n' ? ha : hb;
+        long long ma = sa.st_mtim.tv_sec * 1000000000LL + sa.st_mtim.tv_nsec;
+        long long mb = sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+        return op[1] == 'n' ? ma > mb : ma < mb;
+    }
+    long long x = test_int(t, a), y = test_int(t, b);
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y;
+}
+
+static int test_primary(struct test_state *t)
+{
+    const char *a = test_peek(t, 0);
+    if (a == NULL) {
+        fprintf(stderr, "test: argument expected\n");
+        t->error = 1;
+        return 0;
+    }
+    // a binary operator takes precedence, so "test -n = -n" compares strings
+    if (is_binary_op(test_peek(t, 1)) && test_peek(t, 2) != NULL) {
+        t->pos += 3;
+        return test_binary(t, a, t->args[t->pos - 2], t->args[t->pos - 1]);
+    }
+    if (strcmp(a, "(") == 0 && t->count - t->pos > 1) {
+        t->pos++;
+        int result = test_expr(t);
+        if (test_peek(t, 0) == NULL || strcmp(test_peek(t, 0), ")") != 0) {
+            fprintf(stderr, "test: missing )\n");
+            t->error = 1;
+        }
+        t->pos++;
+        return result;
+    }
+    if (is_unary_op(a) && test_peek(t, 1) != NULL) {
+        t->pos += 2;
+        return test_unary(a, t->args[t->pos - 1]);
+    }
+    t->pos++;
+    return a[0] != '\0';  // a lone string is true when it isn't empty
+}
+
+static int test_not(struct test_state *t)
+{
+    const char *a = test_peek(t, 0);
+    if (a != NULL && strcmp(a, "!") == 0 && test_peek(t, 1) != NULL) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static int test_and(struct test_state *t)
+{
+    int result = test_not(t);
+    while (test_peek(t, 0) != NULL && strcmp(test_peek(t, 0), "-a") == 0) {
+        t->pos++;
+        int rhs = test_not(t);
+        result = result && rhs;
+    }
+    return result;
+}
+
+static int test_expr(struct test_state *t)
+{
+    int result = test_and(t);
+    while (test_peek(t, 0) != NULL && strcmp(test_peek(t, 0), "-o") == 0) {
+        t->pos++;
+        int rhs = test_and(t);
+        result = result || rhs;
+    }
+    return result;
+}
+
+/* Builtin test / [: returns 0 if the expression is true, 1 if false, 2 on error */
+static int builtin_test(char **argv)
+{
+    struct test_state t = { argv + 1, 0, 0, 0 };
+    while (t.args[t.count] != NULL) t.count++;
+
+    if (strcmp(argv[0], "[") == 0) {
+        if (t.count == 0 || strcmp(t.args[t.count - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        t.count--;
+    }
+    if (t.count == 0) return 1;
+
+    int result = test_expr(&t);
+    if (!t.error && t.pos < t.count) {
+        fprintf(stderr, "test: %s: unexpected argument\n", t.args[t.pos]);
+        t.error = 1;
+    }
+    if (t.error) return 2;
+    return result ? 0 : 1;
+}
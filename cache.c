@@ -0,0 +1,264 @@
+/* Compiled line cache.
+* Scripts and loops submit the same command text over and over. The first time
+* a line is run, the segments lex_line() recorded for it and the shape of the
+* parsed pipeline (which words are each stage's argv, which are redirection
+* targets, "&", "time" and "timeout") are kept, keyed by a hash of the raw line. A line
+* seen again is only re-expanded from its segments, filling in $?, $!, $$,
+* variables and so on, and its pipeline is rebuilt from the shape without
+* scanning the words again.
+* Operators are recognized after expansion, so a hit is only used when none of
+* the words that contain an expansion turned into "|", a redirection operator, "&", "time",
+* "timeout" or "limit", and a line whose "timeout" duration comes from an expansion is not kept.
+* Neither is a line with a glob pattern, whose words change with the directory
+* (glob.c keeps its own cache of directory listings).
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+
+#define LINE_CACHE_SLOTS 1024  // direct-mapped, a new line replaces whatever was in its slot
+#define LINE_CACHE_MAX   4096  // longer lines are not cached
+
+struct cached_line {
+    char *line;              // copy of the raw line, NULL if the slot is empty
+    size_t len;
+    size_t hash;
+    struct lex_seg *segs;    // segments recorded by lex_line()
+    size_t nsegs;
+    int nwords;
+    unsigned char *dynamic;  // per word, 1 if it contains an expansion
+    int nstages, bg, timed, prefix;
+    double timeout, kill_after;
+    struct limits *limits;   // copy of the "limit" settings, or NULL
+    int *shape;              // per stage: the number of redirections, each as fd, op, flags, src and
+                             // file word, the here-doc and here-string words (-1 for none), argv words, -1
+};
+
+static struct cached_line *cache_table = NULL;
+static unsigned long cache_hits = 0, cache_misses = 0;
+
+/* FNV-1a hash of line[0..len) */
+static size_t cache_hash(const char *line, size_t len)
+{
+    size_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) line[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Function to empty a slot */
+static void cache_free(struct cached_line *c)
+{
+    free(c->line);
+    free(c->segs);
+    free(c->dynamic);
+    free(c->shape);
+    free(c->limits);
+    memset(c, 0, sizeof *c);
+}
+
+/* Function to check whether an expanded word would be taken for an operator */
+static int is_operator(const char *word)
+{
+    struct redir r;
+    return strcmp(word, "|") == 0 || redir_operator(word, &r) != 0 ||
+           strcmp(word, "<<") == 0 || strcmp(word, "<<<") == 0 ||
+           strcmp(word, "&") == 0 || strcmp(word, "time") == 0 || strcmp(word, "timeout") == 0 ||
+           strcmp(word, "limit") == 0;
+}
+
+/* Function to drop every cached line, e.g. when IFS changes and their words would split differently */
+void line_cache_clear(void)
+{
+    for (size_t i = 0; cache_table != NULL && i < LINE_CACHE_SLOTS; i++) cache_free(&cache_table[i]);
+}
+
+/*
+* Function to look up line[0..len) and, on a hit, expand it from its segments
+* and rebuild its pipeline in *pl. *words / *word_count are set as lex_line() would.
+* Returns 1 on a hit, 0 on a miss, -1 if memory could not be allocated.
+*/
+int line_cache_lookup(struct lexer *lx, const char *line, size_t len, const struct expand_ctx *ctx,
+                      char ***words, int *word_count, struct pipeline *pl)
+{
+    size_t hash = cache_hash(line, len);
+    struct cached_line *c = cache_table != NULL ? &cache_table[hash & (LINE_CACHE_SLOTS - 1)] : NULL;
+    if (c == NULL || c->line == NULL || c->hash != hash || c->len != len || memcmp(c->line, line, len) != 0) {
+        cache_misses++;
+        return 0;
+    }
+
+    char **w = lex_expand(lx, c->line, c->segs, c->nsegs, ctx, word_count);
+    if (w == NULL) return -1;
+    for (int i = 0; i < c->nwords; i++) {
+        if (c->dynamic[i] && is_operator(w[i])) {  // the words have to be parsed again
+            cache_misses++;
+            return 0;
+        }
+    }
+
+    struct command *stages = arena_alloc(&lx->arena, c->nstages * sizeof *stages);
+    char **argv = arena_alloc(&lx->arena, (c->nwords + c->nstages) * sizeof *argv);
+    if (stages == NULL || argv == NULL) return -1;
+    const int *shape = c->shape;
+    for (int s = 0; s < c->nstages; s++) {
+        struct command *cmd = &stages[s];
+        command_init(cmd);
+        cmd->nredirs = *shape++;
+        if (cmd->nredirs > 0) {
+            cmd->redirs = arena_alloc(&lx->arena, cmd->nredirs * sizeof *cmd->redirs);
+            if (cmd->redirs == NULL) return -1;
+        }
+        for (int r = 0; r < cmd->nredirs; r++, shape += 5) {
+            cmd->redirs[r] = (struct redir) { shape[0], shape[1], shape[2], shape[3], shape[4] >= 0 ? w[shape[4]] : NULL };
+        }
+        if (shape[0] >= 0) cmd->here_doc = w[shape[0]];
+        if (shape[1] >= 0) cmd->here_string = w[shape[1]];
+        cmd->argv = argv;
+        for (shape += 2; *shape >= 0; shape++) *argv++ = w[*shape];
+        *argv++ = NULL;
+        shape++;
+    }
+    pl->stages = stages;
+    pl->nstages = c->nstages;
+    pl->bg = c->bg;
+    pl->timed = c->timed;
+    pl->timeout = c->timeout;
+    pl->kill_after = c->kill_after;
+    pl->prefix = c->prefix;
+    pl->limits = NULL;
+    if (c->limits != NULL) {  // the pipeline may outlive the slot
+        pl->limits = arena_alloc(&lx->arena, limits_size(c->limits));
+        if (pl->limits == NULL) return -1;
+        memcpy(pl->limits, c->limits, limits_size(c->limits));
+    }
+    *words = w;
+    cache_hits++;
+    return 1;
+}
+
+/* Function to find which of the original words an expanded word pointer is */
+static int word_index(char **orig, int nwords, const char *word)
+{
+    if (word == NULL) return -1;
+    for (int i = 0; i < nwords; i++) {
+        if (orig[i] == word) return i;
+    }
+    return -1;
+}
+
+/*
+* Function to remember a line that lex_line() recorded (into lx->segs) and
+* parse_pipeline() turned into *pl. orig holds the words as lex_line() returned
+* them, before parsing moved them around. A line whose expansions produced an
+* operator is not kept. Failing to allocate just leaves the line uncached.
+*/
+void line_cache_store(const struct lexer *lx, const char *line, size_t len, char **orig, int nwords,
+                      const struct pipeline *pl)
+{
+    if (len > LINE_CACHE_MAX) return;
+    if (cache_table == NULL) {
+        cache_table = calloc(LINE_CACHE_SLOTS, sizeof *cache_table);
+        if (cache_table == NULL) return;
+    }
+
+    // mark the words that contain an expansion
+    unsigned char *dynamic = calloc(nwords > 0 ? nwords : 1, 1);
+    if (dynamic == NULL) return;
+    for (size_t s = 0, word = 0; s < lx->nsegs; s++) {
+        if (lx->segs[s].kind == LEX_GLOB_END) {  // the number of words depends on the files there are
+            free(dynamic);
+            return;
+        }
+        if (lx->segs[s].kind == LEX_WORD_END) word++;
+        else if (lx->segs[s].kind != LEX_LITERAL && word < (size_t) nwords) dynamic[word] = 1;  // not a body
+    }
+    // the "time" / "timeout" / "limit" prefix is kept as parsed, so its words have to be fixed
+    for (int i = 0; i < nwords; i++) {
+        if (dynamic[i] && (i < pl->prefix || is_operator(orig[i]))) {
+            free(dynamic);
+            return;
+        }
+    }
+
+    size_t nshape = 0;
+    for (int s = 0; s < pl->nstages; s++) {
+        nshape += 4 + 5 * pl->stages[s].nredirs;
+        for (char **arg = pl->stages[s].argv; *arg != NULL; arg++) nshape++;
+    }
+    struct cached_line c = {
+        .line = malloc(len),
+        .len = len,
+        .hash = cache_hash(line, len),
+        .segs = malloc(lx->nsegs * sizeof *lx->segs),
+        .nsegs = lx->nsegs,
+        .nwords = nwords,
+        .dynamic = dynamic,
+        .nstages = pl->nstages,
+        .bg = pl->bg,
+        .timed = pl->timed,
+        .timeout = pl->timeout,
+        .kill_after = pl->kill_after,
+        .prefix = pl->prefix,
+        .limits = pl->limits != NULL ? malloc(limits_size(pl->limits)) : NULL,
+        .shape = malloc(nshape * sizeof(int)),
+    };
+    if (c.line == NULL || c.segs == NULL || c.shape == NULL || (pl->limits != NULL && c.limits == NULL)) {
+        cache_free(&c);
+        return;
+    }
+    memcpy(c.line, line, len);
+    memcpy(c.segs, lx->segs, lx->nsegs * sizeof *lx->segs);
+    if (pl->limits != NULL) memcpy(c.limits, pl->limits, limits_size(pl->limits));
+    int *shape = c.shape;
+    for (int s = 0; s < pl->nstages; s++) {
+        const struct command *cmd = &pl->stages[s];
+        *shape++ = cmd->nredirs;
+        for (int r = 0; r < cmd->nredirs; r++) {
+            const struct redir *rd = &cmd->redirs[r];
+            *shape++ = rd->fd;
+            *shape++ = rd->op;
+            *shape++ = rd->flags;
+            *shape++ = rd->src;
+            *shape++ = word_index(orig, nwords, rd->path);
+        }
+        *shape++ = word_index(orig, nwords, cmd->here_doc);
+        *shape++ = word_index(orig, nwords, cmd->here_string);
+        for (char **arg = cmd->argv; *arg != NULL; arg++) *shape++ = word_index(orig, nwords, *arg);
+        *shape++ = -1;
+    }
+
+    struct cached_line *slot = &cache_table[c.hash & (LINE_CACHE_SLOTS - 1)];
+    cache_free(slot);
+    *slot = c;
+}
+
+/*
+* Function for the builtin command cache.
+*   cache       print the hit / miss counters, the hit rate and the number of cached lines,
+*               and the same for the directories cached for glob patterns
+*   cache -r    forget every cached line and directory and reset the counters
+* Returns 0, or 2 for an unknown option.
+*/
+int builtin_cache(char **argv)
+{
+    if (argv[1] != NULL && strcmp(argv[1], "-r") == 0) {
+        line_cache_clear();
+        cache_hits = cache_misses = 0;
+        glob_cache_reset();
+        return 0;
+    }
+    if (argv[1] != NULL) {
+        fprintf(stderr, "cache: usage: cache [-r]\n");
+        return 2;
+    }
+    size_t entries = 0;
+    for (size_t i = 0; cache_table != NULL && i < LINE_CACHE_SLOTS; i++) entries += cache_table[i].line != NULL;
+    unsigned long total = cache_hits + cache_misses;
+    printf("hits %lu misses %lu hit rate %.1f%% lines %zu\n", cache_hits, cache_misses,
+           total ? 100.0 * cache_hits / total : 0.0, entries);
+    glob_cache_print();
+    return 0;
+}
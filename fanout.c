@@ -0,0 +1,331 @@
+/* Output fan-out.
+* A command whose stdout is redirected to more than one file ("cmd > a >> b")
+* writes to all of them, as with zsh's MULTIOS, without a tee process per file.
+* The shell opens the files itself and gives the command the write end of a
+* pipe. What arrives in the pipe is duplicated inside the kernel: tee(2) copies
+* it into a spare pipe that is spliced into each file but the last, and the
+* last takes it straight out of the pipe with splice(2), so no byte is copied
+* through user space. The shell moves the data of a foreground job itself, the
+* pipe sits in the job table's epoll set and is pumped whenever the shell
+* waits; a background job, which may outlive the shell, gets one forked pump
+* that is a background job of its own.
+* A builtin writes into a memfd instead, copied to each file with sendfile() once it returns.
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#define FANOUT_PIPE_SIZE (1 << 20)  // asked for both pipes, the kernel may give less
+
+struct fanout {
+    struct fanout *next;   // the fan-outs the shell is pumping
+    int in;                // read end of the command's pipe, or a builtin's memfd
+    int spare[2];          // pipe tee() copies into, -1 for a builtin
+    int nouts;
+    int outs[];            // the files, -1 once writing to one has failed
+};
+
+static struct fanout *pumping = NULL;
+
+/* Function to count the files a command's stdout is redirected to */
+int fanout_targets(const struct command *cmd)
+{
+    int n = 0;
+    for (int i = 0; i < cmd->nredirs; i++) {
+        const struct redir *r = &cmd->redirs[i];
+        n += r->fd == 1 && r->op == REDIR_OPEN && r->flags != O_RDONLY;
+    }
+    return n;
+}
+
+/* Function to close everything a fan-out holds and free it */
+static void fanout_free(struct fanout *f)
+{
+    if (f->in >= 0) close(f->in);
+    if (f->spare[0] >= 0) close(f->spare[0]);
+    if (f->spare[1] >= 0) close(f->spare[1]);
+    for (int i = 0; i < f->nouts; i++) {
+        if (f->outs[i] >= 0) close(f->outs[i]);
+    }
+    free(f);
+}
+
+/*
+* Function to open the files cmd's stdout is redirected to, and replace the
+* first of those steps with one that hands the command fd (the others are dropped).
+* Returns the fan-out holding the files, or NULL if one could not be opened (which has been reported).
+*/
+static struct fanout *fanout_open(struct command *cmd, int fd)
+{
+    struct fanout *f = calloc(1, sizeof *f + fanout_targets(cmd) * sizeof(int));
+    if (f == NULL) {
+        perror("memory allocation error");
+        return NULL;
+    }
+    f->in = f->spare[0] = f->spare[1] = -1;
+    int kept = 0;
+    for (int i = 0; i < cmd->nredirs; i++) {
+        struct redir *r = &cmd->redirs[i];
+        if (r->fd == 1 && r->op == REDIR_OPEN && r->flags != O_RDONLY) {
+            int out = open(r->path, r->flags | O_CLOEXEC, REDIR_MODE);
+            if (out == -1) {
+                fprintf(stderr, "%s: %s\n", r->path, strerror(errno));
+                fanout_free(f);
+                return NULL;
+            }
+            f->outs[f->nouts++] = out;
+            if (f->nouts > 1) continue;
+            *r = (struct redir) { 1, REDIR_PASS, 0, fd, NULL };
+        }
+        cmd->redirs[kept++] = *r;
+    }
+    cmd->nredirs = kept;
+    return f;
+}
+
+/* Function to stop writing to a file that failed */
+static void fanout_drop(int *out)
+{
+    perror("smallsh: fan-out write failed");
+    close(*out);
+    *out = -1;
+}
+
+/*
+* Function to write n bytes of the pipe src into *out, through a buffer where
+* splice() can't write (an O_APPEND file on older kernels). A file that fails
+* is dropped and its share of the pipe is read and thrown away.
+*/
+static void fanout_write(int src, int *out, size_t n)
+{
+    char buf[65536];
+    while (n > 0) {
+        size_t want = n < sizeof buf ? n : sizeof buf;
+        ssize_t m = -1;
+        if (*out >= 0) {
+            m = splice(src, NULL, *out, NULL, n, SPLICE_F_MOVE);
+            if (m == -1 && errno == EINVAL) {
+                m = read(src, buf, want);
+                for (ssize_t done = 0, w; m > 0 && done < m; done += w) {
+                    w = write(*out, buf + done, m - done);
+                    if (w == -1) {
+                        fanout_drop(out);
+                        break;
+                    }
+                }
+            } else if (m == -1) {
+                fanout_drop(out);
+            }
+        }
+        if (m == -1) m = read(src, buf, want);
+        if (m <= 0) return;
+        n -= m;
+    }
+}
+
+/*
+* Function to move what is waiting in f's pipe into every file, waiting for data
+* unless flags has SPLICE_F_NONBLOCK. Each file but the last gets a tee() of the
+* same bytes through the spare pipe, which is empty again after every splice,
+* and the last takes them out of the pipe.
+* Returns the bytes moved, 0 at the end of the output, or -1 if none were ready.
+*/
+static ssize_t fanout_move(struct fanout *f, unsigned flags)
+{
+    ssize_t n = tee(f->in, f->spare[1], INT_MAX, flags);
+    if (n == -1) return errno == EAGAIN ? -1 : 0;
+    if (n == 0) return 0;
+    for (int i = 0; i < f->nouts - 1; i++) {
+        // the spare pipe holds no less than the first tee() put in it, so this copies all n
+        if (i > 0 && tee(f->in, f->spare[1], n, 0) != n) return 0;
+        fanout_write(f->spare[0], &f->outs[i], n);
+    }
+    fanout_write(f->in, &f->outs[f->nouts - 1], n);
+    return n;
+}
+
+static int compare_fd(const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+/*
+* Function to close every fd of a forked pump but stderr and f's own, so it
+* doesn't hold the pipes of the other stages open (they would never see EOF or SIGPIPE).
+*/
+static void fanout_close_others(const struct fanout *f)
+{
+    int keep[f->nouts + 4], n = 0;
+    keep[n++] = 2;
+    keep[n++] = f->in;
+    keep[n++] = f->spare[0];
+    keep[n++] = f->spare[1];
+    for (int i = 0; i < f->nouts; i++) keep[n++] = f->outs[i];
+    qsort(keep, n, sizeof keep[0], compare_fd);
+    unsigned int from = 0;
+    for (int i = 0; i < n; i++) {
+        if ((unsigned int) keep[i] > from) close_range(from, keep[i] - 1, 0);
+        from = keep[i] + 1;
+    }
+    close_range(from, ~0U, 0);
+}
+
+/*
+* Function to set up the fan-out of a launched command with more than one stdout file.
+* Its stdout becomes a pipe whose write end is returned, to be closed once the command
+* is launched. A foreground command's pipe is pumped by the shell while it waits,
+* a background command gets a forked pump that runs until the output ends.
+* Returns -1 if a file could not be opened or the pipe set up (which has been reported).
+*/
+int fanout_start(struct command *cmd, int bg)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe() failed");
+        return -1;
+    }
+    struct fanout *f = fanout_open(cmd, fds[1]);
+    if (f == NULL) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    f->in = fds[0];
+    if (pipe2(f->spare, O_CLOEXEC) == -1) {
+        perror("pipe() failed");
+        f->spare[0] = f->spare[1] = -1;
+        fanout_free(f);
+        close(fds[1]);
+        return -1;
+    }
+    // bigger pipes mean fewer rounds, best effort
+    fcntl(f->in, F_SETPIPE_SZ, FANOUT_PIPE_SIZE);
+    fcntl(f->spare[1], F_SETPIPE_SZ, FANOUT_PIPE_SIZE);
+
+    if (bg) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork() failed");
+            fanout_free(f);
+            close(fds[1]);
+            return -1;
+        }
+        if (pid == 0) {  // the pump
+            fanout_close_others(f);
+            signal(SIGPIPE, SIG_IGN);
+            while (fanout_move(f, 0) > 0) {}
+            _exit(0);
+        }
+        // a helper job, so wait and exit cover the output still being written
+        job_add(pid, JOB_HELPER, "fan-out");
+        fanout_free(f);  // the pump has its own copies
+        return fds[1];
+    }
+    fcntl(f->in, F_SETFL, O_NONBLOCK);
+    f->next = pumping;
+    pumping = f;
+    jobs_watch_fd(f->in);
+    return fds[1];
+}
+
+/* Function to stop pumping f once its output has ended */
+static void fanout_finish(struct fanout *f)
+{
+    struct fanout **p = &pumping;
+    while (*p != f) p = &(*p)->next;
+    *p = f->next;
+    jobs_unwatch_fd(f->in);
+    fanout_free(f);
+}
+
+/* Function to move what is ready in f, a write to a closed pipe is reported as a failed file */
+static void fanout_pump_one(struct fanout *f)
+{
+    sigset_t pipe_mask, old;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_mask, &old);
+    ssize_t n;
+    while ((n = fanout_move(f, SPLICE_F_NONBLOCK)) > 0) {}
+    // a blocked SIGPIPE stays pending, take it before it can kill the shell
+    struct timespec zero = {0};
+    while (sigtimedwait(&pipe_mask, NULL, &zero) == SIGPIPE) {}
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (n == 0) fanout_finish(f);
+}
+
+/*
+* Function to pump the fan-out reading fd, for the job table's wait loop.
+* Returns 1 if fd belongs to a fan-out, 0 otherwise.
+*/
+int fanout_pump(int fd)
+{
+    for (struct fanout *f = pumping; f != NULL; f = f->next) {
+        if (f->in == fd) {
+            fanout_pump_one(f);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+* Function to move what is left of the foreground fan-outs once their commands
+* have finished. A fan-out whose pipe is still held open (by a process the command left behind) stays.
+*/
+void fanout_drain(void)
+{
+    struct fanout *f = pumping;
+    while (f != NULL) {
+        struct fanout *next = f->next;
+        fanout_pump_one(f);
+        f = next;
+    }
+}
+
+/*
+* Function to set up the fan-out of a builtin with more than one stdout file:
+* its stdout becomes a memfd, copied to every file by fanout_release().
+* Returns NULL if a file or the memfd could not be opened (which has been reported).
+*/
+struct fanout *fanout_capture(struct command *cmd)
+{
+    int fd = memfd_create("smallsh-fanout", MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("memfd_create() failed");
+        return NULL;
+    }
+    struct fanout *f = fanout_open(cmd, fd);
+    if (f == NULL) {
+        close(fd);
+        return NULL;
+    }
+    f->in = fd;
+    return f;
+}
+
+/* Function to copy what a builtin wrote into every file of its fan-out and free it */
+void fanout_release(struct fanout *f)
+{
+    off_t len = lseek(f->in, 0, SEEK_CUR);  // the builtin's writes moved the shared offset
+    char buf[65536];
+    for (int i = 0; i < f->nouts; i++) {
+        off_t off = 0;
+        while (off < len) {
+            ssize_t n = sendfile(f->outs[i], f->in, &off, len - off);
+            if (n == -1 && errno == EINVAL) {  // an O_APPEND file, copied through buf
+                n = pread(f->in, buf, len - off < (off_t)sizeof buf ? len - off : (off_t)sizeof buf, off);
+                if (n > 0) n = write(f->outs[i], buf, n);
+                if (n > 0) off += n;
+            }
+            if (n <= 0) {
+                perror("smallsh: fan-out write failed");
+                break;
+            }
+        }
+    }
+    fanout_free(f);
+}
@@ -0,0 +1,527 @@
+/* Control flow: for, while, until and if.
+* A line that holds ";" or starts with a keyword is split into commands at
+* ";" and parsed into a tree; a compound command left open at the end of the
+* line reads more lines until it is closed. The tree is parsed once and then
+* walked, so a loop body is not parsed again on every iteration. Each simple
+* command in it is run with execute_line(), where it hits the line cache after
+* the first iteration and uses the same builtins and launch path as any other line.
+*
+*   for NAME in words; do list; done
+*   while list; do list; done       until list; do list; done
+*   if list; then list; [elif list; then list;] ... [else list;] fi
+*   break, continue
+*
+* The body lines of a "<<" here-document are read here too, right after the
+* command that has it, and appended to its text for lex_line() to expand.
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+
+enum { KW_NONE, KW_FOR, KW_WHILE, KW_UNTIL, KW_IF, KW_THEN, KW_ELIF, KW_ELSE, KW_FI,
+       KW_DO, KW_DONE, KW_BREAK, KW_CONTINUE };
+
+static const char *const keywords[] = {
+    [KW_FOR] = "for", [KW_WHILE] = "while", [KW_UNTIL] = "until", [KW_IF] = "if",
+    [KW_THEN] = "then", [KW_ELIF] = "elif", [KW_ELSE] = "else", [KW_FI] = "fi",
+    [KW_DO] = "do", [KW_DONE] = "done", [KW_BREAK] = "break", [KW_CONTINUE] = "continue",
+};
+#define NKEYWORDS (sizeof keywords / sizeof keywords[0])
+
+enum { NODE_CMD, NODE_FOR, NODE_WHILE, NODE_UNTIL, NODE_IF, NODE_BREAK, NODE_CONTINUE };
+
+// A command in the tree, commands of a list are chained through next
+struct node {
+    int type;
+    char *text;              // NODE_CMD: the command line, NODE_FOR: the words after "in"
+    size_t len;
+    char *name;              // NODE_FOR: the loop variable
+    struct node *cond;       // NODE_WHILE, NODE_UNTIL, NODE_IF: the list that is tested
+    struct node *body;       // loop body, or the branch taken when cond succeeds
+    struct node *else_body;  // NODE_IF: the other branch, an elif is a nested NODE_IF
+    struct node *next;
+};
+
+// Parser state: the line being split into commands, and where more lines come from
+struct flow_parser {
+    const unsigned char *is_delim;
+    char *buf;               // copy of the current line
+    size_t len, cap;
+    size_t pos;              // first byte not parsed yet
+    int depth;               // open compound commands, more lines are read while > 0
+    flow_more_fn more;
+    void *arg;
+    int error;               // FLOW_SYNTAX, FLOW_NOMEM or FLOW_INTR once parsing has failed
+};
+
+// Results of parsing and of running a list
+enum { FLOW_NEXT, FLOW_BREAK, FLOW_CONTINUE, FLOW_INTR, FLOW_NOMEM, FLOW_SYNTAX };
+
+static volatile sig_atomic_t flow_interrupted = 0;
+
+static void handle_flow_SIGINT(int signo)
+{
+    (void) signo;
+    flow_interrupted = 1;
+}
+
+/* Function to free a list and everything under it */
+static void node_free(struct node *n)
+{
+    while (n != NULL) {
+        struct node *next = n->next;
+        free(n->text);
+        free(n->name);
+        node_free(n->cond);
+        node_free(n->body);
+        node_free(n->else_body);
+        free(n);
+        n = next;
+    }
+}
+
+/* Function to make the parser's current line a copy of line[0..len) */
+static int parser_load(struct flow_parser *p, const char *line, size_t len)
+{
+    if (len > p->cap) {
+        char *buf = realloc(p->buf, len);
+        if (buf == NULL) return -1;
+        p->buf = buf;
+        p->cap = len;
+    }
+    memcpy(p->buf, line, len);
+    p->len = len;
+    p->pos = 0;
+    return 0;
+}
+
+/*
+* Function to move to the start of the next command, reading more lines while
+* a compound command is open.
+* Returns 1 if there is a command, 0 at the end of the input (p->error is set
+* if that was too early).
+*/
+static int next_command(struct flow_parser *p)
+{
+    for (;;) {
+        while (p->pos < p->len && (p->is_delim[(unsigned char) p->buf[p->pos]] || p->buf[p->pos] == ';')) p->pos++;
+        if (p->pos < p->len && p->buf[p->pos] != '#') return 1;
+        if (p->depth == 0) return 0;
+
+        const char *line;
+        ssize_t len = p->more != NULL ? p->more(p->arg, &line) : INPUT_EOF;
+        if (len == INPUT_INTR) {
+            p->error = FLOW_INTR;
+            return 0;
+        }
+        if (len == INPUT_EOF) {
+            fprintf(stderr, "smallsh: syntax error: unexpected end of file\n");
+            p->error = FLOW_SYNTAX;
+            return 0;
+        }
+        if (parser_load(p, line, len) == -1) {
+            p->error = FLOW_NOMEM;
+            return 0;
+        }
+    }
+}
+
+/* Function to measure the word at p->pos, returning its keyword or KW_NONE */
+static int command_keyword(const struct flow_parser *p, size_t *word_len)
+{
+    size_t end = p->pos;
+    while (end < p->len && !p->is_delim[(unsigned char) p->buf[end]] && p->buf[end] != ';') end++;
+    *word_len = end - p->pos;
+    for (size_t k = 1; k < NKEYWORDS; k++) {
+        if (strlen(keywords[k]) == *word_len && memcmp(keywords[k], p->buf + p->pos, *word_len) == 0) return k;
+    }
+    return KW_NONE;
+}
+
+/*
+* Function to append the here-document bodies of the command in *text to it:
+* a newline, then lines from more up to and including each delimiter. A body
+* left open at the end of the input ends there. *text must be malloc'd.
+* Returns FLOW_NEXT, FLOW_NOMEM or FLOW_INTR.
+*/
+static int heredoc_gather(const unsigned char *is_delim, flow_more_fn more, void *arg, char **text, size_t *len)
+{
+    struct lex_seg docs[LEX_HEREDOC_MAX];
+    int ndocs = lex_heredocs(is_delim, *text, *len, docs);
+    size_t cap = *len + 1;
+
+    for (int d = 0; d < ndocs; d++) {
+        for (;;) {
+            const char *line;
+            ssize_t n = more != NULL ? more(arg, &line) : INPUT_EOF;
+            if (n == INPUT_INTR) return FLOW_INTR;
+            int eof = n == INPUT_EOF;
+            if (eof) {  // the newline ends the last body line
+                fprintf(stderr, "smallsh: warning: here-document ended by end of file (wanted \"%.*s\")\n",
+                        (int) docs[d].len, *text + docs[d].off);
+                line = "";
+                n = 0;
+            }
+            if (*len + n + 2 > cap) {
+                while (*len + n + 2 > cap) cap *= 2;
+                char *grown = realloc(*text, cap);
+                if (grown == NULL) return FLOW_NOMEM;
+                *text = grown;
+            }
+            (*text)[(*len)++] = '\n';
+            memcpy(*text + *len, line, n);
+            *len += n;
+            (*text)[*len] = '\0';
+            if (eof) return FLOW_NEXT;
+            if ((size_t) n == docs[d].len && memcmp(line, *text + docs[d].off, n) == 0) break;
+        }
+    }
+    return FLOW_NEXT;
+}
+
+/* Function to take the rest of the command at p->pos, up to ";" or a comment, as a string */
+static char *take_command(struct flow_parser *p, size_t *len)
+{
+    size_t start = p->pos, end = start;
+    while (end < p->len && p->buf[end] != ';') {
+        if (p->buf[end] == '#' && (end == start || p->is_delim[(unsigned char) p->buf[end - 1]])) break;
+        end++;
+    }
+    p->pos = end < p->len && p->buf[end] == '#' ? p->len : end;
+    while (end > start && p->is_delim[(unsigned char) p->buf[end - 1]]) end--;
+
+    char *text = malloc(end - start + 1);
+    if (text == NULL) {
+        p->error = FLOW_NOMEM;
+        return NULL;
+    }
+    memcpy(text, p->buf + start, end - start);
+    text[end - start] = '\0';
+    *len = end - start;
+    return text;
+}
+
+/* Function to skip the delimiters after a keyword */
+static void skip_keyword(struct flow_parser *p, size_t word_len)
+{
+    p->pos += word_len;
+    while (p->pos < p->len && p->is_delim[(unsigned char) p->buf[p->pos]]) p->pos++;
+}
+
+static struct node *parse_list(struct flow_parser *p, unsigned stop, int *stopped_by);
+
+/* Function to parse a list that has to be ended by one of the stop keywords, want names them in errors */
+static struct node *parse_until(struct flow_parser *p, unsigned stop, int *stopped_by, const char *want)
+{
+    struct node *list = parse_list(p, stop, stopped_by);
+    if (!p->error && *stopped_by == KW_NONE) {
+        fprintf(stderr, "smallsh: syntax error: missing \"%s\"\n", want);
+        p->error = FLOW_SYNTAX;
+    }
+    return list;
+}
+
+/* Function to parse the rest of "for NAME in words; do list; done" */
+static int parse_for(struct flow_parser *p, struct node *n)
+{
+    size_t word_len;
+    int stopped_by;
+
+    command_keyword(p, &word_len);
+    if (word_len == 0 || !var_name_ok(p->buf + p->pos, word_len)) {
+        fprintf(stderr, "smallsh: syntax error: \"for\" needs a variable name\n");
+        return FLOW_SYNTAX;
+    }
+    n->name = strndup(p->buf + p->pos, word_len);
+    if (n->name == NULL) return FLOW_NOMEM;
+    skip_keyword(p, word_len);
+    command_keyword(p, &word_len);
+    if (word_len != 2 || memcmp(p->buf + p->pos, "in", 2) != 0) {
+        fprintf(stderr, "smallsh: syntax error: expected \"in\" after \"for %s\"\n", n->name);
+        return FLOW_SYNTAX;
+    }
+    skip_keyword(p, word_len);
+    n->text = take_command(p, &n->len);
+    if (n->text == NULL) return FLOW_NOMEM;
+
+    if (!next_command(p) || command_keyword(p, &word_len) != KW_DO) {
+        if (!p->error) fprintf(stderr, "smallsh: syntax error: missing \"do\" after \"for\"\n");
+        return p->error ? p->error : FLOW_SYNTAX;
+    }
+    skip_keyword(p, word_len);
+    n->body = parse_until(p, 1u << KW_DONE, &stopped_by, "done");
+    return p->error;
+}
+
+/* Function to parse the rest of an if or elif: "list; then list; ... fi" */
+static int parse_if(struct flow_parser *p, struct node *n)
+{
+    int stopped_by;
+
+    n->type = NODE_IF;
+    n->cond = parse_until(p, 1u << KW_THEN, &stopped_by, "then");
+    if (p->error) return p->error;
+    n->body = parse_until(p, 1u << KW_ELIF | 1u << KW_ELSE | 1u << KW_FI, &stopped_by, "fi");
+    if (p->error) return p->error;
+    if (stopped_by == KW_ELIF) {
+        n->else_body = calloc(1, sizeof *n->else_body);
+        if (n->else_body == NULL) return FLOW_NOMEM;
+        return parse_if(p, n->else_body);
+    }
+    if (stopped_by == KW_ELSE) n->else_body = parse_until(p, 1u << KW_FI, &stopped_by, "fi");
+    return p->error;
+}
+
+/*
+* Function to parse commands until one starts with a keyword in the stop set
+* (a bit per keyword), which is consumed and returned in *stopped_by. At the
+* end of the input *stopped_by is KW_NONE. Errors are left in p->error.
+*/
+static struct node *parse_list(struct flow_parser *p, unsigned stop, int *stopped_by)
+{
+    struct node *head = NULL, **tail = &head;
+    size_t word_len;
+    int stopped;
+
+    *stopped_by = KW_NONE;
+    while (next_command(p)) {
+        int kw = command_keyword(p, &word_len);
+        if (kw != KW_NONE && (stop & 1u << kw)) {
+            skip_keyword(p, word_len);
+            *stopped_by = kw;
+            return head;
+        }
+
+        struct node *n = calloc(1, sizeof *n);
+        if (n == NULL) {
+            p->error = FLOW_NOMEM;
+            return head;
+        }
+        *tail = n;
+        tail = &n->next;
+
+        if (kw != KW_NONE) skip_keyword(p, word_len);
+        p->depth++;
+        switch (kw) {
+        case KW_NONE:
+            n->type = NODE_CMD;
+            n->text = take_command(p, &n->len);
+            if (n->text != NULL && memmem(n->text, n->len, "<<", 2) != NULL) {
+                int err = heredoc_gather(p->is_delim, p->more, p->arg, &n->text, &n->len);
+                if (err != FLOW_NEXT) p->error = err;
+            }
+            break;
+        case KW_FOR:
+            n->type = NODE_FOR;
+            p->error = parse_for(p, n);
+            break;
+        case KW_WHILE:
+        case KW_UNTIL:
+            n->type = kw == KW_WHILE ? NODE_WHILE : NODE_UNTIL;
+            n->cond = parse_until(p, 1u << KW_DO, &stopped, "do");
+            if (!p->error) n->body = parse_until(p, 1u << KW_DONE, &stopped, "done");
+            break;
+        case KW_IF:
+            p->error = parse_if(p, n);
+            break;
+        case KW_BREAK:
+        case KW_CONTINUE:
+            n->type = kw == KW_BREAK ? NODE_BREAK : NODE_CONTINUE;
+            break;
+        default:
+            fprintf(stderr, "smallsh: syntax error near \"%s\"\n", keywords[kw]);
+            p->error = FLOW_SYNTAX;
+        }
+        p->depth--;
+        if (p->error) return head;
+
+        // nothing but ";" or a comment may follow a compound command
+        if (kw != KW_NONE && p->pos < p->len && p->buf[p->pos] != ';' && p->buf[p->pos] != '#' &&
+            !p->is_delim[(unsigned char) p->buf[p->pos]]) {
+            fprintf(stderr, "smallsh: syntax error: unexpected text after \"%s\"\n",
+                    kw == KW_IF ? "fi" : kw == KW_BREAK || kw == KW_CONTINUE ? keywords[kw] : "done");
+            p->error = FLOW_SYNTAX;
+            return head;
+        }
+    }
+    return head;
+}
+
+static int run_list(struct lexer *lx, struct expand_ctx *ctx, struct node *n);
+
+/* Function to run one simple command of the tree */
+static int run_command(struct lexer *lx, struct expand_ctx *ctx, struct node *n)
+{
+    if (flow_interrupted) return FLOW_INTR;
+    arena_reset(&lx->arena);
+    if (trace_fd >= 0) trace_next();
+    exit_stat = 0;
+    if (execute_line(lx, ctx, n->text, n->len, 0) == -1) return FLOW_NOMEM;
+    // a job killed with ^C stops the loops around it too
+    if (flow_interrupted || (WIFSIGNALED(exit_stat) && WTERMSIG(exit_stat) == SIGINT)) return FLOW_INTR;
+    return FLOW_NEXT;
+}
+
+/* Function to run a for loop: the words are expanded once, then the body runs once per word */
+static int run_for(struct lexer *lx, struct expand_ctx *ctx, struct node *n)
+{
+    int word_count, result = FLOW_NEXT;
+
+    arena_reset(&lx->arena);
+    char **words = lex_line(lx, n->text, n->len, ctx, &word_count);
+    if (words == NULL) return FLOW_NOMEM;
+    // the body reuses the arena, keep the words somewhere else
+    char **list = malloc((word_count + 1) * sizeof *list);
+    if (list == NULL) return FLOW_NOMEM;
+    for (int i = 0; i < word_count; i++) {
+        list[i] = strdup(words[i]);
+        if (list[i] == NULL) {
+            word_count = i;
+            result = FLOW_NOMEM;
+            break;
+        }
+    }
+
+    stat_code = 0;
+    for (int i = 0; i < word_count && result == FLOW_NEXT; i++) {
+        if (var_set(n->name, list[i], 0) == -1) {
+            result = FLOW_NOMEM;
+            break;
+        }
+        result = run_list(lx, ctx, n->body);
+        if (result == FLOW_CONTINUE) result = FLOW_NEXT;
+        if (result == FLOW_BREAK) {
+            result = FLOW_NEXT;
+            break;
+        }
+    }
+    for (int i = 0; i < word_count; i++) free(list[i]);
+    free(list);
+    return result;
+}
+
+/* Function to run a while (or, with until set, an until) loop */
+static int run_while(struct lexer *lx, struct expand_ctx *ctx, struct node *n, int until)
+{
+    int status = 0, result;
+
+    for (;;) {
+        result = run_list(lx, ctx, n->cond);
+        if (result != FLOW_NEXT) break;
+        if ((stat_code == 0) == until) break;
+        result = run_list(lx, ctx, n->body);
+        status = stat_code;
+        if (result == FLOW_CONTINUE) continue;
+        if (result != FLOW_NEXT) break;
+    }
+    stat_code = status;
+    return result == FLOW_BREAK || result == FLOW_CONTINUE ? FLOW_NEXT : result;
+}
+
+/*
+* Function to walk a list, running each command in turn. $? is left as the
+* status of the last command run.
+* Returns FLOW_NEXT, or FLOW_BREAK / FLOW_CONTINUE / FLOW_INTR / FLOW_NOMEM to unwind.
+*/
+static int run_list(struct lexer *lx, struct expand_ctx *ctx, struct node *n)
+{
+    for (; n != NULL; n = n->next) {
+        int result = FLOW_NEXT;
+        switch (n->type) {
+        case NODE_CMD:
+            result = run_command(lx, ctx, n);
+            break;
+        case NODE_FOR:
+            result = run_for(lx, ctx, n);
+            break;
+        case NODE_WHILE:
+        case NODE_UNTIL:
+            result = run_while(lx, ctx, n, n->type == NODE_UNTIL);
+            break;
+        case NODE_IF:
+            result = run_list(lx, ctx, n->cond);
+            if (result != FLOW_NEXT) break;
+            if (stat_code == 0) result = run_list(lx, ctx, n->body);
+            else if (n->else_body != NULL) result = run_list(lx, ctx, n->else_body);
+            else stat_code = 0;
+            break;
+        case NODE_BREAK:
+        case NODE_CONTINUE:
+            stat_code = 0;
+            return n->type == NODE_BREAK ? FLOW_BREAK : FLOW_CONTINUE;
+        }
+        if (result != FLOW_NEXT) return result;
+    }
+    return FLOW_NEXT;
+}
+
+/* Function to check whether a line needs the control flow parser, or is a single command */
+static int is_simple(const unsigned char *is_delim, const char *line, size_t len)
+{
+    size_t i = 0;
+    while (i < len && is_delim[(unsigned char) line[i]]) i++;
+    size_t end = i;
+    while (end < len && !is_delim[(unsigned char) line[end]] && line[end] != ';') end++;
+    for (size_t k = 1; k < NKEYWORDS; k++) {
+        if (strlen(keywords[k]) == end - i && memcmp(keywords[k], line + i, end - i) == 0) return 0;
+    }
+    // a ";" in a comment doesn't count
+    for (; end < len && line[end] != ';'; end++) {
+        if (line[end] == '#' && is_delim[(unsigned char) line[end - 1]]) return 1;
+    }
+    return end == len;
+}
+
+/*
+* Function to run a line that may hold several commands separated by ";" and
+* compound commands. A compound command left open at the end of the line is
+* completed with lines from more (which may be NULL). A line that is just one
+* simple command goes straight to execute_line().
+* Returns 0, or -1 if memory could not be allocated.
+*/
+int execute_list(struct lexer *lx, struct expand_ctx *ctx, const char *line, size_t len, int exec_last,
+                 flow_more_fn more, void *arg)
+{
+    if (is_simple(lx->is_delim, line, len)) {
+        if (memmem(line, len, "<<", 2) == NULL) return execute_line(lx, ctx, line, len, exec_last);
+        // reading the here-document bodies may move the line in the input buffer
+        char *text = strndup(line, len);
+        if (text == NULL) return -1;
+        int err = heredoc_gather(lx->is_delim, more, arg, &text, &len);
+        int result = err == FLOW_NOMEM ? -1 : 0;
+        if (err == FLOW_NEXT) result = execute_line(lx, ctx, text, len, 0);
+        free(text);
+        return result;
+    }
+
+    struct flow_parser p = { .is_delim = lx->is_delim, .more = more, .arg = arg };
+    int stopped_by;
+    if (parser_load(&p, line, len) == -1) return -1;
+    struct node *tree = parse_list(&p, 0, &stopped_by);
+    free(p.buf);
+    if (p.error == FLOW_NOMEM) {
+        node_free(tree);
+        return -1;
+    }
+    if (p.error) {
+        if (p.error == FLOW_SYNTAX) stat_code = 2;
+        node_free(tree);
+        return 0;
+    }
+    if (trace_fd >= 0) trace_mark(TRACE_READ);  // every line of the compound is in
+
+    // the shell ignores SIGINT while it runs commands, catch it so ^C can stop a loop of builtins
+    struct sigaction flow_action = { .sa_handler = handle_flow_SIGINT, .sa_flags = SA_RESTART }, old_action;
+    sigaction(SIGINT, NULL, &old_action);
+    int catch = old_action.sa_handler == SIG_IGN;
+    if (catch) sigaction(SIGINT, &flow_action, NULL);
+    flow_interrupted = 0;
+
+    int result = run_list(lx, ctx, tree);
+
+    if (catch) sigaction(SIGINT, &old_action, NULL);
+    if (result == FLOW_INTR && flow_interrupted) fprintf(stderr, "\n");
+    flow_interrupted = 0;
+    node_free(tree);
+    return result == FLOW_NOMEM ? -1 : 0;
+}
@@ -0,0 +1,554 @@
+/* Pathname expansion.
+* A word with "*", "?" or "[...]" in its literal text is matched against the
+* file names it describes, one path component at a time. Each component is
+* compiled once into a token list with its fixed prefix and suffix pulled out,
+* so most names are rejected by a memcmp. Directories are read with large
+* getdents64() calls into a packed list of names and their d_type, and the
+* lists are kept, sorted, in a small cache keyed by device, inode and mtime, so
+* a script that globs the same directory again neither reads it again nor has
+* to sort what matched.
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+#include <dirent.h>
+#include <sys/syscall.h>
+
+#define GLOB_READ_BUF    (1 << 20)         // bytes asked of each getdents64() call
+#define GLOB_CACHE_DIRS  16                // directories kept in the cache
+#define GLOB_CACHE_BYTES (64 << 20)        // total size of the cached name lists
+#define GLOB_RACY_SECS   2                 // a directory changed this recently may change again unseen
+
+enum { TOK_CHAR, TOK_ANY, TOK_STAR, TOK_CLASS };
+
+struct glob_tok {
+    unsigned char type;
+    unsigned char c;           // TOK_CHAR
+    unsigned char set[32];     // TOK_CLASS: bit per byte value
+};
+
+// One compiled path component
+struct glob_pat {
+    struct glob_tok *toks;
+    size_t ntoks;
+    size_t min_len;            // tokens that consume a byte
+    const char *prefix;        // literal bytes every match starts with
+    size_t prefix_len;
+    const char *suffix;        // literal bytes every match ends with (after the last "*")
+    size_t suffix_len;
+    int star;                  // 1 if there is a "*"
+    int dot;                   // 1 if the pattern starts with ".", so it may match hidden files
+};
+
+// A directory's entries packed as [d_type][name]\0 ...
+struct dir_list {
+    char *buf;
+    size_t len, cap;
+};
+
+struct dir_cache_entry {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct dir_list list;      // list.buf is NULL if the slot is empty
+    int sorted;                // sorted on its first hit, a directory globbed once never is
+    unsigned long used;        // for least recently used eviction
+};
+
+// The linux_dirent64 records getdents64() returns
+struct dirent64_rec {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static struct dir_cache_entry dir_cache[GLOB_CACHE_DIRS];
+static size_t dir_cache_bytes = 0;
+static unsigned long dir_cache_clock = 0;
+static unsigned long dir_hits = 0, dir_scans = 0;
+static char *read_buf = NULL;
+
+// State of one expansion
+struct glob_state {
+    struct arena *arena;
+    char *path;                // the directory being matched in, built up a component at a time
+    size_t path_cap;
+    size_t nmatches;
+    int failed;                // memory could not be allocated
+};
+
+static char **glob_results = NULL;   // returned by glob_expand(), reused between calls
+static size_t glob_results_cap = 0;
+
+/*
+* Function to check whether s[0..len) holds a glob character. As in
+* pat_compile(), a "[" only counts when a "]" closes it in the same component.
+*/
+int glob_has_magic(const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '*' || s[i] == '?') return 1;
+        if (s[i] != '[') continue;
+        size_t j = i + 1;
+        if (j < len && (s[j] == '!' || s[j] == '^')) j++;
+        size_t first = j;
+        while (j < len && s[j] != '/' && (s[j] != ']' || j == first)) j++;
+        if (j < len && s[j] == ']') return 1;
+    }
+    return 0;
+}
+
+/*
+* Function to compile the component s[0..len) into pat. A "[" without a closing
+* "]" is an ordinary character. Returns 1 if the component has a glob token,
+* 0 if it is plain text, -1 if memory could not be allocated.
+*/
+static int pat_compile(struct glob_pat *pat, const char *s, size_t len)
+{
+    memset(pat, 0, sizeof *pat);
+    pat->toks = malloc((len ? len : 1) * sizeof *pat->toks);
+    if (pat->toks == NULL) return -1;
+    pat->dot = len > 0 && s[0] == '.';
+
+    int magic = 0;
+    for (size_t i = 0; i < len; i++) {
+        struct glob_tok *t = &pat->toks[pat->ntoks++];
+        t->type = TOK_CHAR;
+        t->c = s[i];
+        if (s[i] == '?') {
+            t->type = TOK_ANY;
+        } else if (s[i] == '*') {
+            t->type = TOK_STAR;
+            if (pat->ntoks > 1 && t[-1].type == TOK_STAR) pat->ntoks--;  // "**" is "*"
+        } else if (s[i] == '[') {
+            size_t j = i + 1;
+            int negate = j < len && (s[j] == '!' || s[j] == '^');
+            if (negate) j++;
+            size_t first = j;
+            while (j < len && (s[j] != ']' || j == first)) j++;  // a "]" right after "[" is part of the set
+            if (j == len) continue;  // no closing "]", just a "["
+            memset(t->set, 0, sizeof t->set);
+            for (size_t k = first; k < j; k++) {
+                unsigned char lo = s[k], hi = lo;
+                if (k + 2 < j && s[k + 1] == '-') {
+                    hi = s[k + 2];
+                    k += 2;
+                }
+                for (unsigned c = lo; c <= hi; c++) t->set[c >> 3] |= 1 << (c & 7);
+            }
+            if (negate) {
+                for (size_t k = 0; k < sizeof t->set; k++) t->set[k] = ~t->set[k];
+            }
+            t->type = TOK_CLASS;
+            i = j;
+        }
+        if (t->type != TOK_CHAR) magic = 1;
+    }
+
+    // the literal runs at either end let most names be rejected without running the matcher
+    size_t i = 0;
+    while (i < pat->ntoks && pat->toks[i].type == TOK_CHAR) i++;
+    pat->prefix = s;
+    pat->prefix_len = i;  // a CHAR token is one byte of s until the first other token
+    for (i = 0; i < pat->ntoks; i++) {
+        if (pat->toks[i].type == TOK_STAR) pat->star = 1;
+        else pat->min_len++;
+    }
+    if (pat->star && pat->toks[pat->ntoks - 1].type == TOK_CHAR) {
+        size_t n = 0;
+        while (n < pat->ntoks && pat->toks[pat->ntoks - 1 - n].type == TOK_CHAR) n++;
+        pat->suffix = s + len - n;  // the tail of s has no "[" or "?", so it is n bytes long
+        pat->suffix_len = n;
+    }
+    return magic;
+}
+
+/* Function to check a token against one byte of a name */
+static int tok_match(const struct glob_tok *t, unsigned char c)
+{
+    switch (t->type) {
+    case TOK_CHAR: return t->c == c;
+    case TOK_ANY: return 1;
+    case TOK_CLASS: return t->set[c >> 3] >> (c & 7) & 1;
+    }
+    return 0;
+}
+
+/* Function to match name[0..len) against a compiled component */
+static int pat_match(const struct glob_pat *pat, const char *name, size_t len)
+{
+    if (name[0] == '.' && !pat->dot) return 0;  // hidden files need a leading "."
+    if (len < pat->min_len || (!pat->star && len != pat->min_len)) return 0;
+    if (memcmp(name, pat->prefix, pat->prefix_len) != 0) return 0;
+    if (pat->suffix_len > 0 && memcmp(name + len - pat->suffix_len, pat->suffix, pat->suffix_len) != 0) return 0;
+
+    // backtrack to the last "*" on a mismatch, letting it take one more byte
+    const struct glob_tok *toks = pat->toks;
+    size_t t = 0, s = 0, star_t = (size_t) -1, star_s = 0;
+    while (s < len) {
+        if (t < pat->ntoks && toks[t].type == TOK_STAR) {
+            star_t = ++t;
+            star_s = s;
+        } else if (t < pat->ntoks && tok_match(&toks[t], name[s])) {
+            t++;
+            s++;
+        } else if (star_t != (size_t) -1) {
+            t = star_t;
+            s = ++star_s;
+        } else {
+            return 0;
+        }
+    }
+    while (t < pat->ntoks && toks[t].type == TOK_STAR) t++;
+    return t == pat->ntoks;
+}
+
+/* Function to append n bytes to a name list, growing it when needed */
+static int list_put(struct dir_list *list, const void *data, size_t n)
+{
+    if (list->len + n > list->cap) {
+        size_t cap = list->cap ? list->cap : 4096;
+        while (cap < list->len + n) cap *= 2;
+        char *buf = realloc(list->buf, cap);
+        if (buf == NULL) return -1;
+        list->buf = buf;
+        list->cap = cap;
+    }
+    memcpy(list->buf + list->len, data, n);
+    list->len += n;
+    return 0;
+}
+
+/* Function to read every entry of the directory fd into list, skipping "." and ".." */
+static int dir_scan(int fd, struct dir_list *list)
+{
+    if (read_buf == NULL && (read_buf = malloc(GLOB_READ_BUF)) == NULL) return -1;
+    dir_scans++;
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, read_buf, GLOB_READ_BUF);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return n == 0 ? 0 : -1;
+        for (long off = 0; off < n;) {
+            struct dirent64_rec *d = (struct dirent64_rec *) (read_buf + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            if (list_put(list, &d->d_type, 1) == -1 || list_put(list, name, strlen(name) + 1) == -1) return -1;
+        }
+    }
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+* Function to sort a name list, so matches taken from it come out in order
+* and don't have to be sorted on every glob. Returns 0, or -1 if memory could not be allocated.
+*/
+static int dir_sort(struct dir_list *list)
+{
+    size_t n = 0;
+    for (size_t off = 0; off < list->len; off += strlen(list->buf + off + 1) + 2) n++;
+    char **names = malloc((n ? n : 1) * sizeof *names);
+    char *buf = malloc(list->cap);
+    if (names == NULL || buf == NULL) {
+        free(names);
+        free(buf);
+        return -1;
+    }
+    n = 0;
+    for (size_t off = 0; off < list->len; off += strlen(list->buf + off + 1) + 2) names[n++] = list->buf + off + 1;
+    qsort(names, n, sizeof *names, compare_names);
+    size_t len = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t size = strlen(names[i]) + 2;
+        memcpy(buf + len, names[i] - 1, size);  // with its d_type byte
+        len += size;
+    }
+    free(names);
+    free(list->buf);
+    list->buf = buf;
+    return 0;
+}
+
+/* Function to empty a cache slot */
+static void dir_cache_drop(struct dir_cache_entry *e)
+{
+    dir_cache_bytes -= e->list.cap;
+    free(e->list.buf);
+    memset(e, 0, sizeof *e);
+}
+
+/*
+* Function to get the entries of the directory path, from the cache while its
+* mtime hasn't changed. A list that isn't kept in the cache is returned in
+* *tmp and has to be freed by the caller.
+* Returns NULL if the directory can't be read (errno is set).
+*/
+static const struct dir_list *dir_read(const char *path, struct dir_list *tmp)
+{
+    struct stat st;
+    if (stat(path, &st) == -1) return NULL;
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+
+    struct dir_cache_entry *slot = &dir_cache[0];
+    for (size_t i = 0; i < GLOB_CACHE_DIRS; i++) {
+        struct dir_cache_entry *e = &dir_cache[i];
+        if (e->list.buf != NULL && e->dev == st.st_dev && e->ino == st.st_ino) {
+            if (e->mtime.tv_sec == st.st_mtim.tv_sec && e->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                e->used = ++dir_cache_clock;
+                dir_hits++;
+                if (!e->sorted) e->sorted = dir_sort(&e->list) == 0;
+                return &e->list;
+            }
+            slot = e;  // changed, scan it again into the same slot
+            break;
+        }
+        if (e->list.buf == NULL || (slot->list.buf != NULL && e->used < slot->used)) slot = e;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    memset(tmp, 0, sizeof *tmp);
+    int err = dir_scan(fd, tmp);
+    close(fd);
+    if (err == -1) {
+        free(tmp->buf);
+        tmp->buf = NULL;
+        return NULL;
+    }
+
+    // an entry added in the same timestamp tick as the mtime we saw wouldn't change it, so
+    // a directory modified moments ago isn't cached (st was taken before the scan, so it's never newer)
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec - st.st_mtim.tv_sec < GLOB_RACY_SECS || tmp->cap > GLOB_CACHE_BYTES) return tmp;
+
+    if (slot->list.buf != NULL) dir_cache_drop(slot);
+    while (dir_cache_bytes + tmp->cap > GLOB_CACHE_BYTES) {  // evict the least recently used
+        struct dir_cache_entry *lru = NULL;
+        for (size_t i = 0; i < GLOB_CACHE_DIRS; i++) {
+            if (dir_cache[i].list.buf != NULL && (lru == NULL || dir_cache[i].used < lru->used)) lru = &dir_cache[i];
+        }
+        dir_cache_drop(lru);
+    }
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtim;
+    slot->list = *tmp;
+    slot->sorted = 0;
+    slot->used = ++dir_cache_clock;
+    dir_cache_bytes += tmp->cap;
+    tmp->buf = NULL;
+    return &slot->list;
+}
+
+/* Function to make room for n more bytes in the path buffer */
+static int path_reserve(struct glob_state *g, size_t n)
+{
+    if (n <= g->path_cap) return 0;
+    size_t cap = g->path_cap ? g->path_cap : 256;
+    while (cap < n) cap *= 2;
+    char *path = realloc(g->path, cap);
+    if (path == NULL) return -1;
+    g->path = path;
+    g->path_cap = cap;
+    return 0;
+}
+
+/* Function to add path[0..len) to the matches, copied into the arena */
+static void add_match(struct glob_state *g, size_t len)
+{
+    if (g->nmatches == glob_results_cap) {
+        size_t cap = glob_results_cap ? glob_results_cap * 2 : 64;
+        char **list = realloc(glob_results, cap * sizeof *list);
+        if (list == NULL) {
+            g->failed = 1;
+            return;
+        }
+        glob_results = list;
+        glob_results_cap = cap;
+    }
+    char *match = arena_alloc(g->arena, len + 1);
+    if (match == NULL) {
+        g->failed = 1;
+        return;
+    }
+    memcpy(match, g->path, len);
+    match[len] = '\0';
+    glob_results[g->nmatches++] = match;
+}
+
+/* Function to check whether the entry path[0..len) of d_type type is a directory */
+static int is_dir(struct glob_state *g, size_t len, unsigned char type)
+{
+    if (type == DT_DIR) return 1;
+    if (type != DT_LNK && type != DT_UNKNOWN) return 0;
+    struct stat st;
+    g->path[len] = '\0';
+    return stat(g->path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+* Function to match the components of rest against the files under the
+* directory path[0..len) (which is empty or ends with "/"), adding each full match.
+*/
+static void glob_dir(struct glob_state *g, size_t len, const char *rest)
+{
+    const char *slash = strchrnul(rest, '/');
+    size_t comp_len = slash - rest;
+    const char *next = NULL;  // the components after this one, "" if the pattern ends with "/"
+    if (*slash == '/') {
+        next = slash;
+        while (*next == '/') next++;
+    }
+
+    struct glob_pat pat;
+    int magic = pat_compile(&pat, rest, comp_len);
+    if (magic == -1) {
+        g->failed = 1;
+        return;
+    }
+
+    if (!magic) {  // plain text, only has to exist
+        if (path_reserve(g, len + comp_len + 2) == -1) {
+            g->failed = 1;
+        } else {
+            memcpy(g->path + len, rest, comp_len);
+            len += comp_len;
+            struct stat st;
+            g->path[len] = '\0';
+            if (next != NULL) {
+                g->path[len++] = '/';
+                if (*next != '\0') glob_dir(g, len, next);
+                else if (stat(g->path, &st) == 0 && S_ISDIR(st.st_mode)) add_match(g, len);
+            } else if (lstat(g->path, &st) == 0) {
+                add_match(g, len);
+            }
+        }
+        free(pat.toks);
+        return;
+    }
+
+    struct dir_list tmp = {0}, subdirs = {0};
+    if (path_reserve(g, len + 2) == -1) {
+        g->failed = 1;
+        free(pat.toks);
+        return;
+    }
+    memcpy(g->path + len, len == 0 ? "." : "", len == 0 ? 2 : 1);
+    const struct dir_list *list = dir_read(g->path, &tmp);
+    for (size_t off = 0; list != NULL && off < list->len && !g->failed;) {
+        unsigned char type = list->buf[off];
+        const char *name = list->buf + off + 1;
+        size_t name_len = strlen(name);
+        off += name_len + 2;
+        if (!pat_match(&pat, name, name_len)) continue;
+
+        if (path_reserve(g, len + name_len + 2) == -1) {
+            g->failed = 1;
+            break;
+        }
+        memcpy(g->path + len, name, name_len);
+        size_t end = len + name_len;
+        if (next == NULL) {
+            add_match(g, end);
+        } else if (is_dir(g, end, type)) {
+            if (*next == '\0') {
+                g->path[end++] = '/';
+                add_match(g, end);
+            } else if (list_put(&subdirs, name, name_len + 1) == -1) {
+                g->failed = 1;
+            }
+        }
+    }
+    free(tmp.buf);
+    free(pat.toks);
+
+    // reading a subdirectory may evict list from the cache, so they are gone through afterwards
+    for (size_t off = 0; off < subdirs.len && !g->failed;) {
+        const char *name = subdirs.buf + off;
+        size_t name_len = strlen(name);
+        off += name_len + 1;
+        if (path_reserve(g, len + name_len + 2) == -1) {
+            g->failed = 1;
+            break;
+        }
+        memcpy(g->path + len, name, name_len);
+        g->path[len + name_len] = '/';
+        glob_dir(g, len + name_len + 1, next);
+    }
+    free(subdirs.buf);
+}
+
+/* Function to check whether some component of pattern has a "*", "?" or a closed "[...]" */
+static int has_glob(const char *pattern)
+{
+    for (const char *p = pattern; *p != '\0'; p++) {
+        if (*p == '*' || *p == '?') return 1;
+        if (*p == '[') {
+            const char *close = p + 1;
+            if (*close == '!' || *close == '^') close++;
+            if (*close == ']') close++;
+            while (*close != '\0' && *close != '/' && *close != ']') close++;
+            if (*close == ']') return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+* Function to expand the pattern into the sorted list of paths it matches,
+* allocated from the arena. *matches is valid until the next call.
+* Returns the number of matches (0 if none, the word is then kept as it is),
+* or -1 if memory could not be allocated.
+*/
+ssize_t glob_expand(struct arena *a, const char *pattern, char ***matches)
+{
+    struct glob_state g = { .arena = a };
+    size_t len = 0;
+
+    if (!has_glob(pattern)) return 0;  // e.g. the "[" of test
+
+    if (*pattern == '/') {  // absolute
+        if (path_reserve(&g, 2) == -1) return -1;
+        g.path[len++] = '/';
+        while (*pattern == '/') pattern++;
+    }
+    glob_dir(&g, len, pattern);
+    free(g.path);
+    if (g.failed) return -1;
+    // matches from a cached (sorted) directory are usually in order already
+    for (size_t i = 1; i < g.nmatches; i++) {
+        if (strcmp(glob_results[i - 1], glob_results[i]) > 0) {
+            qsort(glob_results, g.nmatches, sizeof *glob_results, compare_names);
+            break;
+        }
+    }
+    *matches = glob_results;
+    return g.nmatches;
+}
+
+/* Function to forget every cached directory */
+void glob_cache_reset(void)
+{
+    for (size_t i = 0; i < GLOB_CACHE_DIRS; i++) {
+        if (dir_cache[i].list.buf != NULL) dir_cache_drop(&dir_cache[i]);
+    }
+    dir_hits = dir_scans = 0;
+}
+
+/* Function to print the directory cache counters, for the cache builtin */
+void glob_cache_print(void)
+{
+    size_t dirs = 0;
+    for (size_t i = 0; i < GLOB_CACHE_DIRS; i++) dirs += dir_cache[i].list.buf != NULL;
+    printf("glob dirs %zu (%zu KB) hits %lu scans %lu\n", dirs, dir_cache_bytes >> 10, dir_hits, dir_scans);
+}
@@ -0,0 +1,148 @@
+/* Line input.
+* Lines are read with read(2) into a buffer owned by the reader and handed out
+* as slices of that buffer. Reading goes through job_wait_fd(), so children
+* are reaped while the shell waits for input. A script file is mapped into
+* memory instead, and its lines are handed out in place without being copied.
+* A terminal gives a line per read, anything else (commands piped in from
+* another process) is read ahead in large blocks, so a steady stream of lines
+* costs a read and a wait per block rather than per line.
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+
+#include <sys/mman.h>
+
+#define INPUT_BUF_MIN 4096       // initial buffer size for a terminal
+#define INPUT_BLOCK   (256 << 10)  // read-ahead for pipes, sockets and files
+
+/*
+* Function to set up in to read the script at path through mmap(). Files that
+* can't be mapped (pipes, devices) are read with read(2) instead.
+* Returns 0 on success, -1 (with errno set) if the file can't be opened or mapped.
+*/
+int input_open_script(struct input *in, const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    memset(in, 0, sizeof *in);
+    if (!S_ISREG(st.st_mode)) {  // pipes and devices can't be mapped, read them instead
+        in->fd = fd;
+        return 0;
+    }
+    in->fd = -1;
+    in->eof = 1;  // the whole file is already "read"
+    if (st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        in->buf = map;
+        in->end = st.st_size;
+        in->mapped = 1;
+    }
+    close(fd);  // the mapping stays valid
+    return 0;
+}
+
+/* Function to set up in to read the lines of str (the argument of -c) in place */
+void input_open_string(struct input *in, const char *str)
+{
+    memset(in, 0, sizeof *in);
+    in->fd = -1;
+    in->eof = 1;
+    in->buf = (char *) str;
+    in->end = strlen(str);
+}
+
+/* Function to pick how much to read at a time, based on what in->fd is */
+static void input_probe(struct input *in)
+{
+    in->block = isatty(in->fd) ? INPUT_BUF_MIN : INPUT_BLOCK;
+}
+
+/* Function to check whether in reads from a terminal, which gets prompts and ^C handling */
+int input_interactive(struct input *in)
+{
+    if (in->fd < 0) return 0;
+    if (in->block == 0) input_probe(in);
+    return in->block == INPUT_BUF_MIN;
+}
+
+/* Function to check whether every line has been handed out */
+int input_done(struct input *in)
+{
+    return in->eof && in->start == in->end;
+}
+
+/*
+* Function to read the next line from in->fd.
+* On success *line points at the line (without its newline) inside the reader's
+* buffer, valid until the next call, and the line's length is returned.
+* Returns INPUT_EOF at end of input or INPUT_INTR if interrupted by a signal.
+*/
+ssize_t input_getline(struct input *in, const char **line)
+{
+    for (;;) {
+        char *nl = in->start < in->end ? memchr(in->buf + in->start, '\n', in->end - in->start) : NULL;
+        if (nl != NULL) {
+            *line = in->buf + in->start;
+            ssize_t len = nl - *line;
+            in->start += len + 1;
+            return len;
+        }
+        if (in->eof) {
+            if (in->start == in->end) return INPUT_EOF;
+            // last line without a newline
+            *line = in->buf + in->start;
+            ssize_t len = in->end - in->start;
+            in->start = in->end;
+            return len;
+        }
+
+        // make room: move the partial line to the front (only the tail of a block is
+        // moved, the lines before it have been handed out), grow if it fills the buffer
+        if (in->block == 0) input_probe(in);
+        if (in->start > 0) {  // (never reached for a mapping, it is already at eof)
+            memmove(in->buf, in->buf + in->start, in->end - in->start);
+            in->end -= in->start;
+            in->start = 0;
+        }
+        if (in->end == in->cap) {
+            size_t cap = in->cap ? in->cap * 2 : in->block;
+            char *buf = realloc(in->buf, cap);
+            if (buf == NULL) {
+                perror("memory allocation error");
+                return INPUT_EOF;
+            }
+            in->buf = buf;
+            in->cap = cap;
+        }
+
+        int ready = job_wait_fd(in->fd);
+        if (ready == -1) return INPUT_INTR;
+        if (ready == 2 && in->prompt != NULL) {
+            // background jobs were reported over the prompt, show it again
+            fprintf(stderr, "%s", in->prompt);
+        }
+        if (ready != 1) continue;
+
+        ssize_t n = read(in->fd, in->buf + in->end, in->cap - in->end);
+        if (n == -1) {
+            if (errno == EINTR) return INPUT_INTR;
+            if (errno == EAGAIN) continue;
+            in->eof = 1;
+        } else if (n == 0) {
+            in->eof = 1;
+        } else {
+            in->end += n;
+        }
+    }
+}
@@ -0,0 +1,734 @@
+/* Job table and child reaping.
+* Every launched child is recorded in a hash table keyed by pid. SIGCHLD is
+* blocked and read from a signalfd that is polled together with the input fd
+* through epoll, so children are reaped as soon as they change state, even while the
+* shell is waiting for a line, and background completions are reported
+* right away instead of at the next prompt.
+* Children are reaped with wait4(), and the wall time and resource usage of
+* the most recent jobs are kept for the time prefix and the jobs / stats builtins.
+* Jobs with a timeout have their deadlines in a min-heap, and a single timerfd
+* in the same epoll set is armed for the earliest one. When it expires the job
+* gets SIGTERM, then SIGKILL after a grace period, and $? becomes 124.
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#define JOB_TABLE_MIN 64  // initial number of slots (power of two)
+#define JOB_HISTORY   64  // finished jobs kept for stats
+#define JOB_NAME_MAX  32  // bytes of the command name kept per job
+
+// job states
+#define JOB_RUNNING 0
+#define JOB_DONE    1     // exited or killed, status holds the wait status
+#define JOB_STOPPED 2     // stopped, waiting for the foreground wait to notice
+
+struct job {
+    pid_t pid;        // 0 if the slot is empty
+    int bg;           // 1 for background jobs, which are reported when they finish, or JOB_HELPER
+    int state;
+    int status;       // wait status from the last state change
+    char name[JOB_NAME_MAX];   // command name, for jobs and stats
+    struct timespec start;     // launch time (CLOCK_MONOTONIC)
+    struct job_usage usage;    // filled in when the job finishes
+    int deadline;              // index in the deadline heap, -1 if it has no deadline
+    int timed_out;             // 1 once it has been sent SIGTERM for running too long
+    double kill_after;         // seconds from SIGTERM to SIGKILL
+};
+
+// A job's next deadline: SIGTERM when it times out, then SIGKILL after the grace period
+struct deadline {
+    uint64_t when;    // CLOCK_MONOTONIC nanoseconds
+    pid_t pid;
+};
+
+// A finished job, as shown by stats
+struct job_record {
+    pid_t pid;
+    int bg;
+    int status;
+    char name[JOB_NAME_MAX];
+    struct job_usage usage;
+};
+
+static struct job *job_table = NULL;
+static size_t job_cap = 0;     // number of slots
+static size_t job_count = 0;   // number of used slots
+static size_t job_bg_count = 0;  // number of those that are background jobs
+
+// the most recent background job to finish, for wait -n
+static unsigned long bg_done_seq = 0;
+static pid_t bg_done_pid = 0;
+static int bg_done_status = 0;
+
+// ring of the most recently finished jobs
+static struct job_record job_history[JOB_HISTORY];
+static unsigned long job_history_count = 0;  // total ever recorded
+
+static int child_epoll = -1;   // child events: the SIGCHLD signalfd
+static int input_epoll = -1;   // child_epoll plus the input fd
+static int sig_fd = -1;        // signalfd for SIGCHLD
+static int timer_fd = -1;      // timerfd armed for the earliest deadline
+static struct deadline *deadlines = NULL;  // min-heap on when
+static size_t deadline_count = 0, deadline_cap = 0;
+static int watched_fd = -1;    // input fd currently in input_epoll
+static int watched_pollable = 0;  // 0 if watched_fd can't be polled (regular file), always readable
+
+/* Function to find the slot holding pid, or the empty slot where it belongs */
+static size_t job_slot(pid_t pid)
+{
+    size_t mask = job_cap - 1;
+    size_t i = ((size_t) pid * 2654435761u) & mask;
+    while (job_table[i].pid != 0 && job_table[i].pid != pid) i = (i + 1) & mask;
+    return i;
+}
+
+/* Function to find the job for pid, NULL if it isn't in the table */
+static struct job *job_find(pid_t pid)
+{
+    if (job_cap == 0) return NULL;
+    struct job *job = &job_table[job_slot(pid)];
+    return job->pid == pid ? job : NULL;
+}
+
+/* Function to double the table size and reinsert every job */
+static int job_grow(void)
+{
+    struct job *old = job_table;
+    size_t old_cap = job_cap;
+    size_t new_cap = job_cap ? job_cap * 2 : JOB_TABLE_MIN;
+
+    struct job *table = calloc(new_cap, sizeof *table);
+    if (table == NULL) return -1;
+    job_table = table;
+    job_cap = new_cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].pid != 0) job_table[job_slot(old[i].pid)] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/* Function to read CLOCK_MONOTONIC in nanoseconds */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Function to put deadline d at heap index i, keeping its job's index in step */
+static void deadline_place(size_t i, struct deadline d)
+{
+    deadlines[i] = d;
+    struct job *job = job_find(d.pid);
+    if (job != NULL) job->deadline = i;
+}
+
+/* Function to move the deadline at index i up or down until the heap is ordered again */
+static void deadline_fix(size_t i)
+{
+    struct deadline d = deadlines[i];
+    while (i > 0 && deadlines[(i - 1) / 2].when > d.when) {
+        deadline_place(i, deadlines[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= deadline_count) break;
+        if (child + 1 < deadline_count && deadlines[child + 1].when < deadlines[child].when) child++;
+        if (deadlines[child].when >= d.when) break;
+        deadline_place(i, deadlines[child]);
+        i = child;
+    }
+    deadline_place(i, d);
+}
+
+/* Function to arm the timerfd for the earliest deadline, or disarm it when there is none */
+static void deadline_arm(void)
+{
+    struct itimerspec its = {0};
+    if (deadline_count > 0) {
+        // 0 would disarm the timer, a deadline that has passed fires right away at 1ns
+        uint64_t when = deadlines[0].when ? deadlines[0].when : 1;
+        its.it_value.tv_sec = when / 1000000000;
+        its.it_value.tv_nsec = when % 1000000000;
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Function to give a job a deadline secs from now, replacing any it had */
+static void deadline_set(struct job *job, double secs)
+{
+    struct deadline d = { now_ns() + (uint64_t) (secs * 1e9), job->pid };
+    if (job->deadline >= 0) {
+        deadlines[job->deadline].when = d.when;
+        deadline_fix(job->deadline);
+    } else {
+        if (deadline_count == deadline_cap) {
+            size_t cap = deadline_cap ? deadline_cap * 2 : 64;
+            struct deadline *heap = realloc(deadlines, cap * sizeof *heap);
+            if (heap == NULL) {
+                perror("memory allocation error");
+                return;
+            }
+            deadlines = heap;
+            deadline_cap = cap;
+        }
+        deadlines[deadline_count] = d;
+        deadline_fix(deadline_count++);
+    }
+    if (deadlines[0].pid == job->pid) deadline_arm();
+}
+
+/* Function to drop a job's deadline, e.g. once it has finished */
+static void deadline_cancel(struct job *job)
+{
+    size_t i = job->deadline;
+    job->deadline = -1;
+    if (--deadline_count > i) {
+        deadlines[i] = deadlines[deadline_count];
+        deadline_fix(i);
+    }
+    // with none left, disarming also clears an expiry not read yet, so the timerfd isn't left readable;
+    // otherwise a timer still armed for this one just wakes the wait once and deadline_expire() re-arms it
+    if (deadline_count == 0) deadline_arm();
+}
+
+/*
+* Function to act on every deadline that has passed: a job that has run too long
+* is sent SIGTERM and given a new deadline kill_after seconds later, and one that
+* is still running at that one is sent SIGKILL.
+*/
+static void deadline_expire(void)
+{
+    uint64_t expirations, now = now_ns();
+    while (read(timer_fd, &expirations, sizeof expirations) > 0) {}  // epoll is level-triggered, drain it
+
+    while (deadline_count > 0 && deadlines[0].when <= now) {
+        struct job *job = job_find(deadlines[0].pid);
+        if (job->timed_out) {
+            kill(job->pid, SIGKILL);
+            deadline_cancel(job);
+            continue;
+        }
+        kill(job->pid, SIGTERM);
+        kill(job->pid, SIGCONT);  // a stopped job could not act on it
+        job->timed_out = 1;
+        if (job->kill_after > 0) deadline_set(job, job->kill_after);
+        else deadline_cancel(job);
+    }
+    deadline_arm();
+}
+
+/* Function to remove pid from the table (backward-shift deletion, no tombstones) */
+static void job_remove(pid_t pid)
+{
+    if (job_cap == 0) return;
+    size_t mask = job_cap - 1;
+    size_t i = job_slot(pid);
+    if (job_table[i].pid != pid) return;
+    if (job_table[i].deadline >= 0) deadline_cancel(&job_table[i]);
+    if (job_table[i].bg) job_bg_count--;
+    job_table[i].pid = 0;
+    job_count--;
+
+    for (size_t j = (i + 1) & mask; job_table[j].pid != 0; j = (j + 1) & mask) {
+        size_t home = ((size_t) job_table[j].pid * 2654435761u) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            job_table[i] = job_table[j];
+            job_table[j].pid = 0;
+            i = j;
+        }
+    }
+}
+
+/*
+* Function to make the job pid time out secs seconds from now: it is sent SIGTERM,
+* and SIGKILL kill_after seconds later if it is still running (never if kill_after is 0).
+*/
+void job_set_timeout(pid_t pid, double secs, double kill_after)
+{
+    struct job *job = job_find(pid);
+    if (job == NULL || secs <= 0) return;
+    job->kill_after = kill_after;
+    deadline_set(job, secs);
+}
+
+/*
+* Function to set up child reaping: SIGCHLD is blocked and delivered through
+* a signalfd in the epoll set. Children get an empty signal mask when launched.
+* Safe to call more than once, so it can be done lazily before the first launch.
+*/
+void jobs_init(void)
+{
+    if (sig_fd != -1) return;  // already set up
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    child_epoll = epoll_create1(EPOLL_CLOEXEC);
+    input_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (sig_fd == -1 || timer_fd == -1 || child_epoll == -1 || input_epoll == -1) {
+        perror("jobs_init() failed");
+        exit(1);
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = sig_fd };
+    epoll_ctl(child_epoll, EPOLL_CTL_ADD, sig_fd, &ev);
+    ev.data.fd = timer_fd;
+    epoll_ctl(child_epoll, EPOLL_CTL_ADD, timer_fd, &ev);
+    // an epoll fd is readable while it has events, so the input wait can nest it
+    ev.data.fd = child_epoll;
+    epoll_ctl(input_epoll, EPOLL_CTL_ADD, child_epoll, &ev);
+}
+
+/* Function to get the seconds elapsed since start */
+static double elapsed_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+* Function to start over with an empty job table and fresh wait fds in a
+* process forked from the shell (a --serve worker): the inherited epoll sets
+* and signalfd would still report to the parent.
+*/
+void jobs_reinit(void)
+{
+    if (sig_fd != -1) {
+        close(sig_fd);
+        close(timer_fd);
+        close(child_epoll);
+        close(input_epoll);
+        sig_fd = timer_fd = child_epoll = input_epoll = -1;
+    }
+    watched_fd = -1;
+    free(job_table);
+    job_table = NULL;
+    job_cap = job_count = job_bg_count = 0;
+    deadline_count = 0;
+    job_history_count = 0;
+    jobs_init();
+}
+
+/* Function to get an fd that is readable while child events are pending, for an outside epoll set */
+int jobs_event_fd(void)
+{
+    return child_epoll;
+}
+
+/*
+* Function to record a launched child, bg is 1 for background jobs (JOB_HELPER
+* for a helper such as a fan-out pump), name is its command.
+*/
+void job_add(pid_t pid, int bg, const char *name)
+{
+    if ((job_count + 1) * 4 > job_cap * 3 && job_grow() == -1) {
+        perror("memory allocation error");
+        return;
+    }
+    struct job *job = &job_table[job_slot(pid)];
+    job->pid = pid;
+    job->bg = bg;
+    job->state = JOB_RUNNING;
+    job->status = 0;
+    job->deadline = -1;
+    job->timed_out = 0;
+    snprintf(job->name, sizeof job->name, "%s", name);
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    memset(&job->usage, 0, sizeof job->usage);
+    job_count++;
+    if (bg) job_bg_count++;
+}
+
+/* Function to move a job to the background, e.g. after it was stopped in the foreground */
+void job_set_bg(pid_t pid)
+{
+    struct job *job = job_find(pid);
+    if (job != NULL) {
+        if (!job->bg) job_bg_count++;
+        job->bg = 1;
+        job->state = JOB_RUNNING;
+    }
+}
+
+/* Function to record the resources a finished job used, and remember it for stats (helpers aren't) */
+static void job_finish(struct job *job, int status, const struct rusage *ru)
+{
+    job->usage.wall = elapsed_since(&job->start);
+    job->usage.ru = *ru;
+    if (job->bg == JOB_HELPER) return;
+
+    struct job_record *rec = &job_history[job_history_count++ % JOB_HISTORY];
+    rec->pid = job->pid;
+    rec->bg = job->bg;
+    rec->status = status;
+    memcpy(rec->name, job->name, sizeof rec->name);
+    rec->usage = job->usage;
+}
+
+/*
+* Function to update the job pid after it changed state with status, using ru
+* if it finished. Background jobs are reported and forgotten (stopped ones are
+* continued), foreground jobs keep their status for job_wait_fg().
+* Returns 1 if a background job was reported, 0 otherwise.
+*/
+int job_changed(pid_t pid, int status, const struct rusage *ru)
+{
+    struct job *job = job_find(pid);
+    if (job == NULL) return 0;  // not one of ours
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        job_finish(job, status, ru);
+        if (job->deadline >= 0) deadline_cancel(job);
+        // like coreutils timeout, a job killed for running too long has status 124
+        if (job->timed_out) status = W_EXITCODE(TIMEOUT_STATUS, 0);
+    }
+    if (!job->bg) {
+        job->status = status;
+        job->state = WIFSTOPPED(status) ? JOB_STOPPED : JOB_DONE;
+        return 0;
+    }
+    if (job->bg == JOB_HELPER) {  // finishes along with its command, which is the one reported
+        if (WIFSTOPPED(status)) kill(pid, SIGCONT);
+        else job_remove(pid);
+        return 0;
+    }
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        if (job->timed_out) {
+            fprintf(stderr, "Child process %jd done. Timed out.\n", (intmax_t) pid);
+        } else if (WIFEXITED(status)) {
+            fprintf(stderr, "Child process %jd done. Exit status %d.\n", (intmax_t) pid, WEXITSTATUS(status));
+        } else {
+            fprintf(stderr, "Child process %jd done. Signaled %d.\n", (intmax_t) pid, WTERMSIG(status));
+        }
+        job_remove(pid);
+        bg_done_seq++;
+        bg_done_pid = pid;
+        bg_done_status = status;
+    } else if (WIFSTOPPED(status)) {
+        kill(pid, SIGCONT);
+        fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t) pid);
+    }
+    return 1;
+}
+
+/*
+* Function to reap every child that has changed state, including the ones
+* the zygote launched for us, then act on the deadlines that have passed.
+* Returns the number of background jobs reported.
+*/
+static int jobs_reap(void)
+{
+    struct signalfd_siginfo info;
+    struct rusage ru;
+    int status, reported = 0;
+    pid_t pid;
+
+    // drain the signalfd, one SIGCHLD may stand for many children
+    while (read(sig_fd, &info, sizeof info) > 0) {}
+
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &ru)) > 0) {
+        reported += job_changed(pid, status, &ru);
+    }
+    reported += zygote_reap();
+    // after reaping, so a job that finished in time is not taken for one that timed out
+    if (deadline_count > 0) deadline_expire();
+    return reported;
+}
+
+/* Function to watch fd for child events too (the zygote's status socket, an output fan-out) */
+void jobs_watch_fd(int fd)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    epoll_ctl(child_epoll, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Function to stop watching fd */
+void jobs_unwatch_fd(int fd)
+{
+    epoll_ctl(child_epoll, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+* Function to handle pending child events, waiting up to timeout ms (-1 forever) for one.
+* Returns the number of background jobs reported, or -1 if interrupted by a signal.
+*/
+static int jobs_dispatch(int timeout)
+{
+    struct epoll_event events[8];
+
+    int n = epoll_wait(child_epoll, events, 8, timeout);
+    if (n == -1) return errno == EINTR ? -1 : 0;
+    int reap = 0;
+    for (int i = 0; i < n; i++) {
+        // output fan-outs are pumped here, anything else is SIGCHLD, the timer or the zygote
+        if (!fanout_pump(events[i].data.fd)) reap = 1;
+    }
+    return reap ? jobs_reap() : 0;  // jobs_reap() handles all three
+}
+
+/*
+* Function to block until fd is readable (or, with fd -1, until a child changes state),
+* reaping children in the meantime.
+* Returns 1 if fd is readable, 0 after reaping, 2 after reaping and reporting
+* background jobs, or -1 if interrupted by a signal.
+*/
+int job_wait_fd(int fd)
+{
+    struct epoll_event events[2];
+
+    if (fd < 0) {
+        int reported = jobs_dispatch(-1);
+        return reported == -1 ? -1 : (reported > 0 ? 2 : 0);
+    }
+
+    if (fd != watched_fd) {  // swap the input fd in the epoll set
+        if (watched_fd >= 0 && watched_pollable) epoll_ctl(input_epoll, EPOLL_CTL_DEL, watched_fd, NULL);
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+        watched_fd = fd;
+        watched_pollable = epoll_ctl(input_epoll, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+    if (!watched_pollable) {  // regular files are always readable
+        return jobs_dispatch(0) > 0 ? 2 : 1;
+    }
+
+    int n = epoll_wait(input_epoll, events, 2, -1);
+    if (n == -1) return errno == EINTR ? -1 : 0;
+
+    int readable = 0, reported = 0;
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.fd == child_epoll) reported = jobs_dispatch(0);
+        else if (events[i].data.fd == fd) readable = 1;
+    }
+    if (readable) return 1;
+    return reported > 0 ? 2 : 0;
+}
+
+/*
+* Function to wait until the foreground job pid exits, is killed or stops.
+* Finished jobs are removed from the table, and their resource usage is stored
+* in *usage unless it is NULL. Returns the wait status.
+*/
+int job_wait_fg(pid_t pid, struct job_usage *usage)
+{
+    struct job *job = job_find(pid);
+    if (job == NULL) return 0;
+    jobs_reap();  // it may have finished already
+    while ((job = job_find(pid)) != NULL && job->state == JOB_RUNNING) {
+        job_wait_fd(-1);
+    }
+    int status = job->status;
+    if (job->state == JOB_DONE) {
+        if (usage != NULL) *usage = job->usage;
+        job_remove(pid);
+    }
+    return status;
+}
+
+/*
+* Function to check on the foreground job pid without blocking. A job that has
+* stopped is continued. Returns 1 and sets *status once the job has finished
+* (it is removed from the table), 0 while it is still running.
+*/
+int job_check_fg(pid_t pid, int *status)
+{
+    struct job *job = job_find(pid);
+    if (job == NULL) {
+        *status = 0;
+        return 1;
+    }
+    if (job->state == JOB_STOPPED) {
+        kill(pid, SIGCONT);
+        job->state = JOB_RUNNING;
+    }
+    if (job->state != JOB_DONE) return 0;
+    *status = job->status;
+    job_remove(pid);
+    return 1;
+}
+
+/*
+* Function to wait for the background job pid, which is treated as a foreground
+* job from now on so its status is kept rather than reported.
+* Returns 0 and sets *status, or -1 if pid is not a job of this shell.
+*/
+int job_wait_bg(pid_t pid, int *status)
+{
+    struct job *job = job_find(pid);
+    if (job == NULL) return -1;
+    if (job->bg) {
+        job->bg = 0;
+        job_bg_count--;
+    }
+    *status = job_wait_fg(pid, NULL);
+    return 0;
+}
+
+/*
+* Function to wait for the next background job to finish (wait -n).
+* Returns its pid and sets *status, or -1 if there are no background jobs.
+*/
+pid_t job_wait_next_bg(int *status)
+{
+    unsigned long seq = bg_done_seq;
+    jobs_reap();
+    while (bg_done_seq == seq) {
+        if (job_bg_count == 0) return -1;
+        job_wait_fd(-1);
+    }
+    *status = bg_done_status;
+    return bg_done_pid;
+}
+
+/* Function to wait until every background job has finished */
+void jobs_wait_all_bg(void)
+{
+    jobs_reap();
+    while (job_bg_count > 0) job_wait_fd(-1);
+}
+
+/*
+* Function to turn a wait status into the value for $?: the exit status,
+* or the signal number for a process that was killed.
+*/
+int job_status_code(int status)
+{
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return WTERMSIG(status);
+    return 0;
+}
+
+/* Function to reap children that have already changed state, without blocking */
+void jobs_poll(void)
+{
+    jobs_dispatch(0);
+}
+
+/* Function to send sig to every background job */
+void jobs_signal_bg(int sig)
+{
+    for (size_t i = 0; i < job_cap; i++) {
+        if (job_table[i].pid != 0 && job_table[i].bg) kill(job_table[i].pid, sig);
+    }
+}
+
+/* Function to add the resources used by u to sum (wall times add up, max RSS is the largest) */
+void job_usage_add(struct job_usage *sum, const struct job_usage *u)
+{
+    sum->wall += u->wall;
+    timeradd(&sum->ru.ru_utime, &u->ru.ru_utime, &sum->ru.ru_utime);
+    timeradd(&sum->ru.ru_stime, &u->ru.ru_stime, &sum->ru.ru_stime);
+    if (u->ru.ru_maxrss > sum->ru.ru_maxrss) sum->ru.ru_maxrss = u->ru.ru_maxrss;
+    sum->ru.ru_minflt += u->ru.ru_minflt;
+    sum->ru.ru_majflt += u->ru.ru_majflt;
+    sum->ru.ru_nvcsw += u->ru.ru_nvcsw;
+    sum->ru.ru_nivcsw += u->ru.ru_nivcsw;
+}
+
+static double tv_seconds(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* Function to print a job's resource usage for the time prefix, in the style of bash's time */
+void job_usage_print(const struct job_usage *u)
+{
+    fprintf(stderr, "\nreal\t%dm%.3fs\n", (int) (u->wall / 60), u->wall - 60 * (int) (u->wall / 60));
+    double user = tv_seconds(&u->ru.ru_utime), sys = tv_seconds(&u->ru.ru_stime);
+    fprintf(stderr, "user\t%dm%.3fs\n", (int) (user / 60), user - 60 * (int) (user / 60));
+    fprintf(stderr, "sys\t%dm%.3fs\n", (int) (sys / 60), sys - 60 * (int) (sys / 60));
+    fprintf(stderr, "maxrss\t%ld KB\n", u->ru.ru_maxrss);
+    fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n", u->ru.ru_nvcsw, u->ru.ru_nivcsw);
+}
+
+/* Function to print one row of the stats table */
+static void print_usage_row(pid_t pid, const char *state, const struct job_usage *u, const char *name)
+{
+    printf("%-8jd %-10s %9.3f %9.3f %9.3f %9ld %7ld %7ld  %s\n", (intmax_t) pid, state, u->wall,
+           tv_seconds(&u->ru.ru_utime), tv_seconds(&u->ru.ru_stime), u->ru.ru_maxrss,
+           u->ru.ru_nvcsw, u->ru.ru_nivcsw, name);
+}
+
+static void print_usage_header(void)
+{
+    printf("%-8s %-10s %9s %9s %9s %9s %7s %7s  %s\n", "PID", "STATUS", "REAL", "USER", "SYS",
+           "MAXRSS_KB", "VCSW", "IVCSW", "COMMAND");
+}
+
+/* Function to describe a finished job's wait status, e.g. "exit 0" or "signal 9" */
+static const char *status_text(int status, char *buf, size_t size)
+{
+    if (WIFSIGNALED(status)) snprintf(buf, size, "signal %d", WTERMSIG(status));
+    else snprintf(buf, size, "exit %d", WEXITSTATUS(status));
+    return buf;
+}
+
+/*
+* Function to print the finished jobs kept in the history, oldest first.
+* With bg_only only background jobs are shown.
+*/
+static void print_history(int bg_only)
+{
+    unsigned long first = job_history_count > JOB_HISTORY ? job_history_count - JOB_HISTORY : 0;
+    char buf[24];
+    for (unsigned long i = first; i < job_history_count; i++) {
+        const struct job_record *rec = &job_history[i % JOB_HISTORY];
+        if (bg_only && !rec->bg) continue;
+        print_usage_row(rec->pid, status_text(rec->status, buf, sizeof buf), &rec->usage, rec->name);
+    }
+}
+
+/*
+* Builtin jobs [-v]: list the running background jobs and how long they have run.
+* With -v the background jobs that have finished recently are listed too, with their resource usage.
+*/
+int builtin_jobs(char **argv)
+{
+    int verbose = argv[1] != NULL && strcmp(argv[1], "-v") == 0;
+    if (argv[1] != NULL && !verbose) {
+        fprintf(stderr, "jobs: usage: jobs [-v]\n");
+        return 2;
+    }
+    if (verbose) print_usage_header();
+    for (size_t i = 0; i < job_cap; i++) {
+        struct job *job = &job_table[i];
+        if (job->pid == 0 || job->bg != 1) continue;
+        if (verbose) {
+            struct job_usage u = {0};
+            u.wall = elapsed_since(&job->start);  // CPU use isn't known until it has been reaped
+            print_usage_row(job->pid, "running", &u, job->name);
+        } else {
+            printf("[%jd] Running %.1fs\t%s\n", (intmax_t) job->pid, elapsed_since(&job->start), job->name);
+        }
+    }
+    if (verbose) print_history(1);
+    return 0;
+}
+
+/*
+* Builtin stats [-c]: show the wall time, CPU time, max RSS and context switches
+* of the most recently finished jobs, foreground and background. -c clears them.
+*/
+int builtin_stats(char **argv)
+{
+    if (argv[1] != NULL && strcmp(argv[1], "-c") == 0) {
+        job_history_count = 0;
+        return 0;
+    }
+    if (argv[1] != NULL) {
+        fprintf(stderr, "stats: usage: stats [-c]\n");
+        return 2;
+    }
+    print_usage_header();
+    print_history(0);
+    return 0;
+}
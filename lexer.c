@@ -0,0 +1,488 @@
+/* Word splitting and expansion.
+* A command line is scanned once: words are split on IFS, and "~/", "$$",
+* "$?", "$!", "$0".."$9" and variables ("$NAME", "${NAME}", "${NAME:-default}")
+* are expanded in the same pass as the characters are copied. A word with
+* "*", "?" or "[" in its literal text is replaced by the file names it matches.
+* The bodies of "<<" here-documents follow the command on the lines after it
+* (see flow.c); each is expanded as one word, without splitting or globbing,
+* and takes the place of its delimiter word.
+* Words are built in a bump arena that is reset before the next line is
+* read, so a steady stream of commands doesn't grow the heap.
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+
+#define ARENA_BLOCK_MIN 4096  // smallest block the arena asks malloc for
+#define EXPAND_FAILED ((size_t) -1)
+
+struct arena_block {
+    struct arena_block *next;
+    size_t cap;        // bytes available in data
+    size_t used;       // bytes handed out so far
+    char data[];
+};
+
+/*
+* Function to make room for n more bytes in the string being built at the top
+* of the arena. A partly built string is moved when it has to change blocks.
+* Returns 0 on success, -1 if memory could not be allocated.
+*/
+static int arena_reserve(struct arena *a, size_t n)
+{
+    struct arena_block *cur = a->cur;
+    if (cur != NULL && cur->used + a->open + n <= cur->cap) return 0;
+
+    size_t need = a->open + n;
+    // reuse the next block kept from an earlier line if it is big enough
+    struct arena_block *next = cur != NULL ? cur->next : a->head;
+    while (next != NULL && next->cap < need) next = next->next;
+    if (next == NULL) {
+        size_t cap = ARENA_BLOCK_MIN;
+        while (cap < need) cap *= 2;
+        next = malloc(sizeof *next + cap);
+        if (next == NULL) return -1;
+        next->cap = cap;
+        // link the new block after the current one
+        if (cur == NULL) {
+            next->next = a->head;
+            a->head = next;
+        } else {
+            next->next = cur->next;
+            cur->next = next;
+        }
+    }
+    next->used = 0;
+    if (a->open > 0) memcpy(next->data, cur->data + cur->used, a->open);
+    a->cur = next;
+    return 0;
+}
+
+/* Function to append n bytes to the string being built */
+static int arena_put(struct arena *a, const char *s, size_t n)
+{
+    if (arena_reserve(a, n) == -1) return -1;
+    memcpy(a->cur->data + a->cur->used + a->open, s, n);
+    a->open += n;
+    return 0;
+}
+
+/* Function to NUL-terminate the string being built and return it */
+static char *arena_close(struct arena *a)
+{
+    if (arena_reserve(a, 1) == -1) return NULL;
+    char *str = a->cur->data + a->cur->used;
+    str[a->open] = '\0';
+    a->cur->used += a->open + 1;
+    a->open = 0;
+    return str;
+}
+
+/*
+* Function to allocate n bytes from the arena (pointer aligned).
+* Returns NULL if memory could not be allocated.
+*/
+void *arena_alloc(struct arena *a, size_t n)
+{
+    if (a->cur != NULL) {
+        a->cur->used = (a->cur->used + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    }
+    if (arena_reserve(a, n) == -1) return NULL;
+    void *p = a->cur->data + a->cur->used;
+    a->cur->used += n;
+    return p;
+}
+
+/* Function to release everything allocated from the arena, keeping its blocks for reuse */
+void arena_reset(struct arena *a)
+{
+    for (struct arena_block *b = a->head; b != NULL; b = b->next) b->used = 0;
+    a->cur = a->head;
+    a->open = 0;
+}
+
+/* Function to pick the characters words are split on */
+void lex_set_delim(struct lexer *lx, const char *delim)
+{
+    memset(lx->is_delim, 0, sizeof lx->is_delim);
+    for (; *delim; delim++) lx->is_delim[(unsigned char) *delim] = 1;
+}
+
+/* Function to format a non-negative number into buf, returns the length */
+static size_t format_num(char *buf, long n)
+{
+    char tmp[24];
+    size_t len = 0;
+    if (n < 0) {
+        *buf++ = '-';
+        return 1 + format_num(buf, -n);
+    }
+    do {
+        tmp[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    for (size_t i = 0; i < len; i++) buf[i] = tmp[len - 1 - i];
+    return len;
+}
+
+/* Function to add a word to the word list, growing the list when needed */
+static int lex_push(struct lexer *lx, size_t count, char *word)
+{
+    if (count + 1 >= lx->words_cap) {
+        size_t cap = lx->words_cap ? lx->words_cap * 2 : 64;
+        char **words = realloc(lx->words, cap * sizeof *words);
+        if (words == NULL) return -1;
+        lx->words = words;
+        lx->words_cap = cap;
+    }
+    lx->words[count] = word;
+    return 0;
+}
+
+/* Function to check for a character that can continue a variable name */
+static int is_name_char(char c)
+{
+    return c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9');
+}
+
+/* Function to append the value of the variable name[0..n), nothing if it is unset */
+static int put_var(struct lexer *lx, const char *name, size_t n, const struct expand_ctx *ctx)
+{
+    const char *value = ctx->lookup != NULL ? ctx->lookup(name, n) : NULL;
+    if (value == NULL) return 0;
+    return arena_put(&lx->arena, value, strlen(value));
+}
+
+/*
+* Function to expand the "$" at line[i]: "$$", "$?", "$!", "$0".."$9", "$NAME",
+* "${NAME}" or "${NAME:-default}" (the default is used when NAME is unset or
+* empty, and is itself expanded). Anything else keeps the "$" as it is.
+* Returns the index after the expansion, or EXPAND_FAILED if memory could not be allocated.
+*/
+static size_t expand_dollar(struct lexer *lx, const char *line, size_t len, size_t i, const struct expand_ctx *ctx)
+{
+    char num[24];
+    size_t sub_len;
+    char next = i + 1 < len ? line[i + 1] : '\0';
+
+    switch (next) {
+    case '$':
+        sub_len = format_num(num, ctx->shell_pid);
+        return arena_put(&lx->arena, num, sub_len) == -1 ? EXPAND_FAILED : i + 2;
+    case '?':
+        sub_len = format_num(num, ctx->last_status);
+        return arena_put(&lx->arena, num, sub_len) == -1 ? EXPAND_FAILED : i + 2;
+    case '!':
+        sub_len = ctx->last_bg != 0 ? format_num(num, ctx->last_bg) : 0;
+        return arena_put(&lx->arena, num, sub_len) == -1 ? EXPAND_FAILED : i + 2;
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9': {  // positional parameter
+        int n = next - '0';
+        if (n < ctx->nparams && arena_put(&lx->arena, ctx->params[n], strlen(ctx->params[n])) == -1) {
+            return EXPAND_FAILED;
+        }
+        return i + 2;
+    }
+    case '{': {
+        size_t name = i + 2, end = name;
+        while (end < len && is_name_char(line[end])) end++;
+        if (end == name || end == len) break;
+        if (line[end] == '}') {
+            return put_var(lx, line + name, end - name, ctx) == -1 ? EXPAND_FAILED : end + 1;
+        }
+        if (line[end] != ':' || end + 1 == len || line[end + 1] != '-') break;
+        size_t def = end + 2, close = def;
+        while (close < len && line[close] != '}') close++;
+        if (close == len) break;
+        const char *value = ctx->lookup != NULL ? ctx->lookup(line + name, end - name) : NULL;
+        if (value != NULL && *value != '\0') {
+            return arena_put(&lx->arena, value, strlen(value)) == -1 ? EXPAND_FAILED : close + 1;
+        }
+        // expand the default in place, it may hold "$" needles of its own
+        while (def < close) {
+            size_t run = def;
+            while (run < close && line[run] != '$') run++;
+            if (run > def && arena_put(&lx->arena, line + def, run - def) == -1) return EXPAND_FAILED;
+            if (run == close) break;
+            def = expand_dollar(lx, line, close, run, ctx);
+            if (def == EXPAND_FAILED) return EXPAND_FAILED;
+        }
+        return close + 1;
+    }
+    default:
+        if (next == '_' || (next >= 'A' && next <= 'Z') || (next >= 'a' && next <= 'z')) {
+            size_t end = i + 2;
+            while (end < len && is_name_char(line[end])) end++;
+            return put_var(lx, line + i + 1, end - i - 1, ctx) == -1 ? EXPAND_FAILED : end;
+        }
+    }
+    // a lone "$" is kept as it is
+    return arena_put(&lx->arena, "$", 1) == -1 ? EXPAND_FAILED : i + 1;
+}
+
+/*
+* Function to add a segment to the recording of the current line, a literal
+* that continues the previous one is merged into it.
+* Returns 0 on success, -1 if memory could not be allocated.
+*/
+static int lex_record(struct lexer *lx, int kind, size_t off, size_t len)
+{
+    if (kind == LEX_LITERAL && lx->nsegs > 0) {
+        struct lex_seg *last = &lx->segs[lx->nsegs - 1];
+        if (last->kind == LEX_LITERAL && last->off + last->len == off) {
+            last->len += len;
+            return 0;
+        }
+    }
+    if (lx->nsegs == lx->segs_cap) {
+        size_t cap = lx->segs_cap ? lx->segs_cap * 2 : 64;
+        struct lex_seg *segs = realloc(lx->segs, cap * sizeof *segs);
+        if (segs == NULL) return -1;
+        lx->segs = segs;
+        lx->segs_cap = cap;
+    }
+    lx->segs[lx->nsegs++] = (struct lex_seg) { kind, off, len };
+    return 0;
+}
+
+/*
+* Function to end the word being built. A glob pattern is replaced by the
+* paths it matches, or kept as it is if nothing matches.
+* Returns 0 on success, -1 if memory could not be allocated.
+*/
+static int lex_end_word(struct lexer *lx, size_t *count, int glob)
+{
+    char *word = arena_close(&lx->arena);
+    if (word == NULL) return -1;
+    if (glob) {
+        char **matches;
+        ssize_t n = glob_expand(&lx->arena, word, &matches);
+        if (n == -1) return -1;
+        for (ssize_t i = 0; i < n; i++) {
+            if (lex_push(lx, (*count)++, matches[i]) == -1) return -1;
+        }
+        if (n > 0) return 0;
+    }
+    if (lex_push(lx, *count, word) == -1) return -1;
+    (*count)++;
+    return 0;
+}
+
+/*
+* Function to find the delimiters of the here-documents of the command on
+* line[0..len), split into words the way lex_line() splits it.
+* Returns how many there are (at most LEX_HEREDOC_MAX), their slices of the line are put in docs.
+*/
+int lex_heredocs(const unsigned char *is_delim, const char *line, size_t len, struct lex_seg *docs)
+{
+    int n = 0, delim_next = 0;
+    size_t i = 0;
+    for (;;) {
+        while (i < len && is_delim[(unsigned char) line[i]]) i++;
+        if (i == len || line[i] == '#') break;
+        size_t start = i;
+        if (line[i] == '<' && i + 1 < len && line[i + 1] == '<') {
+            i += i + 2 < len && line[i + 2] == '<' ? 3 : 2;
+            delim_next = i - start == 2;
+            continue;
+        }
+        while (i < len && !is_delim[(unsigned char) line[i]]) i++;
+        if (delim_next && n < LEX_HEREDOC_MAX) docs[n++] = (struct lex_seg) { LEX_LITERAL, start, i - start };
+        delim_next = 0;
+    }
+    return n;
+}
+
+/*
+* Function to expand the here-document bodies that follow the command, from
+* line[pos..len), in the order of docs. Each body runs up to a line that is its
+* delimiter, and is put in the word list in place of that delimiter word.
+* Returns 0 on success, -1 if memory could not be allocated.
+*/
+static int lex_bodies(struct lexer *lx, const char *line, size_t len, size_t pos, const struct lex_seg *docs,
+                      const size_t *doc_words, int ndocs, const struct expand_ctx *ctx)
+{
+    int record = lx->record;
+    for (int d = 0; d < ndocs; d++) {
+        while (pos < len) {
+            const char *nl = memchr(line + pos, '\n', len - pos);
+            size_t end = nl != NULL ? (size_t) (nl - line) : len, eol = end < len ? end + 1 : end;
+            if (end - pos == docs[d].len && memcmp(line + pos, line + docs[d].off, docs[d].len) == 0) {
+                pos = eol;
+                break;
+            }
+            while (pos < eol) {
+                size_t run = pos;
+                while (run < eol && line[run] != '$') run++;
+                if (run > pos && arena_put(&lx->arena, line + pos, run - pos) == -1) return -1;
+                if (record && run > pos && lex_record(lx, LEX_LITERAL, pos, run - pos) == -1) return -1;
+                if (run == eol) break;
+                pos = expand_dollar(lx, line, end, run, ctx);
+                if (pos == EXPAND_FAILED) return -1;
+                if (record && lex_record(lx, LEX_DOLLAR, run, pos - run) == -1) return -1;
+            }
+            pos = eol;
+        }
+        char *body = arena_close(&lx->arena);
+        if (body == NULL) return -1;
+        lx->words[doc_words[d]] = body;
+        if (record && lex_record(lx, LEX_HEREDOC_END, 0, doc_words[d]) == -1) return -1;
+    }
+    return 0;
+}
+
+/*
+* Function to split line[0..len) into words and expand them.
+* Scanning stops at a word that starts with "#", or at the end of the first
+* line if here-document bodies follow it. The returned array is
+* NULL-terminated and, like the words, valid until the next arena_reset() of lx->arena.
+* With lx->record set, the line is also recorded as segments in lx->segs.
+* Returns NULL if memory could not be allocated.
+*/
+char **lex_line(struct lexer *lx, const char *line, size_t len, const struct expand_ctx *ctx, int *word_count)
+{
+    size_t count = 0;
+    size_t i = 0;
+    int record = lx->record;
+    struct lex_seg docs[LEX_HEREDOC_MAX];  // delimiters of the here-documents
+    size_t doc_words[LEX_HEREDOC_MAX];     // and the words they are
+    int ndocs = 0, delim_next = 0;
+
+    lx->nsegs = 0;
+    // the command ends at a newline only when here-document bodies follow it
+    const char *nl = memchr(line, '\n', len);
+    size_t cmd_len = nl != NULL ? (size_t) (nl - line) : len;
+
+    for (;;) {
+        while (i < cmd_len && lx->is_delim[(unsigned char) line[i]]) i++;
+        if (i == cmd_len || line[i] == '#') break;
+        int glob = 0;  // only the word's own text can make it a pattern, not what "$" expands to
+        int open_set = 0;  // a "[" was seen in the word's text, a later "]" closes it
+        size_t start = i;
+
+        // "<<" and "<<<" are words of their own, even with the delimiter or string right after them
+        if (line[i] == '<' && i + 1 < cmd_len && line[i + 1] == '<') {
+            size_t op = i + 2 < cmd_len && line[i + 2] == '<' ? 3 : 2;
+            if (arena_put(&lx->arena, line + i, op) == -1 || lex_end_word(lx, &count, 0) == -1) return NULL;
+            if (record && (lex_record(lx, LEX_LITERAL, i, op) == -1 || lex_record(lx, LEX_WORD_END, i + op, 0) == -1)) {
+                return NULL;
+            }
+            i += op;
+            delim_next = op == 2;
+            continue;
+        }
+
+        // "~/" can only be found at the beginning of a word
+        if (line[i] == '~' && i + 1 < len && line[i + 1] == '/') {
+            if (arena_put(&lx->arena, ctx->home, strlen(ctx->home)) == -1) return NULL;
+            if (record && lex_record(lx, LEX_HOME, i, 1) == -1) return NULL;
+            i++;  // keep the slash
+        }
+
+        // copy runs of plain characters, expanding each "$" needle in place
+        while (i < cmd_len && !lx->is_delim[(unsigned char) line[i]]) {
+            size_t run = i;
+            while (run < cmd_len && line[run] != '$' && !lx->is_delim[(unsigned char) line[run]]) run++;
+            if (run > i && arena_put(&lx->arena, line + i, run - i) == -1) return NULL;
+            if (record && run > i && lex_record(lx, LEX_LITERAL, i, run - i) == -1) return NULL;
+            if (!glob && run > i) {
+                glob = glob_has_magic(line + i, run - i) || (open_set && memchr(line + i, ']', run - i));
+                if (memchr(line + i, '[', run - i)) open_set = 1;
+            }
+            i = run;
+            if (i == cmd_len || line[i] != '$') continue;
+
+            size_t dollar = i;
+            i = expand_dollar(lx, line, cmd_len, i, ctx);
+            if (i == EXPAND_FAILED) return NULL;
+            if (record && lex_record(lx, LEX_DOLLAR, dollar, i - dollar) == -1) return NULL;
+        }
+
+        if (delim_next) {  // a delimiter is matched as it is written, the word is replaced by the body
+            glob = 0;
+            if (ndocs < LEX_HEREDOC_MAX) {
+                doc_words[ndocs] = count;
+                docs[ndocs++] = (struct lex_seg) { LEX_LITERAL, start, i - start };
+            }
+            delim_next = 0;
+        }
+        if (lex_end_word(lx, &count, glob) == -1) return NULL;
+        if (record && lex_record(lx, glob ? LEX_GLOB_END : LEX_WORD_END, i, 0) == -1) return NULL;
+    }
+
+    if (lex_push(lx, count, NULL) == -1) return NULL;
+    if (ndocs > 0 && lex_bodies(lx, line, len, cmd_len + 1, docs, doc_words, ndocs, ctx) == -1) return NULL;
+    *word_count = count;
+    return lx->words;
+}
+
+/*
+* Function to expand a line again from the segments lex_line() recorded for it:
+* literals are copied and only the "$" needles and "~/" are expanded, without
+* scanning for delimiters. The result is the same as lex_line() on the line.
+* Returns NULL if memory could not be allocated.
+*/
+char **lex_expand(struct lexer *lx, const char *line, const struct lex_seg *segs, size_t nsegs,
+                  const struct expand_ctx *ctx, int *word_count)
+{
+    size_t count = 0;
+
+    for (size_t s = 0; s < nsegs; s++) {
+        const struct lex_seg *seg = &segs[s];
+        switch (seg->kind) {
+        case LEX_LITERAL:
+            if (arena_put(&lx->arena, line + seg->off, seg->len) == -1) return NULL;
+            break;
+        case LEX_DOLLAR:
+            if (expand_dollar(lx, line, seg->off + seg->len, seg->off, ctx) == EXPAND_FAILED) return NULL;
+            break;
+        case LEX_HOME:
+            if (arena_put(&lx->arena, ctx->home, strlen(ctx->home)) == -1) return NULL;
+            break;
+        case LEX_WORD_END:
+        case LEX_GLOB_END:
+            if (lex_end_word(lx, &count, seg->kind == LEX_GLOB_END) == -1) return NULL;
+            break;
+        case LEX_HEREDOC_END:  // comes after the last word
+            lx->words[seg->len] = arena_close(&lx->arena);
+            if (lx->words[seg->len] == NULL) return NULL;
+            break;
+        }
+    }
+    if (lex_push(lx, count, NULL) == -1) return NULL;
+    *word_count = count;
+    return lx->words;
+}
+
+/* Function to find a needle substring in a haystack string and replace with sub.
+* Returns the final string with the replacement.
+*/
+char *str_gsub(char *restrict *restrict haystack, char const *restrict needle, char const *restrict sub) {
+    char *str = *haystack;
+    size_t haystack_len = strlen(str);
+    size_t const needle_len = strlen(needle),
+                sub_len = strlen(sub);
+
+    for (; (str = strstr(str, needle)); ) {
+        ptrdiff_t off = str - *haystack;
+        if (sub_len > needle_len) {
+            str = realloc(*haystack, sizeof **haystack * (haystack_len + sub_len - needle_len + 1));
+            if (!str) goto exit;
+            *haystack = str;
+            str = *haystack + off;
+        }
+        memmove(str + sub_len, str + needle_len, haystack_len + 1 - off - needle_len);
+        memcpy(str, sub, sub_len);
+        haystack_len = haystack_len + sub_len - needle_len;
+        str += sub_len;
+    }
+    str = *haystack;
+    if (sub_len < needle_len) {
+        str = realloc(*haystack, sizeof **haystack * (haystack_len + 1));
+        if (!str) goto exit;
+        *haystack = str;
+    }
+
+exit:
+    return str;
+}
@@ -0,0 +1,310 @@
+/* Per-job resource settings, the "limit" prefix.
+*   limit [-a CPUS] [-n NICE] [-i CLASS[:LEVEL]] [-r NAME=VALUE]... [-g CGROUP [-c CPU%] [-m BYTES]] cmd
+* pins a command or pipeline to a set of CPUs, raises its niceness, sets its
+* I/O scheduling class, lowers its RLIMIT_* values and places it in a cgroup v2
+* directory whose cpu.max / memory.max are written first. The settings are
+* parsed once into a struct limits with no pointers, so the line cache can keep a
+* copy, and applied by the child between fork() and exec, which is why a
+* command with limits is always launched with fork() (see spawn.c).
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+#include <limits.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/statfs.h>
+
+#define CGROUP_ROOT       "/sys/fs/cgroup"
+#define CPU_MAX_PERIOD    100000    // cpu.max period in microseconds, -c is a share of it
+#define CGROUP2_MAGIC     0x63677270  // statfs() f_type of a cgroup v2 mount
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+enum { LIMIT_CPUS = 1, LIMIT_NICE = 2, LIMIT_IOPRIO = 4, LIMIT_CPU_MAX = 8, LIMIT_MEM_MAX = 16 };
+
+struct limits {
+    size_t size;           // bytes taken by the whole struct, cgroup path included
+    int set;               // LIMIT_* bits of the settings given
+    cpu_set_t cpus;        // -a
+    int nice;              // -n, added to the niceness
+    int ioprio;            // -i, as ioprio_set() takes it
+    int nrlimits;
+    struct { int resource; rlim_t value; } rlimits[RLIM_NLIMITS];  // -r
+    long long cpu_max;     // -c, quota per CPU_MAX_PERIOD, -1 for "max"
+    long long mem_max;     // -m, -1 for "max"
+    char cgroup[];         // -g, resolved under CGROUP_ROOT, "" for none
+};
+
+static const struct { const char *name; int resource; } rlimit_names[] = {
+    { "as", RLIMIT_AS }, { "core", RLIMIT_CORE }, { "cpu", RLIMIT_CPU }, { "data", RLIMIT_DATA },
+    { "fsize", RLIMIT_FSIZE }, { "locks", RLIMIT_LOCKS }, { "memlock", RLIMIT_MEMLOCK },
+    { "msgqueue", RLIMIT_MSGQUEUE }, { "nice", RLIMIT_NICE }, { "nofile", RLIMIT_NOFILE },
+    { "nproc", RLIMIT_NPROC }, { "rss", RLIMIT_RSS }, { "rtprio", RLIMIT_RTPRIO },
+    { "rttime", RLIMIT_RTTIME }, { "sigpending", RLIMIT_SIGPENDING }, { "stack", RLIMIT_STACK },
+};
+
+/* Function to parse a count with an optional K, M or G suffix (or "max" / "unlimited" as -1) */
+static int parse_size(const char *s, long long *value)
+{
+    if (strcmp(s, "max") == 0 || strcmp(s, "unlimited") == 0) {
+        *value = -1;
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (end == s || errno != 0 || v < 0) return -1;
+    switch (*end) {
+    case 'G': case 'g': v <<= 10;  // fall through
+    case 'M': case 'm': v <<= 10;  // fall through
+    case 'K': case 'k': v <<= 10; end++;
+    }
+    if (*end != '\0') return -1;
+    *value = v;
+    return 0;
+}
+
+/* Function to parse a CPU list like "0-3,8" into *set */
+static int parse_cpus(const char *s, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    while (*s != '\0') {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s || lo < 0) return -1;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo) return -1;
+        }
+        if (hi >= CPU_SETSIZE) return -1;
+        for (long cpu = lo; cpu <= hi; cpu++) CPU_SET(cpu, set);
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        s = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/* Function to parse an I/O class, "idle", "be[:LEVEL]" or "rt[:LEVEL]" (or 3, 2, 1) */
+static int parse_ioprio(const char *s, int *ioprio)
+{
+    static const char *classes[] = { "rt", "be", "idle" };
+    int class = 0, level = 4;
+    size_t len = strcspn(s, ":");
+    for (int i = 0; i < 3; i++) {
+        if ((strlen(classes[i]) == len && strncmp(s, classes[i], len) == 0) ||
+            (len == 1 && s[0] == '1' + i)) class = i + 1;
+    }
+    if (class == 0) return -1;
+    if (s[len] == ':') {
+        char *end;
+        level = strtol(s + len + 1, &end, 10);
+        if (end == s + len + 1 || *end != '\0' || level < 0 || level > 7) return -1;
+    }
+    if (class == 3) level = 0;
+    *ioprio = class << IOPRIO_CLASS_SHIFT | level;
+    return 0;
+}
+
+/* Function to parse NAME=VALUE into the next rlimit slot */
+static int parse_rlimit(const char *s, struct limits *lim)
+{
+    const char *eq = strchr(s, '=');
+    long long value;
+    if (eq == NULL || parse_size(eq + 1, &value) == -1) return -1;
+    for (size_t i = 0; i < sizeof rlimit_names / sizeof rlimit_names[0]; i++) {
+        if (strlen(rlimit_names[i].name) == (size_t) (eq - s) && strncmp(s, rlimit_names[i].name, eq - s) == 0) {
+            int n = 0;
+            while (n < lim->nrlimits && lim->rlimits[n].resource != rlimit_names[i].resource) n++;
+            if (n == RLIM_NLIMITS) return -1;
+            lim->rlimits[n].resource = rlimit_names[i].resource;
+            lim->rlimits[n].value = value < 0 ? RLIM_INFINITY : (rlim_t) value;
+            if (n == lim->nrlimits) lim->nrlimits++;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+* Function to parse the options of a "limit" prefix starting at words[at] into a
+* struct limits allocated from the arena. Options end at the first word that
+* isn't one, which must start the command.
+* Returns the index of that word, or -1 on a syntax error (which has been reported).
+*/
+int parse_limits(struct arena *a, char **words, int word_count, int at, struct limits **out)
+{
+    struct limits lim = { .nice = 0 };
+    const char *cgroup = NULL;
+    for (; at + 1 < word_count && words[at][0] == '-' && words[at][1] != '\0' && words[at][2] == '\0'; at += 2) {
+        const char *arg = words[at + 1];
+        int bad = 0;
+        char *end;
+        switch (words[at][1]) {
+        case 'a':
+            bad = parse_cpus(arg, &lim.cpus) == -1;
+            lim.set |= LIMIT_CPUS;
+            break;
+        case 'n':
+            errno = 0;
+            lim.nice = strtol(arg, &end, 10);
+            bad = end == arg || *end != '\0' || errno != 0;
+            lim.set |= LIMIT_NICE;
+            break;
+        case 'i':
+            bad = parse_ioprio(arg, &lim.ioprio) == -1;
+            lim.set |= LIMIT_IOPRIO;
+            break;
+        case 'r':
+            bad = parse_rlimit(arg, &lim) == -1;
+            break;
+        case 'g':
+            cgroup = arg;
+            break;
+        case 'c':  // a percentage of one CPU, "150%" is one and a half
+            lim.cpu_max = -1;
+            if (strcmp(arg, "max") != 0) {
+                double pct = strtod(arg, &end);
+                bad = end == arg || strcmp(end, "%") != 0 || pct <= 0;
+                lim.cpu_max = pct * CPU_MAX_PERIOD / 100;
+                if (lim.cpu_max < 1000) lim.cpu_max = 1000;  // the kernel's minimum quota
+            }
+            lim.set |= LIMIT_CPU_MAX;
+            break;
+        case 'm':
+            bad = parse_size(arg, &lim.mem_max) == -1;
+            lim.set |= LIMIT_MEM_MAX;
+            break;
+        default:
+            fprintf(stderr, "smallsh: limit: unknown option \"%s\"\n", words[at]);
+            return -1;
+        }
+        if (bad) {
+            fprintf(stderr, "smallsh: limit: invalid %s \"%s\"\n", words[at], arg);
+            return -1;
+        }
+    }
+    if (at >= word_count) {
+        fprintf(stderr, "smallsh: limit: no command\n");
+        return -1;
+    }
+    if ((lim.set & (LIMIT_CPU_MAX | LIMIT_MEM_MAX)) && cgroup == NULL) {
+        fprintf(stderr, "smallsh: limit: -c and -m need a cgroup (-g)\n");
+        return -1;
+    }
+
+    // a relative cgroup is taken from the root of the cgroup v2 hierarchy
+    size_t path_len = cgroup == NULL ? 0 : strlen(cgroup) + (cgroup[0] != '/' ? sizeof CGROUP_ROOT : 0);
+    lim.size = sizeof lim + path_len + 1;
+    *out = arena_alloc(a, lim.size);
+    if (*out == NULL) {
+        perror("memory allocation error");
+        return -1;
+    }
+    memcpy(*out, &lim, sizeof lim);
+    (*out)->cgroup[0] = '\0';
+    if (cgroup != NULL) {
+        snprintf((*out)->cgroup, path_len + 1, "%s%s%s", cgroup[0] != '/' ? CGROUP_ROOT : "",
+                 cgroup[0] != '/' ? "/" : "", cgroup);
+    }
+    return at;
+}
+
+/* Function to get the number of bytes a struct limits takes, for copying it */
+size_t limits_size(const struct limits *lim)
+{
+    return lim->size;
+}
+
+/* Function to write value into the file name of a cgroup directory */
+static int cgroup_write(const char *dir, const char *name, const char *value)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t n = write(fd, value, strlen(value));
+    int err = errno;
+    close(fd);
+    errno = err;
+    return n == -1 ? -1 : 0;
+}
+
+/*
+* Function to set up the cgroup of a "limit" prefix in the shell before the job is
+* launched: create the directory if needed and write its cpu.max and memory.max.
+* Returns 0, or -1 if that failed (which has been reported).
+*/
+int limits_prepare(const struct limits *lim)
+{
+    char value[64], parent[PATH_MAX];
+    struct statfs fs;
+    if (lim->cgroup[0] == '\0') return 0;
+    // the directory it goes in has to be part of a cgroup v2 hierarchy
+    char *slash = strrchr(lim->cgroup, '/');
+    snprintf(parent, sizeof parent, "%.*s", (int) (slash - lim->cgroup), lim->cgroup);
+    if (statfs(slash == lim->cgroup ? "/" : parent, &fs) == -1 || fs.f_type != CGROUP2_MAGIC) {
+        fprintf(stderr, "smallsh: limit: %s: not in a cgroup v2 hierarchy\n", lim->cgroup);
+        return -1;
+    }
+    if (mkdir(lim->cgroup, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "smallsh: limit: %s: %s\n", lim->cgroup, strerror(errno));
+        return -1;
+    }
+    if (lim->set & LIMIT_CPU_MAX) {
+        if (lim->cpu_max < 0) snprintf(value, sizeof value, "max %d", CPU_MAX_PERIOD);
+        else snprintf(value, sizeof value, "%lld %d", lim->cpu_max, CPU_MAX_PERIOD);
+        if (cgroup_write(lim->cgroup, "cpu.max", value) == -1) {
+            fprintf(stderr, "smallsh: limit: %s/cpu.max: %s\n", lim->cgroup, strerror(errno));
+            return -1;
+        }
+    }
+    if (lim->set & LIMIT_MEM_MAX) {
+        if (lim->mem_max < 0) snprintf(value, sizeof value, "max");
+        else snprintf(value, sizeof value, "%lld", lim->mem_max);
+        if (cgroup_write(lim->cgroup, "memory.max", value) == -1) {
+            fprintf(stderr, "smallsh: limit: %s/memory.max: %s\n", lim->cgroup, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+* Function to apply a "limit" prefix to the calling process, in the child before exec.
+* The cgroup comes first so that everything after it is accounted there.
+* Returns 0, or -1 if a setting could not be applied (which has been reported).
+*/
+int limits_apply(const struct limits *lim)
+{
+    if (lim->cgroup[0] != '\0' && cgroup_write(lim->cgroup, "cgroup.procs", "0") == -1) {
+        fprintf(stderr, "smallsh: limit: %s/cgroup.procs: %s\n", lim->cgroup, strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < lim->nrlimits; i++) {
+        struct rlimit rl = { lim->rlimits[i].value, lim->rlimits[i].value };
+        if (setrlimit(lim->rlimits[i].resource, &rl) == -1) {
+            perror("smallsh: limit: setrlimit()");
+            return -1;
+        }
+    }
+    if ((lim->set & LIMIT_IOPRIO) && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, lim->ioprio) == -1) {
+        perror("smallsh: limit: ioprio_set()");
+        return -1;
+    }
+    if (lim->set & LIMIT_NICE) {
+        errno = 0;
+        int prio = getpriority(PRIO_PROCESS, 0);
+        if (errno != 0 || setpriority(PRIO_PROCESS, 0, prio + lim->nice) == -1) {
+            perror("smallsh: limit: setpriority()");
+            return -1;
+        }
+    }
+    if ((lim->set & LIMIT_CPUS) && sched_setaffinity(0, sizeof lim->cpus, &lim->cpus) == -1) {
+        perror("smallsh: limit: sched_setaffinity()");
+        return -1;
+    }
+    return 0;
+}
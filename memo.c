@@ -0,0 +1,393 @@
+/* The memo builtin.
+* "memo [-e NAME]... [-d FILE]... cmd args..." runs a deterministic command
+* once and replays its result afterwards. The key is made of the argv, the
+* cwd, the executable, the variables named with -e, and the inode, size and
+* mtime of the "<" input (the text of a here-document) and of each -d
+* dependency. A command reading a pipe, terminal or socket is just run. On a
+* hit the stored stdout (or ">" file contents) is copied out and the stored
+* exit status returned, without forking. On a miss the command is spawned
+* with its stdout going into a new store entry, which is then copied out the
+* same way.
+* Entries are files in SMALLSH_MEMO_DIR (default ~/.cache/smallsh-memo) named
+* by a hash of the key, and hold the whole key so a hash collision is a miss.
+* A hit touches the entry's mtime, and when the store grows past
+* SMALLSH_MEMO_MAX (default 256M) the least recently used entries are removed.
+* stderr is not stored, and a command killed by a signal is not kept.
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+#include <dirent.h>
+#include <sys/sendfile.h>
+
+#define MEMO_MAGIC      "smemo1\n"     // 8 bytes with its NUL
+#define MEMO_DEFAULT_MAX (256 << 20)   // store size cap without SMALLSH_MEMO_MAX
+#define MEMO_NAME_LEN   16             // hex digits in an entry's name
+
+// Start of an entry, followed by the key and then the output
+struct memo_header {
+    char magic[8];
+    uint32_t key_len;
+    int32_t status;      // exit status of the command
+    uint64_t out_len;
+};
+
+// Key being built, fields are length-prefixed so no two keys run together
+struct memo_key {
+    char *buf;
+    size_t len, cap;
+    int failed;
+};
+
+/* Function to append a field to the key */
+static void key_put(struct memo_key *k, const void *data, size_t n)
+{
+    uint32_t len = n;
+    if (k->len + sizeof len + n > k->cap) {
+        size_t cap = k->cap ? k->cap : 1024;
+        while (cap < k->len + sizeof len + n) cap *= 2;
+        char *buf = realloc(k->buf, cap);
+        if (buf == NULL) {
+            k->failed = 1;
+            return;
+        }
+        k->buf = buf;
+        k->cap = cap;
+    }
+    memcpy(k->buf + k->len, &len, sizeof len);
+    memcpy(k->buf + k->len + sizeof len, data, n);
+    k->len += sizeof len + n;
+}
+
+static void key_put_str(struct memo_key *k, const char *s)
+{
+    key_put(k, s, strlen(s) + 1);
+}
+
+/* Function to add what identifies a file's contents: its inode, size and mtime */
+static void key_put_stat(struct memo_key *k, const struct stat *st)
+{
+    int64_t id[5] = { st->st_dev, st->st_ino, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec };
+    key_put(k, id, sizeof id);
+}
+
+/* Function to add a dependency file, or the fact that it doesn't exist */
+static void key_put_file(struct memo_key *k, const char *path)
+{
+    struct stat st;
+    key_put_str(k, path);
+    if (stat(path, &st) == 0) key_put_stat(k, &st);
+    else key_put(k, "", 0);
+}
+
+/* FNV-1a hash of data[0..len) */
+static uint64_t memo_hash(const char *data, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+* Function to find (and create) the store directory, in dir.
+* Returns 0, or -1 if it can't be made.
+*/
+static int memo_dir(char *dir, size_t size)
+{
+    const char *env = var_get("SMALLSH_MEMO_DIR"), *home = var_get("HOME");
+    if (env != NULL && *env != '\0') {
+        snprintf(dir, size, "%s", env);
+    } else {
+        if (home == NULL) home = "/tmp";
+        snprintf(dir, size, "%s/.cache", home);
+        mkdir(dir, 0700);
+        snprintf(dir, size, "%s/.cache/smallsh-memo", home);
+    }
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        fprintf(stderr, "memo: %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Function to get the store size cap, SMALLSH_MEMO_MAX bytes with an optional K, M or G */
+static uint64_t memo_max(void)
+{
+    const char *env = var_get("SMALLSH_MEMO_MAX");
+    if (env == NULL || *env == '\0') return MEMO_DEFAULT_MAX;
+    char *end;
+    uint64_t max = strtoull(env, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': max <<= 10;  // fall through
+    case 'M': case 'm': max <<= 10;  // fall through
+    case 'K': case 'k': max <<= 10;
+    }
+    return max;
+}
+
+/* Function to copy len bytes of fd from off to stdout */
+static int copy_out(int fd, off_t off, uint64_t len)
+{
+    char buf[8192];
+    fflush(stdout);
+    while (len > 0) {
+        ssize_t n = sendfile(1, fd, &off, len);
+        if (n > 0) {
+            len -= n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n == 0) return -1;  // entry shorter than its header says
+        // sendfile() can't write to every kind of stdout, copy the rest by hand
+        n = pread(fd, buf, len < sizeof buf ? len : sizeof buf, off);
+        if (n <= 0 || write(1, buf, n) != n) return -1;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+* Function to replay the entry at path if it holds key.
+* Returns the stored exit status, or -1 on a miss.
+*/
+static int memo_replay(const char *path, const struct memo_key *key)
+{
+    struct memo_header h;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+
+    int status = -1;
+    char *stored = malloc(key->len ? key->len : 1);
+    if (stored != NULL && pread(fd, &h, sizeof h, 0) == sizeof h && memcmp(h.magic, MEMO_MAGIC, 8) == 0 &&
+        h.key_len == key->len && pread(fd, stored, key->len, sizeof h) == (ssize_t) key->len &&
+        memcmp(stored, key->buf, key->len) == 0) {
+        copy_out(fd, sizeof h + key->len, h.out_len);
+        status = h.status;
+        futimens(fd, NULL);  // recently used, evicted last
+    }
+    free(stored);
+    close(fd);
+    return status;
+}
+
+/* Function to check that a file name is one memo gives entries, MEMO_NAME_LEN hex digits */
+static int is_entry(const char *name)
+{
+    size_t n = strspn(name, "0123456789abcdef");
+    return n == MEMO_NAME_LEN && name[n] == '\0';
+}
+
+// An entry of the store, for eviction
+struct memo_file {
+    char name[MEMO_NAME_LEN + 1];
+    off_t size;
+    struct timespec mtime;
+};
+
+static int compare_age(const void *a, const void *b)
+{
+    const struct memo_file *x = a, *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec) return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    return (x->mtime.tv_nsec > y->mtime.tv_nsec) - (x->mtime.tv_nsec < y->mtime.tv_nsec);
+}
+
+/* Function to remove the least recently used entries until the store fits in max bytes */
+static void memo_evict(const char *dir, uint64_t max)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL) return;
+    int dfd = dirfd(d);
+    struct memo_file *files = NULL;
+    size_t n = 0, cap = 0;
+    uint64_t total = 0;
+    struct dirent *e;
+    struct stat st;
+
+    while ((e = readdir(d)) != NULL) {
+        if (!is_entry(e->d_name)) continue;
+        if (fstatat(dfd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode)) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            struct memo_file *list = realloc(files, cap * sizeof *list);
+            if (list == NULL) break;
+            files = list;
+        }
+        memcpy(files[n].name, e->d_name, sizeof files[n].name);  // is_entry() checked its length
+        files[n].size = st.st_size;
+        files[n].mtime = st.st_mtim;
+        total += st.st_size;
+        n++;
+    }
+    if (total > max) {
+        qsort(files, n, sizeof *files, compare_age);
+        for (size_t i = 0; i < n && total > max; i++) {
+            if (unlinkat(dfd, files[i].name, 0) == 0) total -= files[i].size;
+        }
+    }
+    free(files);
+    closedir(d);
+}
+
+/*
+* Function to launch argv in the foreground with its stdout on stdout_fd (-1 for the shell's)
+* and wait for it. Returns its wait status, or -1 if it could not be launched.
+*/
+static int memo_spawn(char **argv, int stdout_fd)
+{
+    struct command cmd = {0};
+    cmd.argv = argv;
+    cmd.stdin_fd = -1;   // the "<" file, if any, is already the shell's stdin
+    cmd.stdout_fd = stdout_fd;
+    cmd.pgid = -1;       // stay in the shell's process group, so ^C reaches it
+    cmd.tty_fd = -1;
+    jobs_init();  // not done at startup for -c
+    fflush(stdout);
+    pid_t pid = spawn_command(&cmd);
+    if (pid < 0) return -1;
+    int status;
+    job_add(pid, 0, argv[0]);
+    while (!job_check_fg(pid, &status)) job_wait_fd(-1);
+    return status;
+}
+
+/*
+* Function to run cmd with its stdout going into a new entry for key, then
+* copy the output out and keep the entry as path.
+* Returns the command's exit status (or signal number).
+*/
+static int memo_run(char **argv, const char *dir, const char *path, const struct memo_key *key)
+{
+    char tmp[PATH_MAX];
+    struct memo_header h = { .key_len = key->len };
+    memcpy(h.magic, MEMO_MAGIC, 8);
+
+    snprintf(tmp, sizeof tmp, "%s/.tmp-XXXXXX", dir);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "memo: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    // the child shares the file offset, so its output lands after the key
+    if (write(fd, &h, sizeof h) != sizeof h || write(fd, key->buf, key->len) != (ssize_t) key->len) {
+        fprintf(stderr, "memo: %s: %s\n", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return 1;
+    }
+
+    int status = memo_spawn(argv, fd);
+    if (status == -1) {
+        close(fd);
+        unlink(tmp);
+        return 127;
+    }
+
+    struct stat st;
+    int keep = WIFEXITED(status) && fstat(fd, &st) == 0;
+    if (keep) {
+        h.status = WEXITSTATUS(status);
+        h.out_len = st.st_size - sizeof h - key->len;
+        keep = pwrite(fd, &h, sizeof h, 0) == sizeof h;
+    }
+    if (fstat(fd, &st) == 0) copy_out(fd, sizeof h + key->len, st.st_size - sizeof h - key->len);
+    close(fd);
+    if (keep && rename(tmp, path) == 0) {
+        memo_evict(dir, memo_max());
+    } else {
+        unlink(tmp);
+    }
+    return job_status_code(status);
+}
+
+/* Function to empty the store (only its entries, in case it was pointed at a directory with other files) */
+static int memo_clear(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL) return 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (is_entry(e->d_name)) unlinkat(dirfd(d), e->d_name, 0);
+    }
+    closedir(d);
+    return 0;
+}
+
+/*
+* Builtin memo [-e NAME]... [-d FILE]... cmd [args], or memo -r to empty the store.
+* Returns the command's exit status, stored or fresh, 1 if the store can't be
+* used, 2 on a usage error.
+*/
+int builtin_memo(char **argv)
+{
+    char dir[PATH_MAX - 64], path[PATH_MAX];
+    struct memo_key key = {0};
+    char **names = argv + 1, **deps;
+    int i = 1;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-r") == 0 && argv[2] == NULL) {
+        return memo_dir(dir, sizeof dir) == -1 ? 1 : memo_clear(dir);
+    }
+    // -e names and -d files are left in argv[1..] and gone through once the key is built
+    while (argv[i] != NULL && (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "-d") == 0) && argv[i + 1] != NULL) i += 2;
+    if (argv[i] == NULL) {
+        fprintf(stderr, "memo: usage: memo [-e NAME]... [-d FILE]... cmd [args] | memo -r\n");
+        return 2;
+    }
+    char **cmd = argv + i;
+    if (memo_dir(dir, sizeof dir) == -1) return 1;
+
+    // the command and how it is run
+    for (char **arg = cmd; *arg != NULL; arg++) key_put_str(&key, *arg);
+    key_put(&key, "", 0);
+    char cwd[PATH_MAX];
+    key_put_str(&key, getcwd(cwd, sizeof cwd) != NULL ? cwd : "");
+    const char *exe = path_lookup(cmd[0]);
+    if (exe == NULL) {
+        fprintf(stderr, "%s: %s\n", cmd[0], strerror(ENOENT));
+        return 127;
+    }
+    key_put_file(&key, exe);
+
+    // its inputs: stdin, the selected variables and the dependencies
+    // (a here-document is keyed by its text, a file by its inode, and a pipe, terminal
+    // or socket can't be keyed at all, so the command just runs)
+    const struct command *self = builtin_command;
+    struct stat st;
+    if (self != NULL && (self->here_doc != NULL || self->here_string != NULL)) {
+        key_put_str(&key, self->here_doc != NULL ? "<<" : "<<<");
+        key_put_str(&key, self->here_doc != NULL ? self->here_doc : self->here_string);
+    } else if (fstat(0, &st) == 0 && S_ISREG(st.st_mode)) {
+        key_put_str(&key, "<");
+        key_put_stat(&key, &st);
+    } else if (fstat(0, &st) == -1 || S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || isatty(0)) {
+        free(key.buf);
+        int status = memo_spawn(cmd, -1);
+        return status == -1 ? 127 : job_status_code(status);
+    } else {
+        key_put(&key, "", 0);
+    }
+    for (deps = names; deps < cmd; deps += 2) {
+        if (strcmp(deps[0], "-e") != 0) continue;
+        const char *value = var_get(deps[1]);
+        key_put_str(&key, deps[1]);
+        key_put(&key, value != NULL ? value : "", value != NULL ? strlen(value) + 1 : 0);
+    }
+    for (deps = names; deps < cmd; deps += 2) {
+        if (strcmp(deps[0], "-d") == 0) key_put_file(&key, deps[1]);
+    }
+    if (key.failed) {
+        perror("memory allocation error");
+        free(key.buf);
+        return 1;
+    }
+
+    snprintf(path, sizeof path, "%s/%016" PRIx64, dir, memo_hash(key.buf, key.len));
+    int status = memo_replay(path, &key);
+    if (status == -1) status = memo_run(cmd, dir, path, &key);
+    free(key.buf);
+    return status;
+}
@@ -0,0 +1,429 @@
+/* The parallel builtin.
+* "parallel [-j N] [-k] cmd args... ::: input..." runs cmd once per input, with
+* "{}" in its words replaced by the input (or the input appended when there is
+* no "{}"). Without ":::" the inputs are the lines of stdin. At most N jobs run
+* at once (the number of online CPUs by default), and the next one is started
+* as soon as one finishes. With -k each job's output is collected in a memfd
+* and written out in input order.
+* With -X each job gets as many inputs as fit in ARG_MAX next to the command
+* and the environment, like xargs, so a list too long for one exec runs in the
+* fewest commands (a "{}" word is replaced by the whole batch, other words are
+* kept as they are).
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#define PARALLEL_MAX_FAILED 101  // $? is the number of failed jobs, capped like GNU parallel
+#define PARALLEL_ARG_SLACK  4096  // bytes of ARG_MAX left unused with -X, as xargs does
+
+// stdin holds the inputs, jobs read /dev/null instead
+static struct redir devnull_in = { 0, REDIR_OPEN, O_RDONLY, -1, "/dev/null" };
+
+// A job started with -k whose output hasn't been written out yet
+struct pjob {
+    int out_fd;    // memfd holding its output
+    int done;
+};
+
+// A running job, the slots are kept packed so a wakeup only looks at the jobs in flight
+struct pslot {
+    pid_t pid;
+    size_t seq;    // its place in the input order
+};
+
+struct parallel {
+    char **template;     // the command words, NULL-terminated
+    int ntemplate;
+    int has_braces;      // 1 if some word contains "{}"
+    char **inputs;       // inputs after ":::", or NULL to read stdin
+    char *line_buf;      // stdin reader
+    size_t line_cap, line_start, line_end;
+    int line_eof;
+    int keep_order;      // -k
+    struct pjob *queue;  // -k jobs in input order not yet written out, a ring
+    size_t queue_cap, queue_head, queue_len;
+    size_t retired;      // jobs taken off the queue so far, the seq of its head
+    struct pslot *slots; // running jobs
+    size_t running;
+    int failed;
+    int stop;            // a job was interrupted, don't start new ones
+    // -X
+    int multi;           // 1 to pass many inputs per job
+    int copies;          // how many times a batch appears in the command
+    size_t arg_space;    // bytes of argv (strings and pointers) left for the inputs
+    char **batch;        // copies of the inputs for the next job
+    size_t batch_len, batch_cap;
+    char *held;          // an input that didn't fit in the last batch
+};
+
+/*
+* Function to return the next line of stdin, without its newline, valid until the next call.
+* Returns NULL at end of input.
+*/
+static char *next_line(struct parallel *p)
+{
+    for (;;) {
+        char *start = p->line_buf + p->line_start;
+        if (p->line_start < p->line_end) {
+            char *nl = memchr(start, '\n', p->line_end - p->line_start);
+            if (nl != NULL) {
+                *nl = '\0';
+                p->line_start = nl + 1 - p->line_buf;
+                return start;
+            }
+            if (p->line_eof && p->line_end < p->line_cap) {  // last line without a newline
+                p->line_buf[p->line_end] = '\0';
+                p->line_start = p->line_end;
+                return start;
+            }
+        } else if (p->line_eof) {
+            return NULL;
+        }
+
+        // move the partial line to the front, grow if it fills the buffer
+        memmove(p->line_buf, start, p->line_end - p->line_start);
+        p->line_end -= p->line_start;
+        p->line_start = 0;
+        if (p->line_end == p->line_cap) {
+            size_t cap = p->line_cap ? p->line_cap * 2 : 4096;
+            char *buf = realloc(p->line_buf, cap);
+            if (buf == NULL) {
+                perror("memory allocation error");
+                return NULL;
+            }
+            p->line_buf = buf;
+            p->line_cap = cap;
+        }
+        if (p->line_eof) continue;
+        ssize_t n = read(0, p->line_buf + p->line_end, p->line_cap - p->line_end);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) p->line_eof = 1;
+        else p->line_end += n;
+    }
+}
+
+/* Function to return the next input, NULL when there are no more */
+static const char *next_input(struct parallel *p)
+{
+    if (p->inputs == NULL) return next_line(p);
+    return *p->inputs != NULL ? *p->inputs++ : NULL;
+}
+
+/* Function to get the queue entry i places after the oldest job */
+static struct pjob *queue_at(struct parallel *p, size_t i)
+{
+    return &p->queue[(p->queue_head + i) & (p->queue_cap - 1)];
+}
+
+/* Function to append a job to the queue, growing the ring when it is full */
+static struct pjob *queue_push(struct parallel *p)
+{
+    if (p->queue_len == p->queue_cap) {
+        size_t cap = p->queue_cap ? p->queue_cap * 2 : 16;
+        struct pjob *queue = malloc(cap * sizeof *queue);
+        if (queue == NULL) return NULL;
+        for (size_t i = 0; i < p->queue_len; i++) queue[i] = *queue_at(p, i);
+        free(p->queue);
+        p->queue = queue;
+        p->queue_cap = cap;
+        p->queue_head = 0;
+    }
+    return queue_at(p, p->queue_len++);
+}
+
+/* Function to start cmd with input substituted. Returns the pid, or -1 if it couldn't be started */
+static pid_t start_job(struct parallel *p, const char *input, int out_fd)
+{
+    char *argv[p->ntemplate + 2];
+    struct command cmd = {0};
+    int argc = 0;
+
+    for (int i = 0; i < p->ntemplate; i++) {
+        argv[argc] = strdup(p->template[i]);
+        if (argv[argc] == NULL || str_gsub(&argv[argc], "{}", input) == NULL) {
+            perror("memory allocation error");
+            free(argv[argc]);
+            while (argc > 0) free(argv[--argc]);
+            return -1;
+        }
+        argc++;
+    }
+    if (!p->has_braces) argv[argc++] = (char *) input;
+    argv[argc] = NULL;
+
+    cmd.argv = argv;
+    cmd.stdin_fd = -1;
+    if (p->inputs == NULL) {  // stdin holds the inputs, keep jobs off it
+        cmd.redirs = &devnull_in;
+        cmd.nredirs = 1;
+    }
+    cmd.stdout_fd = out_fd;
+    cmd.pgid = -1;  // stay in the shell's process group, so ^C reaches the jobs
+    cmd.tty_fd = -1;
+    pid_t pid = spawn_command(&cmd);
+
+    for (int i = 0; i < p->ntemplate; i++) free(argv[i]);
+    return pid;
+}
+
+/* Function to get the argv space (strings and pointers) used by a list of strings */
+static size_t arg_size(char **list)
+{
+    size_t size = 0;
+    for (; *list != NULL; list++) size += strlen(*list) + 1 + sizeof *list;
+    return size;
+}
+
+/*
+* Function to collect the inputs for the next -X job in p->batch: as many as fit
+* in p->arg_space (always at least one). Returns the number collected, 0 at end of input.
+*/
+static size_t next_batch(struct parallel *p)
+{
+    size_t used = 0;
+    p->batch_len = 0;
+    for (;;) {
+        char *input = p->held;
+        p->held = NULL;
+        if (input == NULL) {
+            const char *next = next_input(p);
+            if (next == NULL) break;
+            if ((input = strdup(next)) == NULL) {  // a stdin line is only valid until the next read
+                perror("memory allocation error");
+                break;
+            }
+        }
+        size_t size = (strlen(input) + 1 + sizeof input) * p->copies;
+        if (p->batch_len > 0 && used + size > p->arg_space) {
+            p->held = input;
+            break;
+        }
+        if (p->batch_len == p->batch_cap) {
+            size_t cap = p->batch_cap ? p->batch_cap * 2 : 256;
+            char **batch = realloc(p->batch, cap * sizeof *batch);
+            if (batch == NULL) {
+                perror("memory allocation error");
+                free(input);
+                break;
+            }
+            p->batch = batch;
+            p->batch_cap = cap;
+        }
+        p->batch[p->batch_len++] = input;
+        used += size;
+    }
+    return p->batch_len;
+}
+
+/* Function to start cmd with the inputs in p->batch, which are freed. Returns the pid, or -1 */
+static pid_t start_batch(struct parallel *p, int out_fd)
+{
+    char **argv = malloc((p->ntemplate + p->batch_len * p->copies + 1) * sizeof *argv);
+    struct command cmd = {0};
+    pid_t pid = -1;
+    int argc = 0;
+
+    if (argv == NULL) {
+        perror("memory allocation error");
+    } else {
+        for (int i = 0; i < p->ntemplate; i++) {
+            if (strcmp(p->template[i], "{}") != 0) {
+                argv[argc++] = p->template[i];
+                continue;
+            }
+            memcpy(argv + argc, p->batch, p->batch_len * sizeof *argv);
+            argc += p->batch_len;
+        }
+        if (!p->has_braces) {
+            memcpy(argv + argc, p->batch, p->batch_len * sizeof *argv);
+            argc += p->batch_len;
+        }
+        argv[argc] = NULL;
+
+        cmd.argv = argv;
+        cmd.stdin_fd = -1;
+        if (p->inputs == NULL) {
+            cmd.redirs = &devnull_in;
+            cmd.nredirs = 1;
+        }
+        cmd.stdout_fd = out_fd;
+        cmd.pgid = -1;
+        cmd.tty_fd = -1;
+        pid = spawn_command(&cmd);
+        free(argv);
+    }
+    for (size_t i = 0; i < p->batch_len; i++) free(p->batch[i]);
+    p->batch_len = 0;
+    return pid;
+}
+
+/* Function to write a finished job's collected output to stdout */
+static void copy_output(int fd)
+{
+    char buf[8192];
+    off_t off = 0;
+    ssize_t n;
+
+    // sendfile() can't write to every kind of stdout, copy the rest by hand
+    while ((n = sendfile(1, fd, &off, 1 << 20)) > 0) {}
+    if (n == -1) {
+        lseek(fd, off, SEEK_SET);
+        while ((n = read(fd, buf, sizeof buf)) > 0) {
+            if (write(1, buf, n) != n) break;
+        }
+    }
+}
+
+/* Function to note that the job seq (in input order) has finished with status */
+static void finish_job(struct parallel *p, size_t seq, int status)
+{
+    if (p->keep_order) queue_at(p, seq - p->retired)->done = 1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) p->failed++;
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) p->stop = 1;
+}
+
+/* Function to retire the finished jobs at the head of the queue, writing out their output in order */
+static void retire_jobs(struct parallel *p)
+{
+    while (p->queue_len > 0 && p->queue[p->queue_head].done) {
+        struct pjob *job = &p->queue[p->queue_head];
+        if (job->out_fd >= 0) {
+            copy_output(job->out_fd);
+            close(job->out_fd);
+        }
+        p->queue_head = (p->queue_head + 1) & (p->queue_cap - 1);
+        p->queue_len--;
+        p->retired++;
+    }
+}
+
+/*
+* Builtin parallel [-j N] [-k] [-X] cmd [args] [::: inputs]
+* Returns the number of jobs that failed (capped at 101), 0 if all succeeded,
+* 2 on a usage error.
+*/
+int builtin_parallel(char **argv)
+{
+    struct parallel p = {0};
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+
+    // options
+    for (; argv[i] != NULL && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-k") == 0) {
+            p.keep_order = 1;
+        } else if (strcmp(argv[i], "-X") == 0) {
+            p.multi = 1;
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            const char *n = argv[i][2] != '\0' ? argv[i] + 2 : argv[++i];
+            if (n == NULL || (max_jobs = atol(n)) <= 0) {
+                fprintf(stderr, "parallel: -j needs a positive number\n");
+                return 2;
+            }
+        } else {
+            break;
+        }
+    }
+    if (max_jobs <= 0) max_jobs = 1;
+
+    // command words up to ":::"
+    p.template = argv + i;
+    while (argv[i] != NULL && strcmp(argv[i], ":::") != 0) {
+        if (p.multi ? strcmp(argv[i], "{}") == 0 : strstr(argv[i], "{}") != NULL) {
+            p.has_braces = 1;
+            p.copies++;
+        }
+        i++;
+    }
+    p.ntemplate = argv + i - p.template;
+    if (p.ntemplate == 0) {
+        fprintf(stderr, "parallel: usage: parallel [-j N] [-k] [-X] cmd [args] [::: inputs]\n");
+        return 2;
+    }
+    if (argv[i] != NULL) {
+        p.inputs = argv + i + 1;
+        argv[i] = NULL;  // ends the template
+    }
+    if (p.multi) {
+        // what is left of ARG_MAX once the command and the environment it is passed are counted
+        long arg_max = sysconf(_SC_ARG_MAX);
+        char **env = vars_environ();
+        size_t fixed = arg_size(p.template) + (env != NULL ? arg_size(env) : 0) + PARALLEL_ARG_SLACK;
+        p.arg_space = arg_max > 0 && (size_t) arg_max > fixed ? arg_max - fixed : 0;
+        if (p.copies == 0) p.copies = 1;
+    }
+
+    p.slots = malloc(max_jobs * sizeof *p.slots);
+    if (p.slots == NULL) {
+        perror("memory allocation error");
+        return 1;
+    }
+    jobs_init();  // not done at startup for -c
+    fflush(stdout);
+
+    size_t started = 0;
+    int more = 1;
+    for (;;) {
+        // fill the free slots
+        while (more && !p.stop && p.running < (size_t) max_jobs) {
+            const char *input = p.multi ? NULL : next_input(&p);
+            if (p.multi ? next_batch(&p) == 0 : input == NULL) {
+                more = 0;
+                break;
+            }
+            int out_fd = -1;
+            if (p.keep_order) {
+                struct pjob *job = queue_push(&p);
+                if (job == NULL) {
+                    perror("memory allocation error");
+                    more = 0;
+                    break;
+                }
+                out_fd = job->out_fd = memfd_create("parallel", MFD_CLOEXEC);
+                if (out_fd == -1) {  // its output would jump the queue
+                    perror("memfd_create() failed");
+                    p.queue_len--;
+                    p.failed++;
+                    more = 0;
+                    break;
+                }
+                job->done = 0;
+            }
+            pid_t pid = p.multi ? start_batch(&p, out_fd) : start_job(&p, input, out_fd);
+            if (pid > 0) {
+                job_add(pid, 0, p.template[0]);
+                p.slots[p.running++] = (struct pslot) { pid, started };
+            } else {
+                finish_job(&p, started, W_EXITCODE(pid == SPAWN_NOT_FOUND ? 127 : 1, 0));  // as if it exited
+            }
+            started++;
+        }
+        retire_jobs(&p);
+        if (p.running == 0) break;
+
+        // collect every job that has finished, and wait for more if none has
+        size_t finished = 0;
+        for (size_t j = 0; j < p.running; ) {
+            int status;
+            if (!job_check_fg(p.slots[j].pid, &status)) {
+                j++;
+                continue;
+            }
+            finish_job(&p, p.slots[j].seq, status);
+            p.slots[j] = p.slots[--p.running];
+            finished++;
+        }
+        if (finished == 0) job_wait_fd(-1);
+    }
+
+    for (size_t j = 0; j < p.batch_len; j++) free(p.batch[j]);
+    free(p.batch);
+    free(p.held);
+    free(p.queue);
+    free(p.slots);
+    free(p.line_buf);
+    return p.failed > PARALLEL_MAX_FAILED ? PARALLEL_MAX_FAILED : p.failed;
+}
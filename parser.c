@@ -0,0 +1,206 @@
+/* Parsing of an expanded word list into a pipeline.
+* "|" separates stages, redirection operators ("<", ">", ">>", "2>", "&>",
+* "2>&1", "3<&-" ...) become a list of steps applied in order, those that
+* name a file take the following word, "<<"
+* and "<<<" take it as the data for stdin (a here-document body, which the
+* lexer has put in place of the delimiter, or a here-string), a
+* trailing "&" runs the whole pipeline in the background, a leading "time"
+* reports the resources the pipeline used, a leading "timeout DURATION"
+* kills it if it runs for longer than that, and a leading "limit OPTIONS"
+* (after those two, see limits.c) sets its CPUs, priority, rlimits and cgroup. Operator words are
+* removed from the list in place, so every stage's argv points into the word
+* list produced by lex_line().
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+
+enum { REDIR_WORD_FILE = 1, REDIR_WORD_BOTH, REDIR_WORD_DONE };  // what redir_operator() found
+
+/* Function to reset a stage to a plain command: no redirection, pipes or process group */
+void command_init(struct command *cmd)
+{
+    memset(cmd, 0, sizeof *cmd);
+    cmd->stdin_fd = -1;
+    cmd->stdout_fd = -1;
+    cmd->pgid = -1;
+    cmd->tty_fd = -1;
+    cmd->pid = -1;
+}
+
+/*
+* Function to parse a duration like coreutils timeout: a number of seconds, with an
+* optional s, m, h or d suffix. Returns 0 and sets *secs, or -1 if s is not a duration.
+*/
+int parse_duration(const char *s, double *secs)
+{
+    char *end;
+    errno = 0;
+    double d = strtod(s, &end);
+    if (end == s || errno != 0 || d < 0) return -1;
+    switch (*end) {
+    case '\0':
+    case 's': break;
+    case 'm': d *= 60; break;
+    case 'h': d *= 3600; break;
+    case 'd': d *= 86400; break;
+    default: return -1;
+    }
+    if (*end != '\0' && end[1] != '\0') return -1;
+    *secs = d;
+    return 0;
+}
+
+/*
+* Function to recognize a redirection operator: [n]<, [n]>, [n]>> and &>, &>> (stdout
+* and stderr), which take the next word as the file, or [n]>&m, [n]<&m and [n]>&-.
+* n and m are single digits. Fills in *r (without the path) and returns
+* REDIR_WORD_FILE, REDIR_WORD_BOTH for "&>", REDIR_WORD_DONE, or 0 if word is not one.
+*/
+int redir_operator(const char *word, struct redir *r)
+{
+    const char *p = word;
+    int fd = -1;
+    if (*p >= '0' && *p <= '9') fd = *p++ - '0';
+    if (p[0] == '&' && p[1] == '>' && fd == -1) {  // &> and &>>
+        int append = p[2] == '>';
+        if (p[2 + append] != '\0') return 0;
+        *r = (struct redir) { 1, REDIR_OPEN, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), -1, NULL };
+        return REDIR_WORD_BOTH;
+    }
+    if (p[0] != '<' && p[0] != '>') return 0;
+    int out = p[0] == '>';
+    if (fd == -1) fd = out;
+    if (p[1] == '&') {  // duplicate or close
+        if (p[2] == '-' && p[3] == '\0') *r = (struct redir) { fd, REDIR_CLOSE, 0, -1, NULL };
+        else if (p[2] >= '0' && p[2] <= '9' && p[3] == '\0') *r = (struct redir) { fd, REDIR_DUP, 0, p[2] - '0', NULL };
+        else return 0;
+        return REDIR_WORD_DONE;
+    }
+    int flags;
+    if (p[1] == '\0') flags = out ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+    else if (out && p[1] == '>' && p[2] == '\0') flags = O_WRONLY | O_CREAT | O_APPEND;
+    else return 0;
+    *r = (struct redir) { fd, REDIR_OPEN, flags, -1, NULL };
+    return REDIR_WORD_FILE;
+}
+
+/*
+* Function to parse words[0..word_count) into pl. Stages are allocated from the arena.
+* Returns 0 on success, -1 on a syntax error (which has been reported).
+*/
+int parse_pipeline(struct arena *a, char **words, int word_count, struct pipeline *pl)
+{
+    pl->bg = 0;
+    pl->timed = 0;
+    pl->timeout = 0;
+    pl->kill_after = TIMEOUT_GRACE;
+    pl->limits = NULL;
+    pl->nstages = 1;
+    int first = 0;  // first word of the first stage
+
+    // "time" before a command times the whole pipeline (on its own it is just a command)
+    if (word_count > 1 && strcmp(words[0], "time") == 0) {
+        pl->timed = 1;
+        first = 1;
+    }
+    // "timeout [-k GRACE] DURATION" before a command sets its deadline (without a command it is one)
+    if (word_count > first + 2 && strcmp(words[first], "timeout") == 0) {
+        int at = first + 1;
+        if (strcmp(words[at], "-k") == 0) {
+            if (parse_duration(words[at + 1], &pl->kill_after) == -1) {
+                fprintf(stderr, "smallsh: timeout: invalid duration \"%s\"\n", words[at + 1]);
+                return -1;
+            }
+            at += 2;
+        }
+        if (at + 1 < word_count) {
+            if (parse_duration(words[at], &pl->timeout) == -1) {
+                fprintf(stderr, "smallsh: timeout: invalid duration \"%s\"\n", words[at]);
+                return -1;
+            }
+            first = at + 1;
+        }
+    }
+    // "limit -x ARG ... cmd" applies resource settings to the job (without an option it is a command)
+    if (word_count > first + 2 && strcmp(words[first], "limit") == 0 && words[first + 1][0] == '-') {
+        int end = word_count;
+        if (strcmp(words[end - 1], "&") == 0) end--;
+        first = parse_limits(a, words, end, first + 1, &pl->limits);
+        if (first == -1) return -1;
+    }
+
+    // check if process is to run in the background (if "&" found at the end)
+    if (word_count > 0 && strcmp(words[word_count - 1], "&") == 0) {
+        pl->bg = 1;
+        words[--word_count] = NULL;
+    }
+    pl->prefix = first;
+    for (int i = first; i < word_count; i++) {
+        if (strcmp(words[i], "|") == 0) pl->nstages++;
+    }
+
+    // every operator is at least one word, "&>" and its file make two steps
+    pl->stages = arena_alloc(a, pl->nstages * sizeof *pl->stages);
+    struct redir *redirs = arena_alloc(a, (word_count + 1) * sizeof *redirs), r;
+    if (pl->stages == NULL || redirs == NULL) {
+        perror("memory allocation error");
+        return -1;
+    }
+
+    struct command *cmd = pl->stages;
+    int out = 0;  // next free slot in the compacted word list
+    int start = 0;
+    int kind;
+    command_init(cmd);
+    cmd->redirs = redirs;
+    for (int i = first; i <= word_count; i++) {
+        char *word = words[i];
+        if (word == NULL || strcmp(word, "|") == 0) {
+            // end of the current stage
+            if (out == start) {
+                fprintf(stderr, "smallsh: syntax error near \"%s\"\n", word == NULL ? "newline" : word);
+                return -1;
+            }
+            words[out] = NULL;
+            cmd->argv = &words[start];
+            start = ++out;
+            redirs += cmd->nredirs;
+            if (word != NULL) {
+                command_init(++cmd);
+                cmd->redirs = redirs;
+            }
+        }
+        else if (strcmp(word, "<<") == 0 || strcmp(word, "<<<") == 0) {
+            if (i + 1 >= word_count || strcmp(words[i + 1], "|") == 0) {
+                fprintf(stderr, "smallsh: syntax error: %s needs a %s\n", word, word[2] == '\0' ? "delimiter" : "word");
+                return -1;
+            }
+            // the last input redirection wins
+            int kept = 0;
+            for (int k = 0; k < cmd->nredirs; k++) {
+                if (cmd->redirs[k].fd != 0) cmd->redirs[kept++] = cmd->redirs[k];
+            }
+            cmd->nredirs = kept;
+            cmd->here_doc = cmd->here_string = NULL;
+            if (word[2] == '\0') cmd->here_doc = words[++i];
+            else cmd->here_string = words[++i];
+        }
+        else if ((kind = redir_operator(word, &r)) != 0) {
+            if (kind != REDIR_WORD_DONE) {
+                if (i + 1 >= word_count || strcmp(words[i + 1], "|") == 0) {
+                    fprintf(stderr, "smallsh: syntax error: %s needs a file name\n", word);
+                    return -1;
+                }
+                r.path = words[++i];
+            }
+            if (r.fd == 0) cmd->here_doc = cmd->here_string = NULL;
+            cmd->redirs[cmd->nredirs++] = r;
+            if (kind == REDIR_WORD_BOTH) cmd->redirs[cmd->nredirs++] = (struct redir) { 2, REDIR_DUP, 0, 1, NULL };
+        }
+        else {
+            words[out++] = word;
+        }
+    }
+    return 0;
+}
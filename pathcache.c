@@ -0,0 +1,246 @@
+/* Hashed PATH lookup for external commands.
+* Command names are resolved once by walking PATH and the absolute path is kept
+* in an open-addressing hash table, so repeated commands are exec'd by path
+* without the failed execve() calls execvp() makes for every earlier PATH entry.
+* The table is dropped when PATH changes, and a single entry is dropped when
+* an exec through it fails with ENOENT.
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+
+#define PATH_CACHE_MIN 64  // initial number of slots (power of two)
+
+struct path_entry {
+    char *name;       // command name as typed, NULL if the slot is empty
+    char *path;       // absolute path it resolved to
+    unsigned hits;    // lookups answered from this entry
+};
+
+static struct path_entry *path_table = NULL;
+static size_t path_cap = 0;      // number of slots
+static size_t path_count = 0;    // number of used slots
+static char *path_seen = NULL;   // copy of PATH the table was built against
+static unsigned long path_hits = 0, path_misses = 0;
+
+/* FNV-1a hash of a NUL-terminated string */
+static size_t path_hash(const char *s)
+{
+    size_t h = 14695981039346656037ULL;
+    for (; *s; s++) {
+        h ^= (unsigned char) *s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Function to find the slot holding name, or the empty slot where it belongs */
+static size_t path_slot(const char *name)
+{
+    size_t mask = path_cap - 1;
+    size_t i = path_hash(name) & mask;
+    while (path_table[i].name != NULL && strcmp(path_table[i].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/* Function to empty the table, keeping its storage */
+static void path_clear(void)
+{
+    for (size_t i = 0; i < path_cap; i++) {
+        free(path_table[i].name);
+        free(path_table[i].path);
+        path_table[i].name = NULL;
+        path_table[i].path = NULL;
+        path_table[i].hits = 0;
+    }
+    path_count = 0;
+}
+
+/* Function to double the table size and reinsert every entry */
+static int path_grow(void)
+{
+    struct path_entry *old = path_table;
+    size_t old_cap = path_cap;
+    size_t new_cap = path_cap ? path_cap * 2 : PATH_CACHE_MIN;
+
+    struct path_entry *table = calloc(new_cap, sizeof *table);
+    if (table == NULL) return -1;
+    path_table = table;
+    path_cap = new_cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].name != NULL) path_table[path_slot(old[i].name)] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/* Function to drop the whole table if PATH is no longer what it was built against */
+static void path_check_env(void)
+{
+    const char *path = getenv("PATH");
+    if (path == NULL) path = "";
+    if (path_seen != NULL && strcmp(path_seen, path) == 0) return;
+    path_clear();
+    free(path_seen);
+    path_seen = strdup(path);
+}
+
+/*
+* Function to walk PATH for name the way execvp() would.
+* Returns a malloc'd absolute path, or NULL if no executable was found.
+*/
+static char *path_search(const char *name)
+{
+    const char *path = getenv("PATH");
+    if (path == NULL || *path == '\0') path = "/bin:/usr/bin";
+    size_t name_len = strlen(name);
+    struct stat st;
+
+    for (const char *dir = path; ; ) {
+        const char *end = strchrnul(dir, ':');
+        size_t dir_len = end - dir;
+        char *candidate = malloc(dir_len + name_len + 3);
+        if (candidate == NULL) return NULL;
+        if (dir_len == 0) {  // empty PATH entry means the current directory
+            candidate[0] = '.';
+            dir_len = 1;
+        } else {
+            memcpy(candidate, dir, dir_len);
+        }
+        candidate[dir_len] = '/';
+        memcpy(candidate + dir_len + 1, name, name_len + 1);
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+        if (*end == '\0') break;
+        dir = end + 1;
+    }
+    return NULL;
+}
+
+/*
+* Function to resolve a command name to the path to exec.
+* Names containing a slash are returned as they are. Returns NULL if the
+* command was not found in PATH.
+*/
+const char *path_lookup(const char *name)
+{
+    if (strchr(name, '/') != NULL) return name;
+    path_check_env();
+    if (path_cap == 0 && path_grow() == -1) return NULL;
+
+    size_t i = path_slot(name);
+    if (path_table[i].name != NULL) {
+        path_hits++;
+        path_table[i].hits++;
+        return path_table[i].path;
+    }
+
+    path_misses++;
+    char *path = path_search(name);
+    if (path == NULL) return NULL;  // misses aren't cached, the command may appear later
+    char *key = strdup(name);
+    if (key == NULL) {
+        free(path);
+        return NULL;
+    }
+    if ((path_count + 1) * 4 > path_cap * 3) {  // keep the load factor under 3/4
+        if (path_grow() == -1) {
+            free(key);
+            free(path);
+            return NULL;
+        }
+        i = path_slot(name);
+    }
+    path_table[i].name = key;
+    path_table[i].path = path;
+    path_table[i].hits = 1;
+    path_count++;
+    return path;
+}
+
+/*
+* Function to drop the entry for name, e.g. after an exec through it failed with ENOENT.
+* Uses backward-shift deletion so no tombstones are left behind.
+*/
+void path_forget(const char *name)
+{
+    if (path_cap == 0 || strchr(name, '/') != NULL) return;
+    size_t mask = path_cap - 1;
+    size_t i = path_slot(name);
+    if (path_table[i].name == NULL) return;
+
+    free(path_table[i].name);
+    free(path_table[i].path);
+    path_table[i].name = NULL;
+    path_table[i].path = NULL;
+    path_count--;
+
+    // move later entries of the probe run back into the hole
+    for (size_t j = (i + 1) & mask; path_table[j].name != NULL; j = (j + 1) & mask) {
+        size_t home = path_hash(path_table[j].name) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            path_table[i] = path_table[j];
+            path_table[j].name = NULL;
+            path_table[j].path = NULL;
+            i = j;
+        }
+    }
+}
+
+/*
+* Function for the builtin command hash.
+*   hash             list the remembered commands with their hit counts
+*   hash -r          forget every remembered command
+*   hash -s          print the hit / miss counters
+*   hash name ...    look up each name now so later uses are hits
+* Returns 0 on success, 1 if a name could not be found.
+*/
+int builtin_hash(char **command_tok)
+{
+    int result = 0;
+
+    vars_environ();  // PATH may have been assigned since the last spawn
+
+    if (command_tok[1] == NULL) {
+        path_check_env();
+        if (path_count == 0) {
+            printf("hash: hash table empty\n");
+        } else {
+            printf("hits\tcommand\n");
+        }
+        for (size_t i = 0; i < path_cap; i++) {
+            if (path_table[i].name != NULL) {
+                printf("%4u\t%s\n", path_table[i].hits, path_table[i].path);
+            }
+        }
+        fflush(stdout);
+        return 0;
+    }
+    for (int i = 1; command_tok[i] != NULL; i++) {
+        if (strcmp(command_tok[i], "-r") == 0) {
+            path_clear();
+            path_hits = 0;
+            path_misses = 0;
+        } else if (strcmp(command_tok[i], "-s") == 0) {
+            printf("hits %lu misses %lu entries %zu\n", path_hits, path_misses, path_count);
+        } else {
+            // pre-warming isn't a real use of the command, keep it out of the counters
+            unsigned long hits = path_hits, misses = path_misses;
+            const char *path = path_lookup(command_tok[i]);
+            path_hits = hits;
+            path_misses = misses;
+            if (path == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", command_tok[i]);
+                result = 1;
+            } else if (strchr(command_tok[i], '/') == NULL) {
+                path_table[path_slot(command_tok[i])].hits--;
+            }
+        }
+    }
+    fflush(stdout);
+    return result;
+}
@@ -0,0 +1,409 @@
+/* Command server.
+* "smallsh --serve path" listens on a Unix stream socket and runs the lines
+* clients send, so an orchestrator can dispatch jobs without starting a shell
+* for each one. Every line runs as a job in a worker forked from the server,
+* which splits, expands, parses and runs it with the same execute_list() as
+* the interactive shell (exec'ing a lone command directly, as -c does). So
+* cd, exit, $? and signal dispositions belong to that job alone.
+*
+* Lines from one connection run one after another, connections run
+* concurrently. The worker's stdout and stderr are read through pipes and
+* sent back in frames: a type byte, a 4-byte big-endian length, then the data.
+*   'o'  stdout data
+*   'e'  stderr data
+*   'x'  the job has finished, data is its status ($?) as a 4-byte big-endian int
+* A client that shuts down its sending side still gets the results of the
+* lines it sent, then the connection is closed. One that sends more than
+* SERVE_LINE_MAX bytes without a newline gets an 'e' frame saying so, its
+* running job is stopped and the connection is closed. If it goes away completely,
+* its running job's process group gets SIGTERM.
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SERVE_OUTQ_MAX  (1 << 20)  // stop reading a job's output while this much is unsent
+#define SERVE_LINE_MAX  (256 << 10)  // longest line a client may send, the shell's read-ahead block
+
+// what an epoll event is for
+enum { SERVE_LISTEN, SERVE_CHILD, SERVE_SOCK, SERVE_OUT, SERVE_ERR };
+
+struct client;
+struct serve_fd {
+    int fd;               // -1 when closed
+    int kind;
+    struct client *c;
+};
+
+struct client {
+    struct serve_fd sock;
+    struct serve_fd out, err;  // the running job's stdout / stderr pipes
+    char *in;                  // bytes received, not run yet
+    size_t in_len, in_cap;
+    char *outq;                // frames not sent yet
+    size_t outq_len, outq_cap, outq_sent;
+    pid_t pid;                 // running job, 0 if none
+    int status;                // its wait status, once reaped
+    int reaped;
+    int last_status;           // $? for the next line
+    int eof;                   // the client has sent everything
+    int hangup;                // the client has gone, nothing more can be sent
+    size_t line_len;           // bytes received since the last newline
+    struct client *next;
+};
+
+static int serve_epoll = -1;
+static struct serve_fd listen_watch = { -1, SERVE_LISTEN, NULL };
+static struct serve_fd child_watch = { -1, SERVE_CHILD, NULL };
+static struct client *clients = NULL;
+static struct lexer *serve_lexer;
+static struct expand_ctx *serve_expand;
+
+/* Function to append a frame to the client's output queue */
+static int queue_frame(struct client *c, char type, const void *data, uint32_t len)
+{
+    size_t need = c->outq_len + 5 + len;
+    if (need > c->outq_cap) {
+        size_t cap = c->outq_cap ? c->outq_cap : 4096;
+        while (cap < need) cap *= 2;
+        char *outq = realloc(c->outq, cap);
+        if (outq == NULL) return -1;
+        c->outq = outq;
+        c->outq_cap = cap;
+    }
+    char *p = c->outq + c->outq_len;
+    p[0] = type;
+    p[1] = len >> 24;
+    p[2] = len >> 16;
+    p[3] = len >> 8;
+    p[4] = len;
+    memcpy(p + 5, data, len);
+    c->outq_len = need;
+    return 0;
+}
+
+/* Function to pick the events to wait for on a client's fds from its state */
+static void update_events(struct client *c)
+{
+    int backlog = c->outq_len - c->outq_sent > SERVE_OUTQ_MAX;
+    struct epoll_event ev = { .events = c->eof ? 0 : EPOLLIN, .data.ptr = &c->sock };
+    if (c->outq_sent < c->outq_len) ev.events |= EPOLLOUT;
+    epoll_ctl(serve_epoll, EPOLL_CTL_MOD, c->sock.fd, &ev);
+
+    // pause reading the job's output while the client is behind
+    struct serve_fd *pipes[2] = { &c->out, &c->err };
+    for (int i = 0; i < 2; i++) {
+        if (pipes[i]->fd < 0) continue;
+        ev.events = backlog ? 0 : EPOLLIN;
+        ev.data.ptr = pipes[i];
+        epoll_ctl(serve_epoll, EPOLL_CTL_MOD, pipes[i]->fd, &ev);
+    }
+}
+
+/* Function to note that the client has gone: its running job is stopped and its output dropped */
+static void hangup_client(struct client *c)
+{
+    c->hangup = 1;
+    c->eof = 1;
+    c->in_len = 0;
+    c->outq_sent = c->outq_len = 0;
+    if (c->pid != 0 && !c->reaped) kill(-c->pid, SIGTERM);
+}
+
+/* Function to send as much of the output queue as the socket takes */
+static void flush_client(struct client *c)
+{
+    while (c->outq_sent < c->outq_len) {
+        ssize_t n = send(c->sock.fd, c->outq + c->outq_sent, c->outq_len - c->outq_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) break;
+        if (n <= 0) {
+            hangup_client(c);
+            return;
+        }
+        c->outq_sent += n;
+    }
+    if (c->outq_sent == c->outq_len) c->outq_sent = c->outq_len = 0;
+}
+
+static void close_watch(struct serve_fd *w)
+{
+    epoll_ctl(serve_epoll, EPOLL_CTL_DEL, w->fd, NULL);
+    close(w->fd);
+    w->fd = -1;
+}
+
+/*
+* Function to run in a forked worker: become the shell for one line and exit with its status.
+* Every fd of the server is closed so clients see EOF when the server drops them.
+*/
+static void run_worker(struct client *c, const char *line, size_t len, int out_fd, int err_fd)
+{
+    setpgid(0, 0);  // the job's own group, signalled as a whole if the client hangs up
+    signal(SIGPIPE, SIG_DFL);
+    for (struct client *other = clients; other != NULL; other = other->next) {
+        close(other->sock.fd);
+        if (other->out.fd >= 0) close(other->out.fd);
+        if (other->err.fd >= 0) close(other->err.fd);
+    }
+    close(listen_watch.fd);
+    close(serve_epoll);
+
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd >= 0 && null_fd != 0) {
+        dup2(null_fd, 0);
+        close(null_fd);
+    }
+    dup2(out_fd, 1);
+    dup2(err_fd, 2);
+    jobs_reinit();
+
+    stat_code = c->last_status;
+    if (trace_fd >= 0) {
+        trace_begin();
+        trace_mark(TRACE_READ);
+    }
+    if (execute_list(serve_lexer, serve_expand, line, len, 1, NULL, NULL) == -1) {
+        perror("memory allocation error");
+        _exit(1);
+    }
+    fflush(stdout);
+    exit(stat_code);
+}
+
+/* Function to start the next complete line the client has sent, if there is one and no job is running */
+static void start_job(struct client *c)
+{
+    char *nl;
+    if (c->pid != 0 || c->hangup || c->in_len == 0 || (nl = memchr(c->in, '\n', c->in_len)) == NULL) return;
+    size_t len = nl - c->in;
+
+    int out[2], err[2];
+    if (pipe2(out, O_CLOEXEC) == -1) {
+        perror("pipe() failed");
+        return;
+    }
+    if (pipe2(err, O_CLOEXEC) == -1) {
+        perror("pipe() failed");
+        close(out[0]);
+        close(out[1]);
+        return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) run_worker(c, c->in, len, out[1], err[1]);
+    close(out[1]);
+    close(err[1]);
+    if (pid == -1) {
+        perror("fork() failed");
+        close(out[0]);
+        close(err[0]);
+        return;
+    }
+    setpgid(pid, pid);
+
+    // the line has been handed over
+    memmove(c->in, nl + 1, c->in_len - len - 1);
+    c->in_len -= len + 1;
+
+    c->pid = pid;
+    c->reaped = 0;
+    job_add(pid, 0, "serve");
+    c->out.fd = out[0];
+    c->err.fd = err[0];
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &c->out };
+    epoll_ctl(serve_epoll, EPOLL_CTL_ADD, c->out.fd, &ev);
+    ev.data.ptr = &c->err;
+    epoll_ctl(serve_epoll, EPOLL_CTL_ADD, c->err.fd, &ev);
+}
+
+/* Function to check whether a client is finished with: no job, no more lines and nothing left to send */
+static int client_done(struct client *c)
+{
+    return c->pid == 0 && c->eof && c->outq_len == 0 && (c->in_len == 0 || memchr(c->in, '\n', c->in_len) == NULL);
+}
+
+/* Function to close and free the clients that are finished with (after a batch of events, so none is in use) */
+static void sweep_clients(void)
+{
+    for (struct client **p = &clients; *p != NULL; ) {
+        struct client *c = *p;
+        if (!client_done(c)) {
+            p = &c->next;
+            continue;
+        }
+        *p = c->next;
+        close_watch(&c->sock);
+        free(c->in);
+        free(c->outq);
+        free(c);
+    }
+}
+
+/*
+* Function to move a client along after an event: finish its job once it has
+* exited and its output has been drained, then start its next line.
+*/
+static void advance_client(struct client *c)
+{
+    if (c->pid != 0 && c->reaped && c->out.fd < 0 && c->err.fd < 0) {
+        int code = job_status_code(c->status);
+        unsigned char data[4] = { code >> 24, code >> 16, code >> 8, code };
+        queue_frame(c, 'x', data, 4);
+        c->last_status = code;
+        c->pid = 0;
+    }
+    start_job(c);
+    flush_client(c);
+    if (!client_done(c)) update_events(c);
+}
+
+/* Function to accept every pending connection */
+static void accept_clients(void)
+{
+    int fd;
+    while ((fd = accept4(listen_watch.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct client *c = calloc(1, sizeof *c);
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->sock = (struct serve_fd) { fd, SERVE_SOCK, c };
+        c->out = (struct serve_fd) { -1, SERVE_OUT, c };
+        c->err = (struct serve_fd) { -1, SERVE_ERR, c };
+        c->next = clients;
+        clients = c;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &c->sock };
+        epoll_ctl(serve_epoll, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+/* Function to stop reading from a client whose line is too long: it is told so, its job is stopped */
+static void drop_client(struct client *c)
+{
+    static const char msg[] = "smallsh: line too long\n";
+    c->eof = 1;
+    c->in_len = 0;
+    queue_frame(c, 'e', msg, sizeof msg - 1);
+    if (c->pid != 0 && !c->reaped) kill(-c->pid, SIGTERM);
+}
+
+/* Function to read commands from a client */
+static void read_client(struct client *c)
+{
+    for (;;) {
+        if (c->in_len == c->in_cap) {
+            size_t cap = c->in_cap ? c->in_cap * 2 : 4096;
+            char *in = realloc(c->in, cap);
+            if (in == NULL) return;
+            c->in = in;
+            c->in_cap = cap;
+        }
+        ssize_t n = recv(c->sock.fd, c->in + c->in_len, c->in_cap - c->in_len, MSG_DONTWAIT);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) return;
+        if (n == -1) {
+            hangup_client(c);
+            return;
+        }
+        if (n == 0) {  // everything has been sent, a last line may lack its newline
+            c->eof = 1;
+            if (c->in_len > 0 && c->in[c->in_len - 1] != '\n') c->in[c->in_len++] = '\n';
+            return;
+        }
+        char *nl = memrchr(c->in + c->in_len, '\n', n);
+        c->line_len = nl != NULL ? (size_t) (c->in + c->in_len + n - nl - 1) : c->line_len + n;
+        c->in_len += n;
+        if (c->line_len > SERVE_LINE_MAX) {
+            drop_client(c);
+            return;
+        }
+    }
+}
+
+/* Function to forward a job's output to its client as frames */
+static void read_output(struct serve_fd *w)
+{
+    char buf[65536];
+    ssize_t n = read(w->fd, buf, sizeof buf);
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) return;
+    if (n <= 0) {
+        close_watch(w);
+        return;
+    }
+    if (!w->c->hangup) queue_frame(w->c, w->kind == SERVE_OUT ? 'o' : 'e', buf, n);
+}
+
+/* Function to note the jobs that have finished */
+static void reap_jobs(void)
+{
+    jobs_poll();
+    for (struct client *c = clients; c != NULL; c = c->next) {
+        if (c->pid == 0 || c->reaped || !job_check_fg(c->pid, &c->status)) continue;
+        c->reaped = 1;
+        advance_client(c);
+    }
+}
+
+/*
+* Function to run the server on the socket at path until it is killed.
+* Returns an exit status if the socket can't be set up.
+*/
+int serve_main(const char *path, struct lexer *lexer, struct expand_ctx *expand)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "smallsh: %s: socket path too long\n", path);
+        return 2;
+    }
+    strcpy(addr.sun_path, path);
+
+    serve_lexer = lexer;
+    serve_expand = expand;
+    signal(SIGPIPE, SIG_IGN);
+    jobs_init();
+
+    listen_watch.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path);  // a socket left over from an earlier server
+    if (listen_watch.fd == -1 || bind(listen_watch.fd, (struct sockaddr *) &addr, sizeof addr) == -1 ||
+        listen(listen_watch.fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "smallsh: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    serve_epoll = epoll_create1(EPOLL_CLOEXEC);
+    child_watch.fd = jobs_event_fd();
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_watch };
+    epoll_ctl(serve_epoll, EPOLL_CTL_ADD, listen_watch.fd, &ev);
+    ev.data.ptr = &child_watch;
+    epoll_ctl(serve_epoll, EPOLL_CTL_ADD, child_watch.fd, &ev);
+
+    for (;;) {
+        struct epoll_event events[64];
+        int n = epoll_wait(serve_epoll, events, 64, -1);
+        for (int i = 0; i < n; i++) {
+            struct serve_fd *w = events[i].data.ptr;
+            switch (w->kind) {
+                case SERVE_LISTEN:
+                    accept_clients();
+                    break;
+                case SERVE_CHILD:
+                    reap_jobs();
+                    break;
+                case SERVE_SOCK:
+                    if (w->c->hangup) break;
+                    if (events[i].events & EPOLLIN) read_client(w->c);
+                    if (events[i].events & (EPOLLHUP | EPOLLERR)) hangup_client(w->c);
+                    advance_client(w->c);
+                    break;
+                default:
+                    read_output(w);
+                    advance_client(w->c);
+            }
+        }
+        sweep_clients();
+    }
+}
@@ -8,40 +8,30 @@
 * Waiting
 */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include "smallsh.h"
 
-// Declare constants and global variables
-#define MIN_ARGS    512  // minimum of 512 words supported
-int bg_pids[100];  // array to store background PID's
-int bg_pidc = 0;  // count of background PID's
-int bg_flag = 0;  // flag for background process
-int SIGTSTP_flag = 0;  // flag for STGTSTP  
-pid_t spawnPid = -5;
+// Declare global variables
 pid_t bg_pid = 0;  // store the most recent background pid
 
 // exit status for foreground + background processes
 int exit_stat = 0;
 int stat_code = 0; 
 
-// variables to check for file redirection
-int input_redir = 0;
-int output_redir = 0; 
-char *input_file;
-char *output_file;
-char *dollar_exclam = "";  // initialize $! to empty string 
-char *tok_copy = NULL;
-char *token = NULL;
+// job control and pipes
+int shell_tty = -1;  // terminal fd when smallsh is interactive, -1 otherwise
+int pipe_size = 0;  // F_SETPIPE_SZ for pipeline pipes (SMALLSH_PIPE_SIZE), 0 for the kernel default
 
 // Set up signal handling structs
-struct sigaction SIGINT_action = {0}, SIGTSTP_action = {0}, ignore_action = {0}; 
-struct sigaction SIGINT_action_old = {0}, SIGTSTP_action_old = {0}; 
+struct sigaction SIGINT_action = {0}, ignore_action = {0}; 
 
 // Function Declarations
-char *str_gsub(char *restrict *restrict haystack, char const *restrict needle, char const *restrict sub); 
-int exec_builtin(char **command_tok);  
-int fork_with_redir(char **command_tok, int bg_flag); 
-pid_t fork_bg_process(char **command_tok); 
+void setup_signals(void);
+void run_pipeline(struct pipeline *pl); 
+void wait_foreground(pid_t pid, int last_stage, struct job_usage *usage); 
+void run_timed_builtin(const struct builtin *builtin, struct command *cmd);
+double pipeline_timeout(const struct pipeline *pl);
+ssize_t read_more(void *arg, const char **line);
 
 void handle_SIGINT(int signo); 
 
@@ -52,654 +42,417 @@ void handle_SIGINT(int signo) {
 }
 
 int main(int argc, char *argv[]) {
-    char *lineptr = NULL; 
-    char *line_words = NULL;
-    size_t buffer_size = 0;
-    const char *ps1 = getenv("PS1");
-    const char *ifs = getenv("IFS"); 
-    const char *path = getenv("PATH"); 
-    const char *home_env = getenv("HOME");
-
-    char *token; 
-    char *slash = "/";
-    const char *delim; 
-
-    // token strings that needs expansion or further processing
-    char *needle_home = "~/";
-    char *needle_pid = "$$"; 
-    char *needle_exitstat = "$?"; 
-    char *needle_bgproc = "$!"; 
-    char *ampersand = "&"; 
-    char *comment = "#";
-
-    // Fill out signal handling structs, set disposition to SIG_IGN
-    SIGTSTP_action.sa_handler = SIG_IGN; 
-    sigfillset(&SIGTSTP_action.sa_mask); 
-    SIGTSTP_action.sa_flags = 0; 
-
-    // Fill out SIGINT_action struct, set initial disposition to SIG_IGN
-    SIGINT_action.sa_handler = SIG_IGN;
-    // Block all signals, reset flags
-    sigfillset(&SIGINT_action.sa_mask); 
-    SIGINT_action.sa_flags = 0; 
+    // the environment becomes the exported shell variables (before the zygote forks, so it agrees)
+    if (vars_init() == -1) {
+        perror("memory allocation error");
+        exit(1);
+    }
 
-    // set ignore_action as SIG_IGN as its signal handler
-    ignore_action.sa_handler = SIG_IGN; 
+    static struct lexer lexer;  // word list and arena, reused for every line
+    struct expand_ctx expand = {0};
 
-    // Register the functions so that SIGINT will be ignored
-    sigaction(SIGINT, &ignore_action, NULL);  // initially set to ignore
-    sigaction(SIGTSTP, &ignore_action, NULL); 
+    // "smallsh -c string [name [args]]" runs string and exits, it keeps startup to a minimum:
+    // no signal setup or job control, and the last command is exec'd in place of the shell
+    int string_mode = argc > 1 && strcmp(argv[1], "-c") == 0;
+    if (string_mode && argc == 2) {
+        fprintf(stderr, "smallsh: -c: option requires an argument\n");
+        exit(2);
+    }
+    // "smallsh --serve path" runs the command lines sent to a Unix socket, see serve.c
+    int serve_mode = argc > 1 && strcmp(argv[1], "--serve") == 0;
+    if (serve_mode && argc != 3) {
+        fprintf(stderr, "smallsh: usage: smallsh --serve socket-path\n");
+        exit(2);
+    }
 
-    for (;;) {
-        int redirect_flag = 0; 
-        
-        if (ifs == NULL) {
-            delim = "\t\n"; 
-        } else delim = ifs; 
-        // get pid of process running in the background 
-        pid_t wait_pid = waitpid(0, &exit_stat, WNOHANG | WUNTRACED);
-    start: 
-        while (wait_pid > 0) 
-        {
-            if (WIFEXITED(exit_stat)) { 
-                // fprintf(stderr,"bg_pid from background: %d\n", bg_pid); 
-                fprintf(stderr, "Child process %jd done. Exit status %d.\n", (intmax_t) bg_pid, exit_stat);
-            } else if (WIFSIGNALED(exit_stat)) {
-                bg_pid = spawnPid; 
-                fprintf(stderr, "Child process %jd done. Signaled %d.\n", (intmax_t) wait_pid, exit_stat); 
-            } else if (WIFSTOPPED(exit_stat)) {
-                bg_pid = spawnPid;
-                fprintf(stderr, "Child process %jd done. Continuing.\n", wait_pid, exit_stat);
-            }
-            wait_pid = waitpid(0, &stat_code, WNOHANG | WUNTRACED); 
+    if (!string_mode && !serve_mode) {
+        setup_signals();
+
+        // jobs get their own process group only when we own the terminal
+        if (argc == 1 && isatty(0) && tcgetpgrp(0) == getpgrp()) shell_tty = 0;
+
+        // children are reaped through a signalfd, input is read through the same wait
+        jobs_init();
+        // with SMALLSH_ZYGOTE, fork the launch helper now while the shell is small
+        zygote_start();
+    }
+    const char *pipe_size_env = getenv("SMALLSH_PIPE_SIZE");
+    if (pipe_size_env != NULL) pipe_size = atoi(pipe_size_env);
+    trace_init();
+
+    // words are split on IFS, which assignments and unset can change
+    vars_track_ifs(&lexer);
+    lexer.record = 1;  // lines are kept in the line cache as segments
+    expand.lookup = var_lookup;
+    expand.shell_pid = getpid();
+
+    if (serve_mode) {
+        expand.params = argv;
+        expand.nparams = 1;
+        exit(serve_main(argv[2], &lexer, &expand));
+    }
+
+    struct input input = { .fd = 0 };
+
+    // "smallsh script [args]" runs the script without prompting, $0..$9 are the script and its args
+    int script_mode = argc > 1;
+    // so does "generator | smallsh": only a terminal gets prompts, and ^C at the prompt
+    int interactive = !script_mode && input_interactive(&input);
+    if (string_mode) {
+        input_open_string(&input, argv[2]);
+        expand.params = argc > 3 ? argv + 3 : argv;
+        expand.nparams = argc > 3 ? argc - 3 : 1;
+    } else if (script_mode) {
+        if (input_open_script(&input, argv[1]) == -1) {
+            fprintf(stderr, "smallsh: %s: %s\n", argv[1], strerror(errno));
+            exit(127);
         }
+        expand.params = argv + 1;
+        expand.nparams = argc - 1;
+    } else {
+        expand.params = argv;
+        expand.nparams = 1;
+    }
+    if (expand.nparams > 10) expand.nparams = 10;
 
+    for (;;) {
         /* INPUT */
+        if (trace_fd >= 0) trace_begin();
         // Print the command prompt by expanding PS1 parameter
-        if (ps1 == NULL) {
-            fprintf(stderr, "%s", " "); 
-        } else fprintf(stderr, "%s", ps1); 
-
-        // Register SIGINT to a dummy function before getline
-        SIGINT_action.sa_handler = handle_SIGINT; 
-
-        // Read a line of input from stdin
-        // getline returns number of char's written
-        ssize_t line_length = getline(&lineptr, &buffer_size, stdin);  
-        if (line_length == -1) 
-        {  // error handling for getline
-            clearerr(stdin); 
-            errno = 0; 
-            // fprintf(stderr, "error", errno); 
-            exit(-1); 
-        } 
-        sigaction(SIGINT, &SIGINT_action_old, NULL);
-        lineptr[strcspn(lineptr, "\n")] = 0; 
-
-        // allocate space to hold the actual strings read in (line_words)
-        line_words = calloc(line_length, sizeof(char)); 
-        if (line_words == NULL){
-            perror("memory allocation error"); 
-            return (-1); 
+        if (interactive) {
+            const char *ps1 = var_get("PS1");
+            input.prompt = ps1 == NULL ? " " : ps1;
+            fprintf(stderr, "%s", input.prompt); 
         }
 
-        strcpy(line_words, lineptr);  // includes terminating \0 character
-
-        // handle empty input
-        if (strlen(lineptr) == 0) {
-            goto start;
+        // the previous line's words are no longer needed
+        arena_reset(&lexer.arena);
+
+        // Register SIGINT to a dummy function while reading, so it interrupts the read
+        // (a script or piped input never waits at a prompt, so it skips this)
+        const char *lineptr; 
+        ssize_t line_length;
+        if (!interactive) {
+            line_length = input_getline(&input, &lineptr);  
+        } else {
+            sigaction(SIGINT, &SIGINT_action, NULL);
+            line_length = input_getline(&input, &lineptr);  
+            sigaction(SIGINT, &ignore_action, NULL);
         }
-
-        // determine how many tokens there are
-        int num_tokens = 0; 
-        token = strtok(lineptr, delim); 
-        while (token != NULL) {
-            num_tokens++; 
-            token = strtok(NULL, delim); 
+        if (line_length == INPUT_INTR) {  // interrupted, start over on a new line
+            fprintf(stderr, "\n");
+            continue;
         }
-        num_tokens++;
-
-        /* WORD SPLITTING */
-        // Tokenize User Input 
-        // Code Adapted from (citation): https://stackoverflow.com/questions/37273193/tokenize-user-input-for-execvp-in-c 
-        // DEBUG printf("%s\n", lineptr); 
-        token = strtok(line_words, delim);
-        char **command_tok = calloc(num_tokens, sizeof(char*)); 
-        int i = 0; 
-        while (token) {
-            // printf("Original Token: %s\n", token); 
-            tok_copy = strdup(token);  // copy each word as we tokenize (since strtok breaks down the string)
-            // printf("Copy of token: %s\n", tok_copy); 
-            // ignore the token if it is a comment
-            if (strncmp(&tok_copy[0], comment, 1) == 0) {
-                command_tok[i++] = NULL; 
-                goto fork_process;
-            }
-            
-            /* EXPANSION of words */
-            // if "~/" was found (replace with HOME env variable)
-            if (strncmp(tok_copy, needle_home, 2) == 0)  // ~/ can only be found at beginning of word
-            {  
-            // concatenate char pointers source citation: https://stackoverflow.com/questions/55096198/how-to-concatenate-char-pointers-using-strcat-in-c  
-            char *full_homep = malloc(1 + strlen(slash) + strlen(home_env));  // retain the final slash in HOME variable
-            strcpy(full_homep, home_env); 
-            strcat(full_homep, slash); 
-            //DEBUG: printf("Full home_env: %s\n", full_homep);
-                char *ret = str_gsub(&tok_copy, needle_home, full_homep); 
-                if (!ret) exit(1); 
-                tok_copy = ret; 
-            }
+        if (line_length == INPUT_EOF) 
+        {  // end of input, a script (or piped input) exits with the status of its last command
+            exit(interactive ? -1 : stat_code); 
+        } 
+        if (trace_fd >= 0) trace_mark(TRACE_READ);
 
-            // if "$$" was found (replace with process ID of smallsh)
-            else if (strstr(tok_copy, needle_pid) != NULL)  // strstr returns NULL pointer if substring not found
-            {  
-                // pid_t conversion to string
-                // Adapted from (Citation): https://stackoverflow.com/questions/15262315/how-to-convert-pid-t-to-string 
-                pid_t pid = getpid(); 
-                // DEBUG: printf("smallsh pid = %d\n", pid); 
-                char smallsh_pid[10]; 
-                sprintf(smallsh_pid, "%d", pid); 
-                char *ret = str_gsub(&tok_copy, needle_pid, smallsh_pid); 
-                if (!ret) exit(1);
-                tok_copy = ret; 
-            }
+        // the last command of a -c string replaces the shell, there is nothing left to wait for
+        // (a compound command left open reads its remaining lines through read_more())
+        if (execute_list(&lexer, &expand, lineptr, line_length, string_mode && input_done(&input),
+                         read_more, &input) == -1) {
+            perror("memory allocation error"); 
+            return (-1); 
+        }
+    }
+    return 0; 
+}
 
-            // if "$?" was found (replace with exit status of last foreground command)
-            if (strstr(tok_copy, needle_exitstat) != NULL)
-            {
-                char *child_exit_str = calloc(2048, sizeof(char)); 
-                // fprintf(stderr, "Previous Exit Status = %d\n", stat_code); 
-                if (stat_code != 0) {  // if waited-for command terminated with exit status
-                    // stat_code defaults to 0
-                    // DEBUG: printf("exit value: %d\n", exit_stat);
-                    sprintf(child_exit_str, "%d", stat_code); 
-                    {
-                        char *ret = str_gsub(&tok_copy, needle_exitstat, child_exit_str); 
-                        if (!ret) exit(1); 
-                        tok_copy = ret;
-                    }
-                }
-                else if (stat_code == 0) {
-                    sprintf(child_exit_str, "%d", stat_code);
-                    {
-                        char *ret = str_gsub(&tok_copy, needle_exitstat, child_exit_str); 
-                        if (!ret) exit(1); 
-                        tok_copy = ret; 
-                    }
-                }
-                else if (WIFEXITED(stat_code)) {
-                    // stat_code defaults to 0
-                    int exitStat = WEXITSTATUS(stat_code); 
-                    // DEBUG: printf("exit value: %d\n", exit_stat);
-                    sprintf(child_exit_str, "%d", exitStat); 
-                    {
-                        char *ret = str_gsub(&tok_copy, needle_exitstat, child_exit_str); 
-                        if (!ret) exit(1); 
-                        tok_copy = ret;
-                    }
-                }
-                else if (WIFSIGNALED(exit_stat)) {  // if waited-for command terminated due to signal
-                    int signal_stat = 128 + (WTERMSIG(exit_stat)); 
-                    sprintf(child_exit_str, "%d", signal_stat); 
-                    {
-                        char *ret = str_gsub(&tok_copy, needle_exitstat, child_exit_str); 
-                        if (!ret) exit(1); 
-                        tok_copy = ret; 
-                    }
-                }
-            }
+/*
+* Function to set up the signal handling of an interactive shell or script:
+* SIGINT, SIGTSTP and SIGTTOU are ignored, SIGINT_action is registered only while reading input.
+*/
+void setup_signals(void)
+{
+    // Fill out SIGINT_action struct, the handler is registered only while reading input
+    SIGINT_action.sa_handler = handle_SIGINT;
+    // Block all signals, reset flags
+    sigfillset(&SIGINT_action.sa_mask); 
+    SIGINT_action.sa_flags = 0; 
 
-            // if "$!" was found (replace with process ID of most recent background process in the same group ID as smallsh)
-            if (strstr(tok_copy, needle_bgproc) != NULL) 
-            {
-                if (bg_pid == 0) 
-                {
-                    // fprintf(stderr, "bg pid = %d\n", bg_pid); 
-                    char *ret = str_gsub(&tok_copy, needle_bgproc, dollar_exclam); 
-                    if (!ret) exit(1);
-                    tok_copy = ret;     
-                }
-                else 
-                {
-                    if (WIFEXITED(exit_stat)) 
-                    { 
-                    char bg_pid_str[1024]; 
-                    sprintf(bg_pid_str, "%d", bg_pid); 
-                    char *ret = str_gsub(&tok_copy, needle_bgproc, bg_pid_str); 
-                    if (!ret) exit(1); 
-                    tok_copy = ret; 
-                    }
-                }
-            }
+    // set ignore_action as SIG_IGN as its signal handler
+    ignore_action.sa_handler = SIG_IGN; 
 
-            command_tok[i++] = tok_copy;
-            token = strtok(NULL, delim);  // get the next token 
-        }
-        command_tok[i] = NULL;
-
-        // execute builtin's after tokenizing
-        int builtin_result = exec_builtin(command_tok); 
-        if (builtin_result == 1) {  // 1 indicates that no built in command was found
-        } else { goto start; }
-
-        /* PARSING: check if redirection or background process is needed */
-        for (int i = 0; i < num_tokens-2; i++) 
-        {
-
-            if (strncmp(command_tok[i], "<", 1) == 0)
-            {
-                input_redir = 1;
-                command_tok[i] = NULL;
-                // fprintf(stderr, "Input File: %s\n", command_tok[i+1]); 
-                input_file = command_tok[i+1]; 
-            }
-            else if (strncmp(command_tok[i], ">", 1) == 0)
-            {
-                output_redir = 1; 
-                command_tok[i] = NULL;
-                // fprintf(stderr, "Output File: %s\n", command_tok[i+1]); 
-                output_file = command_tok[i+1]; 
-            }
-        }
+    // Register the functions so that SIGINT will be ignored
+    sigaction(SIGINT, &ignore_action, NULL);  // initially set to ignore
+    sigaction(SIGTSTP, &ignore_action, NULL); 
+    sigaction(SIGTTOU, &ignore_action, NULL);  // so the terminal can be taken back from a job
+}
 
-        // check if process is to run in the background (if "&" found at the end)
-        int bg_process = strncmp(command_tok[num_tokens-2], ampersand, 1); 
-        if (strncmp(command_tok[num_tokens-2], ampersand, 1) == 0)
-        {
-            // fprintf(stderr, "Background process started\n"); 
-            command_tok[num_tokens-2] = NULL;
-            // set background flag and proceed to fork process
-            bg_flag = 1; 
-            goto fork_process;
-            // pid_t gpid = getpgid(spawnPid);
-            // fprintf(stderr, "Group Process ID = %d\n", gpid);
-            spawnPid = -5;
-        }
+/*
+* Function to read the next line of a compound command for execute_list().
+* At a prompt it shows "> " and can be interrupted like the first line.
+*/
+ssize_t read_more(void *arg, const char **line)
+{
+    struct input *in = arg;
+    if (in->prompt == NULL) return input_getline(in, line);
+
+    in->prompt = "> ";
+    fprintf(stderr, "%s", in->prompt);
+    sigaction(SIGINT, &SIGINT_action, NULL);
+    ssize_t len = input_getline(in, line);
+    sigaction(SIGINT, &ignore_action, NULL);
+    if (len == INPUT_INTR) fprintf(stderr, "\n");
+    return len;
+}
 
-        // fprintf(stderr, "Input File = %s, Output File = %s\n", input_file, output_file); 
-        if ((input_redir == 1 || output_redir == 1) && (bg_process == 0)) {
-            bg_flag = 1; 
-            int redir_res = fork_with_redir(command_tok, bg_flag);
-            // fprintf(stderr, "Finished redirecting\n"); 
-            if (redir_res == 0) // redirecting process done
-            {
-                input_redir = 0;
-                output_redir = 0;
-                input_file = NULL;
-                output_file = NULL;
-                goto start; 
-            }
-        } 
-        else if ((input_redir == 1 || output_redir == 1) && (bg_process != 0)) {
-            bg_flag = 0;
-            int redir_res = fork_with_redir(command_tok, bg_flag);
-            // fprintf(stderr, "Finished redirecting\n"); 
-            if (redir_res == 0) // redirecting process done
-            {
-                input_redir = 0;
-                output_redir = 0;
-                input_file = NULL;
-                output_file = NULL;
-                goto start; 
-            }
-        }
-        else {  // no redirecting needed, go straight to fork process
-            goto fork_process; 
+/*
+* Function to split, expand, parse and run one command line and set $?.
+* With exec_last a lone foreground command is exec'd in place of the shell.
+* Returns 0, or -1 if memory could not be allocated.
+*/
+int execute_line(struct lexer *lexer, struct expand_ctx *expand, const char *line, size_t len, int exec_last)
+{
+    /* WORD SPLITTING and EXPANSION */
+    // one pass over the line splits on IFS and expands ~/, $$, $?, $!, $0..$9 and variables
+    const char *home = var_get("HOME");
+    expand->home = home == NULL ? "" : home;
+    expand->last_status = stat_code;
+    expand->last_bg = bg_pid;
+    int word_count = 0;
+    char **command_tok;
+    struct pipeline pipeline;
+    // a line run before is only expanded again, its pipeline comes from the cache
+    int cached = line_cache_lookup(lexer, line, len, expand, &command_tok, &word_count, &pipeline);
+    if (cached == -1) return -1;
+    if (!cached) {
+        command_tok = lex_line(lexer, line, len, expand, &word_count);
+        if (command_tok == NULL) return -1;
+    }
+    if (word_count == 0) return 0;  // empty line or nothing but a comment
+    if (trace_fd >= 0) trace_mark(TRACE_EXPAND);
+
+    // a line of nothing but NAME=value words sets shell variables
+    int assignments = 0;
+    while (assignments < word_count) {
+        const char *eq = strchr(command_tok[assignments], '=');
+        if (eq == NULL || !var_name_ok(command_tok[assignments], eq - command_tok[assignments])) break;
+        assignments++;
+    }
+    if (assignments == word_count) {
+        for (int i = 0; i < word_count; i++) {
+            if (var_assign(command_tok[i]) == -1) return -1;
         }
+        stat_code = 0;
+        if (trace_fd >= 0) trace_end(NULL, 0, stat_code);
+        return 0;
+    }
 
-        /* EXECUTE: Execute non-builtin commands with input and output redirection. */
-
-    // else execute non-builtin commands in new child process 
-    // in foreground - with blocking wait
-    fork_process:
-    {
-        spawnPid = fork();
-        switch(spawnPid) {
-            case -1:
-                perror("fork() failed");
-                exit(1);
-                break;
-            case 0:  // child process executes this branch
-                // DEBUG: fprintf(stderr, "Command: %s\n", command_tok[0]); 
-                sigaction(SIGINT, &SIGINT_action_old, NULL); 
-                sigaction(SIGTSTP, &SIGTSTP_action_old, NULL);
-                execvp(command_tok[0], command_tok); 
-                // execvp only returns on error
-                fprintf(stderr, "execvp failed\n");
-            default:  // parent process waits for foreground process to finish
-                if (bg_flag == 1)  // if background flag is set, process is to run without blocking wait
-                {
-                    bg_pid = spawnPid;
-                    bg_flag = 0;
-                    goto start; 
-                }
-                // waitPid is process ID for the child process
-                waitpid(spawnPid, &exit_stat, 0); 
-                if (WIFEXITED(exit_stat)) {
-                    stat_code = WEXITSTATUS(exit_stat); 
-                    // DEBUG: fprintf(stderr, "Exit Status From Process: %d\n", stat_code);
-                }
-                if (WIFSIGNALED(exit_stat)) {
-                    stat_code = WTERMSIG(exit_stat); 
-                    // DEBUG: fprintf(stderr, "Exit Signal from Process: %d\n", stat_code); 
-                }
-                if (WIFSTOPPED(exit_stat)) {
-                    // send SIGCONT signal
-                    kill(spawnPid, SIGCONT); 
-                    // print to stderr
-                    fprintf(stderr, "Child process %d stopped. Continuing...\n", spawnPid); 
-                }
+    /* PARSING: split into pipeline stages, find redirection and background process */
+    if (!cached) {
+        // parsing moves the words around, the cache needs them in their original order
+        char **words = arena_alloc(&lexer->arena, word_count * sizeof *words);
+        if (words == NULL) return -1;
+        memcpy(words, command_tok, word_count * sizeof *words);
+        if (parse_pipeline(&lexer->arena, command_tok, word_count, &pipeline) == -1) {
+            stat_code = 2;
+            if (trace_fd >= 0) trace_end(NULL, 0, stat_code);
+            return 0;
         }
+        line_cache_store(lexer, line, len, words, word_count, &pipeline);
     }
-    // both parent and child execute this
-        // TODO: function to execute non-builtin commands
-    free(command_tok); 
-    free(tok_copy); 
+    if (trace_fd >= 0) trace_mark(TRACE_PARSE);
+
+    // execute builtin's after parsing (only on their own in the foreground, not inside a pipeline)
+    // (a "limit" prefix is for a launched process, like nice or taskset it runs the external command)
+    if (pipeline.nstages == 1 && !pipeline.bg && pipeline.limits == NULL) {
+        const struct builtin *builtin = builtin_find(pipeline.stages[0].argv[0]);
+        if (builtin != NULL) {
+            if (pipeline.timed) run_timed_builtin(builtin, &pipeline.stages[0]);
+            else stat_code = run_builtin(builtin, &pipeline.stages[0]);
+            if (trace_fd >= 0) trace_end(&pipeline, 1, stat_code);
+            return 0;
+        }
     }
-exit:
-    return 0; 
-}
 
-/* Function to find a needle substring in a haystack string and replace with sub. 
-* Returns the final string with the replacement. 
-*/
-char *str_gsub(char *restrict *restrict haystack, char const *restrict needle, char const *restrict sub) {
-    char *str = *haystack;
-    size_t haystack_len = strlen(str); 
-    size_t const needle_len = strlen(needle),
-                sub_len = strlen(sub); 
-
-    for (; (str = strstr(str, needle)); ) {
-        ptrdiff_t off = str - *haystack; 
-        if (sub_len > needle_len) {
-            str = realloc(*haystack, sizeof **haystack * (haystack_len + sub_len - needle_len + 1));
-            if (!str) goto exit; 
-            *haystack = str;
-            str = *haystack + off; 
+    /* EXECUTE: Execute non-builtin commands with pipes and input and output redirection. */
+    // (unless it is traced, the record is written once it has finished)
+    // (nor can a command with a timeout, the shell has to stay to enforce it)
+    if (pipeline.limits != NULL && limits_prepare(pipeline.limits) == -1) {
+        stat_code = 1;
+        if (trace_fd >= 0) trace_end(&pipeline, 0, stat_code);
+        return 0;
+    }
+    // (nor can one whose output fans out to several files, the shell moves it)
+    if (exec_last && pipeline.nstages == 1 && !pipeline.bg && !pipeline.timed && trace_fd < 0 &&
+        pipeline_timeout(&pipeline) == 0 && fanout_targets(&pipeline.stages[0]) < 2) {
+        vars_environ();  // exec_command() passes environ on
+        pipeline.stages[0].limits = pipeline.limits;
+        if (pipeline.stages[0].here_doc != NULL || pipeline.stages[0].here_string != NULL) {
+            pipeline.stages[0].stdin_fd = here_input_fd(&pipeline.stages[0]);
+            if (pipeline.stages[0].stdin_fd == -1) exit(1);
         }
-        memmove(str + sub_len, str + needle_len, haystack_len + 1 - off - needle_len); 
-        memcpy(str, sub, sub_len);
-        haystack_len = haystack_len + sub_len - needle_len; 
-        str += sub_len;  
+        exec_command(&pipeline.stages[0]);
     }
-    str = *haystack; 
-    if (sub_len < needle_len) {
-        str = realloc(*haystack, sizeof **haystack * (haystack_len + 1)); 
-        if (!str) goto exit; 
-        *haystack = str; 
-    } 
-
-exit:
-    return str; 
+    run_pipeline(&pipeline);
+    if (trace_fd >= 0) trace_end(&pipeline, 0, stat_code);
+    return 0;
 }
 
-/* Function to handle builtin functions - exit and cd 
-* Returns 1 if no builtin commands found, 0 if builtin commands found and executed
-*/ 
-int exec_builtin(char **command_tok) 
+/*
+* Function to launch every stage of a pipeline before waiting on any of them.
+* Stages are connected with pipes and, when the shell owns a terminal, share a
+* new process group that is given the terminal while it runs in the foreground.
+* Foreground pipelines are waited for, background ones are recorded so $! and exit can find them.
+* A pipeline run with "time" reports its wall time and the resources its stages used.
+* Under a timeout every stage gets the same deadline.
+*/
+void run_pipeline(struct pipeline *pl)
 {
-    // handle builtin command "exit"
-    char *home_env = getenv("HOME");
-    if (strncmp(command_tok[0], "exit", 4) == 0) {
-        if (command_tok[1] == NULL) {
-            fprintf(stderr, "\nexit\n"); 
-            // send SIGINT signal to child processes
-            for (int j = 0; j < bg_pidc; j++) {
-                kill(bg_pids[j], SIGINT); 
+    double timeout = pipeline_timeout(pl);
+    int prev_read = -1;
+    pid_t pgid = shell_tty >= 0 ? 0 : -1;
+    struct job_usage total = {0};
+    struct timespec start, end;
+    int i;
+
+    if (pl->timed) clock_gettime(CLOCK_MONOTONIC, &start);
+
+    jobs_init();  // not done at startup for -c
+    for (i = 0; i < pl->nstages; i++) pl->stages[i].pid = -1;
+    for (i = 0; i < pl->nstages; i++) {
+        struct command *cmd = &pl->stages[i];
+        int pipe_fds[2] = { -1, -1 };
+        if (i < pl->nstages - 1) {
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                perror("pipe() failed");
+                break;
             }
-            // exit with specified value
-            exit(exit_stat); 
+            if (pipe_size > 0) fcntl(pipe_fds[1], F_SETPIPE_SZ, pipe_size);
         }
-        // error if more than one argument is provided or if argument is not integer
-        // if (command_tok[2] != NULL || (isdigit(command_tok[1]) == 0)) {
-        //     fprintf(stderr, "Error: Incorrect amount or type of argument\n");
-        //     exit(1);
-        //     break;
-        // }
-        else {  
-            // else print to  stderr
-            exit_stat = atoi(command_tok[1]);
-            fprintf(stderr, "\nexit\n");
-            // send SIGINT signal to child processes
-            for (int j = 0; j < bg_pidc; j++) {
-                kill(bg_pids[j], SIGINT); 
+        cmd->stdin_fd = prev_read;
+        cmd->stdout_fd = pipe_fds[1];
+        cmd->pgid = pgid;
+        cmd->tty_fd = pl->bg ? -1 : shell_tty;
+        cmd->limits = pl->limits;
+        int here_fd = -1;  // a here-document replaces the pipe from the previous stage
+        if (cmd->here_doc != NULL || cmd->here_string != NULL) {
+            here_fd = cmd->stdin_fd = here_input_fd(cmd);
+            if (here_fd == -1) {
+                if (pipe_fds[0] >= 0) close(pipe_fds[0]);
+                if (pipe_fds[1] >= 0) close(pipe_fds[1]);
+                break;
             }
-            // exit with specified value
-            exit(exit_stat);
         }
+        int fan_fd = -1;  // more than one stdout file: the command writes into a pipe the shell fans out
+        if (fanout_targets(cmd) > 1 && (fan_fd = fanout_start(cmd, pl->bg)) == -1) {
+            if (here_fd >= 0) close(here_fd);
+            if (pipe_fds[0] >= 0) close(pipe_fds[0]);
+            if (pipe_fds[1] >= 0) close(pipe_fds[1]);
+            break;
+        }
+        uint64_t spawn_start = trace_fd >= 0 ? trace_now() : 0;
+        cmd->pid = spawn_command(cmd);
+        if (trace_fd >= 0) trace_spawn(i, cmd->pid, trace_now() - spawn_start);
+        if (cmd->pid > 0 && pgid == 0) pgid = cmd->pid;  // first stage leads the group
+
+        // the children have their own copies now
+        if (here_fd >= 0) close(here_fd);
+        if (fan_fd >= 0) close(fan_fd);
+        if (prev_read >= 0) close(prev_read);
+        if (pipe_fds[1] >= 0) close(pipe_fds[1]);
+        prev_read = pipe_fds[0];
+    }
+    if (prev_read >= 0) close(prev_read);
+    if (trace_fd >= 0) trace_mark(TRACE_SPAWNED);
+
+    pid_t last_pid = pl->stages[pl->nstages - 1].pid;
+    if (pl->bg) {  // background process runs without blocking wait
+        for (i = 0; i < pl->nstages; i++) {
+            if (pl->stages[i].pid > 0) {
+                job_add(pl->stages[i].pid, 1, pl->stages[i].argv[0]);
+                job_set_timeout(pl->stages[i].pid, timeout, pl->kill_after);
+            }
+        }
+        if (last_pid > 0) bg_pid = last_pid;
+        jobs_poll();  // a script may launch many in a row without waiting at a prompt
+        return;
     }
 
-    // handle builtin command cd
-    else if (strncmp(command_tok[0], "cd", 2) == 0) 
-    {
-        // if we have specified path, change to that path
-        if (command_tok[1] != NULL) {
-            int change_res = chdir(command_tok[1]); 
-            // error handling for chdir
-            if (change_res == -1) {
-                fprintf(stderr, "%s does not exist\n", command_tok[1]);
-                exit(1);
-            } 
+    for (i = 0; i < pl->nstages; i++) {
+        if (pl->stages[i].pid > 0) {
+            job_add(pl->stages[i].pid, 0, pl->stages[i].argv[0]);
+            job_set_timeout(pl->stages[i].pid, timeout, pl->kill_after);
         }
-        // return error if there are more than one path specified
-        // else if (command_tok[2] != NULL) {
-        //     fprintf(stderr, "Error: Too many arguments\n");
-        //     exit(1);  
-        // } 
-        else {  // default to HOME if no path specified
-            chdir(home_env); 
+    }
+    if (shell_tty >= 0 && pgid > 0) tcsetpgrp(shell_tty, pgid);
+    if (last_pid == -1) stat_code = 1;  // no process could be started for it
+    else if (last_pid == SPAWN_NOT_FOUND) stat_code = 127;
+    for (i = 0; i < pl->nstages; i++) {
+        if (pl->stages[i].pid > 0) {
+            struct job_usage usage = {0};
+            wait_foreground(pl->stages[i].pid, i == pl->nstages - 1, &usage);
+            job_usage_add(&total, &usage);
         }
     }
-    else {
-        return 1; 
+    if (shell_tty >= 0) tcsetpgrp(shell_tty, getpgrp());
+    fanout_drain();  // the last of the output still in a fan-out pipe
+    if (pl->timed) {
+        // the stages overlap, so the real time is measured around the whole pipeline
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        total.wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        job_usage_print(&total);
     }
-    return 0; 
 }
 
 /*
-* Function to fork with redirection while background process is not specified. 
-* Returns 0 if function was successful, 1 otherwise. 
+* Function to get the seconds a pipeline may run: its "timeout" prefix, or else
+* SMALLSH_TIMEOUT. Returns 0 for no limit.
 */
-int fork_with_redir(char **command_tok, int bg_flag) 
+double pipeline_timeout(const struct pipeline *pl)
 {
-    // there is input or output redirecting but not a background process
-    int sourceFD = 0;
-    int targetFD = 1;
-    int result = 1; 
-
-    // input or output redirect specified but not a background process
-    spawnPid = fork(); 
-
-    // both input & output specified
-    if (input_redir == 1 && output_redir == 1) {
-        // check state of fork
-        switch (spawnPid) {
-            case -1:
-                perror("fork() failed\n"); 
-                exit(1); 
-            case 0:  // execute in child branch
-                // TODO: reset all signals to their original dispositions
-                // open source file and redirect source
-                sourceFD = open(input_file, O_RDONLY); 
-                if (sourceFD == -1) {
-                    perror("source open() failed\n");
-                    exit(1); 
-                }
-
-                // redirect stdin to source file
-                result = dup2(sourceFD, 0);
-                if (result == -1) {
-                    perror("source dup2() failed\n");
-                    exit(2); 
-                }
-
-                // open target file and redirect
-                targetFD = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0777); 
-                if (targetFD == -1) {
-                    perror("target open() failed\n"); 
-                    exit(1); 
-                }
-                
-                // redirect stdout to target file
-                result = dup2(targetFD, 1);
-                if (result == -1) {
-                    perror("target dup2() failed\n"); 
-                    exit(2); 
-                }
-                // close file and run exec
-                fcntl(targetFD, F_SETFD, FD_CLOEXEC); 
-                execlp(command_tok[0], command_tok[0], command_tok[1], command_tok[2], command_tok[3], NULL);
-                exit(1);
-            default:  // in parent process, check if background process 
-                if (bg_flag == 1) {
-                    bg_pid = spawnPid; 
-                    bg_flag = 0; 
-                }
-                else {
-                    waitpid(spawnPid, &exit_stat, 0); 
-                    if (WIFEXITED(exit_stat)) {
-                        stat_code = WEXITSTATUS(exit_stat); 
-                        // DEBUG: fprintf(stderr, "Exit Status From Process: %d\n", stat_code);
-                    }
-                    if (WIFSIGNALED(exit_stat)) {
-                        stat_code = WTERMSIG(exit_stat); 
-                        // DEBUG: fprintf(stderr, "Exit Signal from Process: %d\n", stat_code); 
-                    }
-                    if (WIFSTOPPED(exit_stat)) {
-                        // send SIGCONT signal
-                        kill(spawnPid, SIGCONT); 
-                        // print to stderr
-                        fprintf(stderr, "Child process %d stopped. Continuing...\n", spawnPid); 
-                    }
-                }
-        }
-    }
-    // only input redirection specified
-    else if (input_redir == 1 && output_redir == 0) 
-    {
-        switch(spawnPid) {
-            case -1:  // catch fork error
-                perror("fork() failed"); 
-                exit(1); 
-            case 0:   // in child process
-                // TODO: reset all signals to their original disposition
-                // open and redirect source file
-                sourceFD = open(input_file, O_RDONLY); 
-                if (sourceFD == -1) {
-                    perror("open source() failed\n"); 
-                    exit(1); 
-                }
-                
-                // redirect stdin to sourceFD
-                result = dup2(sourceFD, 0); 
-                if (result == -1) {
-                    perror("source dup2() failed\n"); 
-                    exit(2); 
-                }
-                
-                // close file and exec
-                fcntl(sourceFD, F_SETFD, FD_CLOEXEC); 
-                execlp(command_tok[0], command_tok[0], command_tok[1], command_tok[2], command_tok[3], NULL); 
-                exit(1);
-            default:  // in parent process
-                if (bg_flag == 1)  // if bg_flag is set
-                {
-                    bg_pid = spawnPid;
-                    bg_flag = 0; 
-                }
-                    waitpid(spawnPid, &exit_stat, 0); 
-                    if (WIFEXITED(exit_stat)) {
-                        stat_code = WEXITSTATUS(exit_stat); 
-                        // DEBUG: fprintf(stderr, "Exit Status From Process: %d\n", stat_code);
-                    }
-                    if (WIFSIGNALED(exit_stat)) {
-                        stat_code = WTERMSIG(exit_stat); 
-                        // DEBUG: fprintf(stderr, "Exit Signal from Process: %d\n", stat_code); 
-                    }
-                    if (WIFSTOPPED(exit_stat)) {
-                        // send SIGCONT signal
-                        kill(spawnPid, SIGCONT); 
-                        // print to stderr
-                        fprintf(stderr, "Child process %d stopped. Continuing...\n", spawnPid); 
-                    }
-        }
-    }
-    // only output redirection specified
-    else if (output_redir == 1 && input_redir == 0) {
-        switch (spawnPid) {
-            case -1:  // handle fork error
-                perror("fork() failed\n");
-                exit(1); 
-            case 0:  // in child process
-                // TODO: reset all signals to their original disposition
-                // open and redirect source file
-                targetFD = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0777); 
-                if (targetFD == -1) {
-                    perror("open target() failed\n"); 
-                    exit(1); 
-                }
-                
-                // redirect stdin to sourceFD
-                result = dup2(targetFD, 1); 
-                if (result == -1) {
-                    perror("target dup2() failed\n"); 
-                    exit(2); 
-                }
-                
-                // close file and exec
-                fcntl(targetFD, F_SETFD, FD_CLOEXEC); 
-                execlp(command_tok[0], command_tok[0], command_tok[1], command_tok[2], command_tok[3], NULL);
-                // execvp(command_tok[0], command_tok); 
-                exit(1);  
-            default:  // in the parent process, perform a non-blocking wait
-                if (bg_flag == 1)  // if bg_flag is set
-                {
-                    bg_pid = spawnPid; 
-                    bg_flag = 0; 
-                }
-                else {
-                    waitpid(spawnPid, &exit_stat, 0); 
-                    if (WIFEXITED(exit_stat)) {
-                        stat_code = WEXITSTATUS(exit_stat); 
-                        // DEBUG: fprintf(stderr, "Exit Status From Process: %d\n", stat_code);
-                    }
-                    if (WIFSIGNALED(exit_stat)) {
-                        stat_code = WTERMSIG(exit_stat); 
-                        // DEBUG: fprintf(stderr, "Exit Signal from Process: %d\n", stat_code); 
-                    }
-                    if (WIFSTOPPED(exit_stat)) {
-                        // send SIGCONT signal
-                        kill(spawnPid, SIGCONT); 
-                        // print to stderr
-                        fprintf(stderr, "Child process %d stopped. Continuing...\n", spawnPid); 
-                    }
-                }
-        } 
-    }
-    else return 1;
-    // execvp(command_tok[0], command_tok); 
-    // waitpid(spawnPid, &exit_stat, 0);
-    return 0; 
+    if (pl->timeout > 0) return pl->timeout;
+    const char *env = var_get("SMALLSH_TIMEOUT");
+    double secs;
+    if (env == NULL || *env == '\0' || parse_duration(env, &secs) == -1) return 0;
+    return secs;
+}
+
+/*
+* Function to run a builtin under "time". It runs inside the shell, so its
+* resource usage is the change in the shell's own.
+*/
+void run_timed_builtin(const struct builtin *builtin, struct command *cmd)
+{
+    struct job_usage usage = {0};
+    struct rusage before, after;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    getrusage(RUSAGE_SELF, &before);
+    stat_code = run_builtin(builtin, cmd);
+    getrusage(RUSAGE_SELF, &after);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    usage.wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    timersub(&after.ru_utime, &before.ru_utime, &usage.ru.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &usage.ru.ru_stime);
+    usage.ru.ru_maxrss = after.ru_maxrss;
+    usage.ru.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+    usage.ru.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+    job_usage_print(&usage);
 }
 
-/* 
-* Function to fork and perform background process (with non-blocking wait)
+/*
+* Function to perform the blocking wait for a foreground process. The status of the
+* last stage of a pipeline is recorded for $?, and the resources it used in *usage.
+* A stopped process is continued and left running in the background.
 */
-pid_t fork_bg_process(char **command_tok) {
-    spawnPid = fork();
-    switch(spawnPid) {
-        case -1:  // error handling for fork
-            perror("fork() failed");
-            exit(1);
-        case 0:  // execute in child process
-            execvp(command_tok[0], command_tok); 
-            exit(1); 
-        default:  // in parent process perform non-blocking wait
-            bg_pids[bg_pidc] = spawnPid; 
-            bg_pidc++; 
-            // fprintf(stderr, "spawnPid=%d\n", spawnPid);
-            bg_pid = spawnPid; 
-            // fprintf(stderr, "bg_pid in bg process = %d\n", bg_pid);
+void wait_foreground(pid_t pid, int last_stage, struct job_usage *usage)
+{
+    exit_stat = job_wait_fg(pid, usage); 
+    if ((WIFEXITED(exit_stat) || WIFSIGNALED(exit_stat)) && last_stage) {
+        stat_code = job_status_code(exit_stat);
+    }
+    if (WIFSTOPPED(exit_stat)) {
+        // send SIGCONT signal
+        kill(pid, SIGCONT); 
+        // print to stderr
+        fprintf(stderr, "Child process %d stopped. Continuing...\n", pid); 
+        job_set_bg(pid);
+        bg_pid = pid;
     }
-    return bg_pid; 
 }
@@ -1,12 +1,268 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <stddef.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+
+struct limits;
+
+// One step of a command's redirection, the steps are applied in order
+enum { REDIR_OPEN, REDIR_DUP, REDIR_CLOSE, REDIR_PASS };
+struct redir {
+    int fd;              // fd it sets up, 0..9
+    int op;              // REDIR_OPEN path, REDIR_DUP / REDIR_PASS a copy of src, or REDIR_CLOSE
+    int flags;           // REDIR_OPEN: open() flags
+    int src;             // REDIR_DUP: fd of the command's to copy, REDIR_PASS: an fd of the shell's
+    char *path;          // REDIR_OPEN: the file
+};
+#define REDIR_MODE 0666  // permissions of a file created by redirection, before the umask
+
+// A parsed command that is ready to be launched
+struct command {
+    char **argv;         // NULL-terminated argument vector
+    struct redir *redirs;  // "<", ">", ">>", "2>", "&>", "n>&m" ... in the order they were written
+    int nredirs;
+    char *here_doc;      // expanded body of a "<<" here-document, or NULL
+    char *here_string;   // word of a "<<<" here-string, fed with a newline after it, or NULL
+    int stdin_fd;        // pipe end to use as stdin, or -1
+    int stdout_fd;       // pipe end to use as stdout, or -1
+    pid_t pgid;          // process group to join, 0 for a new one, -1 to stay in the shell's
+    int tty_fd;          // terminal to give to the new process group, or -1
+    pid_t pid;           // set once launched, -1 if the launch failed
+    const struct limits *limits;  // applied in the child before exec, or NULL
+};
+
+// Commands connected with "|", launched and waited for as one job
+struct pipeline {
+    struct command *stages;
+    int nstages;
+    int bg;              // 1 if the line ended with "&"
+    int timed;           // 1 if the line started with "time"
+    double timeout;      // seconds from "timeout DURATION", 0 for none
+    double kill_after;   // seconds from SIGTERM to SIGKILL once it has timed out
+    int prefix;          // words before the first stage ("time", "timeout ...", "limit ...")
+    struct limits *limits;  // from "limit ...", NULL for none
+};
+
+#define TIMEOUT_STATUS 124  // $? of a command that was killed for running too long
+#define TIMEOUT_GRACE  5.0  // default seconds between SIGTERM and SIGKILL
+
+// Bump allocator for per-line data, reset before each line is read
+struct arena_block;
+struct arena {
+    struct arena_block *head;   // first block, kept across resets
+    struct arena_block *cur;    // block currently handed out from
+    size_t open;                // length of the string being built at the top
+};
+
+// Values substituted for "~/", "$$", "$?", "$!", "$0".."$9" and "$NAME"
+struct expand_ctx {
+    const char *home;     // HOME, replaces the "~" of "~/"
+    const char *(*lookup)(const char *name, size_t len);  // $NAME, NULL if no variables are set
+    pid_t shell_pid;      // $$
+    int last_status;      // $?
+    pid_t last_bg;        // $!, expands to nothing while 0
+    char **params;        // $0..$9, missing ones expand to nothing
+    int nparams;
+};
+
+// One piece of a split line, kept so the line can be expanded again without rescanning it
+enum { LEX_LITERAL, LEX_DOLLAR, LEX_HOME, LEX_WORD_END, LEX_GLOB_END, LEX_HEREDOC_END };
+struct lex_seg {
+    unsigned char kind;  // LEX_LITERAL, LEX_DOLLAR ("$" needle), LEX_HOME ("~" of "~/"), LEX_WORD_END,
+                         // LEX_GLOB_END for the end of a word that is a glob pattern, or
+                         // LEX_HEREDOC_END for the end of a here-document body, which replaces word len
+    uint32_t off, len;   // slice of the line it came from
+};
+#define LEX_HEREDOC_MAX 16  // here-documents per command, the delimiters of any more are plain words
+
+// Word splitter state, reused from line to line
+struct lexer {
+    struct arena arena;          // words of the current line
+    char **words;                // NULL-terminated word list
+    size_t words_cap;
+    unsigned char is_delim[256]; // IFS characters
+    int record;                  // 1 to record the segments of the next lex_line()
+    struct lex_seg *segs;        // segments of the last recorded line
+    size_t nsegs, segs_cap;
+};
+
+// Word splitting and expansion (lexer.c)
+void *arena_alloc(struct arena *a, size_t n);
+void arena_reset(struct arena *a);
+void lex_set_delim(struct lexer *lx, const char *delim);
+char **lex_line(struct lexer *lx, const char *line, size_t len, const struct expand_ctx *ctx, int *word_count);
+char **lex_expand(struct lexer *lx, const char *line, const struct lex_seg *segs, size_t nsegs,
+                  const struct expand_ctx *ctx, int *word_count);
+int lex_heredocs(const unsigned char *is_delim, const char *line, size_t len, struct lex_seg *docs);
+char *str_gsub(char *restrict *restrict haystack, char const *restrict needle, char const *restrict sub);
+
+// Pathname expansion (glob.c)
+int glob_has_magic(const char *s, size_t len);
+ssize_t glob_expand(struct arena *a, const char *pattern, char ***matches);
+void glob_cache_reset(void);
+void glob_cache_print(void);
+
+// Parsing (parser.c)
+void command_init(struct command *cmd);
+int parse_duration(const char *s, double *secs);
+int redir_operator(const char *word, struct redir *r);
+int parse_pipeline(struct arena *a, char **words, int word_count, struct pipeline *pl);
+
+// Per-job CPU, priority, rlimit and cgroup settings (limits.c)
+int parse_limits(struct arena *a, char **words, int word_count, int at, struct limits **out);
+size_t limits_size(const struct limits *lim);
+int limits_prepare(const struct limits *lim);
+int limits_apply(const struct limits *lim);
+
+// Buffered line reader over a file descriptor
+struct input {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t start;        // first byte not handed out yet
+    size_t end;          // end of the data read so far
+    int eof;
+    const char *prompt;  // shown again after background jobs are reported, or NULL
+    int mapped;          // 1 if buf is a read-only mapping of a script file
+    size_t block;        // bytes to read at a time, 0 until the fd has been looked at
+};
+#define INPUT_EOF   (-1)
+#define INPUT_INTR  (-2)
+
+// Line input (input.c)
+int input_open_script(struct input *in, const char *path);
+void input_open_string(struct input *in, const char *str);
+int input_done(struct input *in);
+int input_interactive(struct input *in);
+ssize_t input_getline(struct input *in, const char **line);
+
+// Resources used by a finished job, from wait4()
+struct job_usage {
+    double wall;         // seconds from launch until it was reaped
+    struct rusage ru;
+};
+
+// Job table and child reaping (jobs.c)
+void jobs_init(void);
+void jobs_reinit(void);
+int jobs_event_fd(void);
+void job_add(pid_t pid, int bg, const char *name);
+#define JOB_HELPER 2  // bg value of a helper process: waited for with the background jobs, never listed or reported
+void job_set_bg(pid_t pid);
+void job_set_timeout(pid_t pid, double secs, double kill_after);
+int job_changed(pid_t pid, int status, const struct rusage *ru);
+void jobs_watch_fd(int fd);
+void jobs_unwatch_fd(int fd);
+int job_wait_fd(int fd);
+int job_wait_fg(pid_t pid, struct job_usage *usage);
+int job_check_fg(pid_t pid, int *status);
+int job_wait_bg(pid_t pid, int *status);
+pid_t job_wait_next_bg(int *status);
+void jobs_wait_all_bg(void);
+int job_status_code(int status);
+void jobs_poll(void);
+void jobs_signal_bg(int sig);
+void job_usage_add(struct job_usage *sum, const struct job_usage *u);
+void job_usage_print(const struct job_usage *u);
+int builtin_jobs(char **argv);
+int builtin_stats(char **argv);
+
+// Launch engine (spawn.c)
+#define SPAWN_NOT_FOUND  (-127)  // spawn_command(): the command isn't in PATH, no process was started
+pid_t spawn_command(struct command *cmd);
+int here_input_fd(const struct command *cmd);
+__attribute__((noreturn)) void exec_command(struct command *cmd);
+
+// Output to more than one file (fanout.c)
+struct fanout;
+int fanout_targets(const struct command *cmd);
+int fanout_start(struct command *cmd, int bg);
+int fanout_pump(int fd);
+void fanout_drain(void);
+struct fanout *fanout_capture(struct command *cmd);
+void fanout_release(struct fanout *f);
+
+// Prefork launcher (zygote.c)
+#define ZYGOTE_UNAVAILABLE  (-2)
+void zygote_start(void);
+pid_t zygote_spawn(struct command *cmd);
+int zygote_reap(void);
+
+// Hashed PATH lookup (pathcache.c)
+const char *path_lookup(const char *name);
+void path_forget(const char *name);
+int builtin_hash(char **command_tok);
+
+// Compiled line cache (cache.c)
+int line_cache_lookup(struct lexer *lx, const char *line, size_t len, const struct expand_ctx *ctx,
+                      char ***words, int *word_count, struct pipeline *pl);
+void line_cache_store(const struct lexer *lx, const char *line, size_t len, char **orig, int nwords,
+                      const struct pipeline *pl);
+void line_cache_clear(void);
+int builtin_cache(char **argv);
+
+// Shell variables and the environment (vars.c)
+int vars_init(void);
+void vars_track_ifs(struct lexer *lx);
+char **vars_environ(void);
+int var_name_ok(const char *name, size_t len);
+int var_set(const char *name, const char *value, int export);
+const char *var_lookup(const char *name, size_t len);
+const char *var_get(const char *name);
+void var_unset(const char *name);
+int var_assign(const char *word);
+int builtin_export(char **argv);
+int builtin_unset(char **argv);
+
+// A command run inside the shell instead of being launched
+struct builtin {
+    const char *name;
+    int (*fn)(char **argv);   // returns the exit status
+};
+
+// Builtin commands (builtins.c)
+const struct builtin *builtin_find(const char *name);
+int run_builtin(const struct builtin *b, struct command *cmd);
+extern const struct command *builtin_command;  // the command run_builtin() is running, for its redirection
+
+// Bounded parallel execution (parallel.c)
+int builtin_parallel(char **argv);
+
+// The memo builtin (memo.c)
+int builtin_memo(char **argv);
+
+// Shell state shared with the builtins (smallsh.c)
+extern int stat_code;   // $?
+extern int exit_stat;   // wait status of the last foreground job
+int execute_line(struct lexer *lexer, struct expand_ctx *expand, const char *line, size_t len, int exec_last);
+
+// Control flow (flow.c), more returns the next line like input_getline() or NULL if there is none
+typedef ssize_t (*flow_more_fn)(void *arg, const char **line);
+int execute_list(struct lexer *lexer, struct expand_ctx *expand, const char *line, size_t len, int exec_last,
+                 flow_more_fn more, void *arg);
+
+// Command server (serve.c)
+int serve_main(const char *path, struct lexer *lexer, struct expand_ctx *expand);
+
+// Per-line latency tracing (trace.c), every hook is guarded by trace_fd >= 0
+enum { TRACE_START, TRACE_READ, TRACE_EXPAND, TRACE_PARSE, TRACE_SPAWNED, TRACE_DONE, TRACE_NSTAGES };
+extern int trace_fd;
+void trace_init(void);
+uint64_t trace_now(void);
+void trace_begin(void);
+void trace_next(void);
+void trace_mark(int stage);
+void trace_spawn(int i, pid_t pid, uint64_t spawn_ns);
+void trace_end(const struct pipeline *pl, int builtin, int status);
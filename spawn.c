@@ -0,0 +1,288 @@
+/* Launch engine for external commands.
+* Commands are started with posix_spawn(), which glibc implements with
+* clone(CLONE_VM | CLONE_VFORK), so the shell's page tables are never copied
+* no matter how large the shell has grown. Redirection is expressed as spawn
+* file actions, pipeline stages are joined into one process group through the
+* spawn attributes, and the signals smallsh ignores are reset to their defaults.
+* Here-documents and here-strings reach the child as an ordinary stdin fd: a
+* pipe that already holds the data when it is small, a memfd otherwise.
+* If a launch can't be expressed that way, or fails, we fall back to fork() + exec,
+* as we do for a command with a "limit" prefix, whose settings the child applies itself.
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+#include <limits.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+extern char **environ;
+
+static pid_t spawn_fork_exec(struct command *cmd);
+
+/* Function to count the words of a NULL-terminated argv */
+static int argv_count(char **argv)
+{
+    int n = 0;
+    while (argv[n] != NULL) n++;
+    return n;
+}
+
+/*
+* Function to fill sh_argv (argc + 2 slots) with "/bin/sh path args...", to run
+* a file without a #! line as a shell script, as execvp() does on ENOEXEC.
+*/
+static void script_argv(char **sh_argv, const char *path, char **argv)
+{
+    sh_argv[0] = "/bin/sh";
+    sh_argv[1] = (char *) path;
+    for (int i = 1; (sh_argv[i + 1] = argv[i]) != NULL; i++) {}
+}
+
+/*
+* Function to launch a command with posix_spawn(), exec'ing the path found by path_lookup().
+* A command that isn't found is reported here, without a child (so its
+* redirections aren't performed); one that can't be started for another reason
+* is launched again with fork() so the child reports why.
+* Returns the pid of the child, SPAWN_NOT_FOUND, or -1 if no process could be started.
+*/
+pid_t spawn_command(struct command *cmd)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sig_default, sig_mask;
+    pid_t pid;
+    int err;
+
+    // the environment is rebuilt here only if an exported variable changed
+    char **envp = vars_environ();
+    if (envp == NULL) envp = environ;
+
+    // CPU affinity, priority, rlimits and the cgroup are set by the child between fork and exec
+    if (cmd->limits != NULL) return spawn_fork_exec(cmd);
+
+    // in zygote mode the small helper forks the child, however big the shell has grown
+    pid = zygote_spawn(cmd);
+    if (pid != ZYGOTE_UNAVAILABLE) return pid;
+
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        return spawn_fork_exec(cmd);
+    }
+    if (posix_spawnattr_init(&attr) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return spawn_fork_exec(cmd);
+    }
+
+    // hand the terminal to the job before its stdin is replaced
+    err = 0;
+#ifdef __GLIBC_PREREQ
+#if __GLIBC_PREREQ(2, 35)
+    if (cmd->tty_fd >= 0 && cmd->pgid == 0) {
+        err = posix_spawn_file_actions_addtcsetpgrp_np(&actions, cmd->tty_fd);
+    }
+#endif
+#endif
+
+    // connect pipes, then redirect stdin / stdout with file actions (performed in the child)
+    if (err == 0 && cmd->stdin_fd >= 0) {
+        err = posix_spawn_file_actions_adddup2(&actions, cmd->stdin_fd, 0);
+    }
+    if (err == 0 && cmd->stdout_fd >= 0) {
+        err = posix_spawn_file_actions_adddup2(&actions, cmd->stdout_fd, 1);
+    }
+    for (int i = 0; err == 0 && i < cmd->nredirs; i++) {
+        const struct redir *r = &cmd->redirs[i];
+        switch (r->op) {
+        case REDIR_OPEN: err = posix_spawn_file_actions_addopen(&actions, r->fd, r->path, r->flags, REDIR_MODE); break;
+        case REDIR_CLOSE: err = posix_spawn_file_actions_addclose(&actions, r->fd); break;
+        default: err = posix_spawn_file_actions_adddup2(&actions, r->src, r->fd);
+        }
+    }
+
+    // the child gets the default dispositions for the signals the shell ignores and an empty signal mask
+    sigemptyset(&sig_default);
+    sigaddset(&sig_default, SIGINT);
+    sigaddset(&sig_default, SIGTSTP);
+    sigaddset(&sig_default, SIGTTOU);
+    sigemptyset(&sig_mask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    if (cmd->pgid >= 0) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        if (err == 0) err = posix_spawnattr_setpgroup(&attr, cmd->pgid);
+    }
+    if (err == 0) err = posix_spawnattr_setsigdefault(&attr, &sig_default);
+    if (err == 0) err = posix_spawnattr_setsigmask(&attr, &sig_mask);
+    if (err == 0) err = posix_spawnattr_setflags(&attr, flags);
+
+    if (err != 0) {  // something we couldn't express, launch the slow way
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+        return spawn_fork_exec(cmd);
+    }
+
+    // exec by the path remembered in the hash table, dropping it if it has gone stale
+    const char *path = path_lookup(cmd->argv[0]);
+    err = ENOENT;
+    if (path != NULL) {
+        err = posix_spawn(&pid, path, &actions, &attr, cmd->argv, envp);
+        if (err == ENOENT && path != cmd->argv[0]) {
+            path_forget(cmd->argv[0]);
+            path = path_lookup(cmd->argv[0]);
+            if (path != NULL) err = posix_spawn(&pid, path, &actions, &attr, cmd->argv, envp);
+        }
+        if (err == ENOEXEC) {
+            char *sh_argv[argv_count(cmd->argv) + 2];
+            script_argv(sh_argv, path, cmd->argv);
+            err = posix_spawn(&pid, sh_argv[0], &actions, &attr, sh_argv, envp);
+        }
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (path == NULL) {  // nothing for a child to tell us, so don't fork one
+        fprintf(stderr, "%s: %s\n", cmd->argv[0], strerror(ENOENT));
+        return SPAWN_NOT_FOUND;
+    }
+    // the spawn reports a single errno without saying which step it came from,
+    // so a failed launch is run again the slow way and the child reports the step
+    // that fails (and exits with the status that goes with it)
+    if (err != 0) return spawn_fork_exec(cmd);
+    return pid;
+}
+
+/*
+* Function to put the here-document or here-string of cmd in a file descriptor
+* to use as its stdin. Data that fits in an empty pipe is written into one and
+* the read end returned, anything bigger goes in an anonymous memfd, so nothing
+* is written to the file system and the child can still seek in it.
+* Returns the fd (close-on-exec), or -1 if it could not be made (which has been reported).
+*/
+int here_input_fd(const struct command *cmd)
+{
+    const char *data = cmd->here_doc != NULL ? cmd->here_doc : cmd->here_string;
+    struct iovec iov[2] = {
+        { (void *) data, strlen(data) },
+        { "\n", cmd->here_doc == NULL },  // a here-string ends with a newline
+    };
+    size_t total = iov[0].iov_len + iov[1].iov_len;
+    int fds[2];
+
+    if (total <= PIPE_BUF) {  // the write can't block
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe() failed");
+            return -1;
+        }
+        if (writev(fds[1], iov, 2) != (ssize_t) total) perror("here-document write() failed");
+        close(fds[1]);
+        return fds[0];
+    }
+
+    int fd = memfd_create("smallsh-here", MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("memfd_create() failed");
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        for (size_t off = 0; off < iov[i].iov_len; ) {
+            ssize_t n = write(fd, (const char *) iov[i].iov_base + off, iov[i].iov_len - off);
+            if (n == -1) {
+                perror("here-document write() failed");
+                close(fd);
+                return -1;
+            }
+            off += n;
+        }
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/*
+* Fallback launcher using fork() and execv().
+* Returns the pid of the child process, or -1 if fork() failed (which has been reported).
+*/
+static pid_t spawn_fork_exec(struct command *cmd)
+{
+    pid_t pid = fork();
+    switch (pid) {
+        case -1:
+            perror("fork() failed");
+            return -1;
+        case 0:  // child process: reset signals, redirect, exec
+            exec_command(cmd);
+        default:  // parent: set the group too, so it exists before the next stage joins it
+            if (cmd->pgid >= 0) setpgid(pid, cmd->pgid == 0 ? pid : cmd->pgid);
+    }
+    return pid;
+}
+
+/*
+* Function to turn the calling process into cmd: join its process group, reset
+* the signals the shell ignores, apply its limits, connect pipes, apply the
+* redirection steps in order, then execv() (a file that isn't an executable
+* format is run by /bin/sh, as execvp() does).
+* Does not return: a failed redirection exits with status 1 (2 for a failed dup2),
+* a command that isn't found with 127 and one that can't be executed with 126.
+*/
+void exec_command(struct command *cmd)
+{
+    struct sigaction default_action = {0};
+    sigset_t sig_mask;
+
+    if (cmd->pgid >= 0) {
+        setpgid(0, cmd->pgid);
+        if (cmd->tty_fd >= 0 && cmd->pgid == 0) tcsetpgrp(cmd->tty_fd, getpid());
+    }
+    default_action.sa_handler = SIG_DFL;
+    sigaction(SIGINT, &default_action, NULL);
+    sigaction(SIGTSTP, &default_action, NULL);
+    sigaction(SIGTTOU, &default_action, NULL);
+    sigemptyset(&sig_mask);
+    sigprocmask(SIG_SETMASK, &sig_mask, NULL);
+    if (cmd->limits != NULL && limits_apply(cmd->limits) == -1) _exit(1);
+
+    if (cmd->stdin_fd >= 0 && dup2(cmd->stdin_fd, 0) == -1) {
+        perror("pipe dup2() failed");
+        _exit(2);
+    }
+    if (cmd->stdout_fd >= 0 && dup2(cmd->stdout_fd, 1) == -1) {
+        perror("pipe dup2() failed");
+        _exit(2);
+    }
+
+    for (int i = 0; i < cmd->nredirs; i++) {
+        const struct redir *r = &cmd->redirs[i];
+        int fd = r->src;
+        if (r->op == REDIR_CLOSE) {
+            close(r->fd);
+            continue;
+        }
+        if (r->op == REDIR_OPEN) {
+            fd = open(r->path, r->flags, REDIR_MODE);
+            if (fd == -1) {
+                fprintf(stderr, "%s: %s\n", r->path, strerror(errno));
+                _exit(1);
+            }
+        }
+        if (fd != r->fd && dup2(fd, r->fd) == -1) {
+            perror("redirection dup2() failed");
+            _exit(2);
+        }
+        if (r->op == REDIR_OPEN && fd != r->fd) close(fd);
+    }
+    const char *path = path_lookup(cmd->argv[0]);
+    if (path != NULL) execv(path, cmd->argv);
+    if (path != NULL && errno == ENOEXEC) {
+        char *sh_argv[argv_count(cmd->argv) + 2];
+        script_argv(sh_argv, path, cmd->argv);
+        execv(sh_argv[0], sh_argv);
+        errno = ENOEXEC;  // the error that matters is the file's own
+    }
+    // execv only returns on error: 127 if there is no such command, 126 if it can't be run
+    int err = path == NULL ? ENOENT : errno;
+    fprintf(stderr, "%s: %s\n", cmd->argv[0], strerror(err));
+    _exit(err == ENOENT ? 127 : 126);
+}
@@ -0,0 +1,142 @@
+/* Per-line latency tracing.
+* With SMALLSH_TRACE set, one JSON record is written for every command line,
+* with CLOCK_MONOTONIC timestamps (ns) for the end of each stage of main():
+* input read, word splitting and expansion, parsing, launch and wait. Each
+* pipeline stage also gets its pid and how long its spawn took, which for
+* posix_spawn() is the time until the child has exec'd.
+* SMALLSH_TRACE is a file to append to, or a number for an fd that is already
+* open. When it is unset every hook is skipped by a single test of trace_fd.
+* A compound line (if, while, for) gets a record per command it runs, each
+* with the time the whole compound had been read as its read stamp.
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+
+int trace_fd = -1;  // where records go, -1 when tracing is off
+
+static FILE *trace_file = NULL;
+static unsigned long trace_line = 0;      // number of lines traced so far
+static uint64_t trace_ts[TRACE_NSTAGES];  // end of each stage, 0 if it didn't happen
+
+// per pipeline stage
+struct trace_stage {
+    pid_t pid;
+    uint64_t spawn_ns;
+};
+static struct trace_stage *trace_stages = NULL;
+static int trace_stages_cap = 0;
+static int trace_nstages = 0;
+
+static const char *trace_names[TRACE_NSTAGES] = { "start", "read", "expand", "parse", "spawned", "done" };
+
+/* Function to read the monotonic clock in ns */
+uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Function to turn tracing on if SMALLSH_TRACE is set */
+void trace_init(void)
+{
+    const char *target = getenv("SMALLSH_TRACE");
+    char *end;
+    if (target == NULL || *target == '\0') return;
+
+    long fd = strtol(target, &end, 10);
+    if (*end != '\0') fd = open(target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd < 0 || (trace_file = fdopen(fd, "a")) == NULL) {
+        fprintf(stderr, "smallsh: SMALLSH_TRACE: %s: %s\n", target, strerror(errno));
+        return;
+    }
+    trace_fd = fd;
+}
+
+/* Function to start the record for a new line */
+void trace_begin(void)
+{
+    memset(trace_ts, 0, sizeof trace_ts);
+    trace_nstages = 0;
+    trace_ts[TRACE_START] = trace_now();
+}
+
+/* Function to start the record for the next command of a compound line, keeping the line's read stamp */
+void trace_next(void)
+{
+    uint64_t read = trace_ts[TRACE_READ];
+    trace_begin();
+    trace_ts[TRACE_READ] = read;
+}
+
+/* Function to note that stage has just ended */
+void trace_mark(int stage)
+{
+    trace_ts[stage] = trace_now();
+}
+
+/* Function to record the launch of pipeline stage i, which took spawn_ns */
+void trace_spawn(int i, pid_t pid, uint64_t spawn_ns)
+{
+    if (i >= trace_stages_cap) {
+        int cap = trace_stages_cap ? trace_stages_cap * 2 : 8;
+        while (cap <= i) cap *= 2;
+        struct trace_stage *stages = realloc(trace_stages, cap * sizeof *stages);
+        if (stages == NULL) return;
+        trace_stages = stages;
+        trace_stages_cap = cap;
+    }
+    trace_stages[i].pid = pid;
+    trace_stages[i].spawn_ns = spawn_ns;
+    if (i >= trace_nstages) trace_nstages = i + 1;
+}
+
+/* Function to write s as a JSON string */
+static void trace_str(const char *s)
+{
+    putc('"', trace_file);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') fprintf(trace_file, "\\%c", c);
+        else if (c < 0x20) fprintf(trace_file, "\\u%04x", c);
+        else putc(c, trace_file);
+    }
+    putc('"', trace_file);
+}
+
+/*
+* Function to write the record for the current line. pl is NULL if the line
+* didn't parse, builtin is 1 if it ran inside the shell, and status is $?
+* (not known for a background pipeline).
+*/
+void trace_end(const struct pipeline *pl, int builtin, int status)
+{
+    trace_ts[TRACE_DONE] = trace_now();
+
+    fprintf(trace_file, "{\"line\":%lu,\"ts\":{", ++trace_line);
+    for (int i = 0; i < TRACE_NSTAGES; i++) {
+        fprintf(trace_file, i ? ",\"%s\":" : "\"%s\":", trace_names[i]);
+        if (trace_ts[i] != 0) fprintf(trace_file, "%" PRIu64, trace_ts[i]);
+        else fputs("null", trace_file);
+    }
+    fputs("},\"stages\":[", trace_file);
+    for (int i = 0; pl != NULL && i < pl->nstages; i++) {
+        fputs(i ? ",{\"cmd\":" : "{\"cmd\":", trace_file);
+        trace_str(pl->stages[i].argv[0]);
+        if (!builtin && i < trace_nstages) {
+            fprintf(trace_file, ",\"pid\":%jd,\"spawn_ns\":%" PRIu64, (intmax_t) trace_stages[i].pid, trace_stages[i].spawn_ns);
+        }
+        putc('}', trace_file);
+    }
+    fputs("]", trace_file);
+
+    // wait is the time from the last launch to the end of the line
+    if (trace_ts[TRACE_SPAWNED] != 0) {
+        fprintf(trace_file, ",\"wait_ns\":%" PRIu64, trace_ts[TRACE_DONE] - trace_ts[TRACE_SPAWNED]);
+    }
+    if (pl != NULL && builtin) fputs(",\"builtin\":true", trace_file);
+    if (pl != NULL && pl->bg) fputs(",\"bg\":true,\"status\":null}\n", trace_file);
+    else fprintf(trace_file, ",\"status\":%d}\n", status);
+    fflush(trace_file);
+}
@@ -0,0 +1,296 @@
+/* Shell variables.
+* Every variable, exported or not, lives in one open-addressing hash table.
+* The environment is imported into it at startup. Each variable is stored as
+* a single "NAME=value" string, so the envp array handed to new commands is
+* just pointers into the table. That array is rebuilt only after an exported
+* variable has changed, not for every spawn.
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+
+#define VARS_MIN 64  // initial number of slots (power of two)
+
+extern char **environ;
+
+struct var {
+    char *entry;       // "NAME=value", NULL if the slot is empty
+    size_t name_len;   // length of NAME
+    int exported;
+};
+
+static struct var *var_table = NULL;
+static size_t var_cap = 0;       // number of slots
+static size_t var_count = 0;     // number of used slots
+static size_t var_exported = 0;  // number of exported variables
+
+static char **envp = NULL;       // exported entries, NULL-terminated
+static int envp_dirty = 1;       // an exported variable changed since envp was built
+static struct lexer *ifs_lexer = NULL;  // splits words on IFS, see vars_track_ifs()
+static char **retired = NULL;    // replaced exported entries envp may still point to
+static size_t retired_count = 0, retired_cap = 0;
+
+/* FNV-1a hash of name[0..len) */
+static size_t var_hash(const char *name, size_t len)
+{
+    size_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Function to find the slot holding name[0..len), or the empty slot where it belongs */
+static size_t var_slot(const char *name, size_t len)
+{
+    size_t mask = var_cap - 1;
+    size_t i = var_hash(name, len) & mask;
+    while (var_table[i].entry != NULL &&
+           (var_table[i].name_len != len || memcmp(var_table[i].entry, name, len) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/* Function to double the table size and reinsert every variable */
+static int var_grow(void)
+{
+    struct var *old = var_table;
+    size_t old_cap = var_cap;
+    size_t new_cap = var_cap ? var_cap * 2 : VARS_MIN;
+
+    struct var *table = calloc(new_cap, sizeof *table);
+    if (table == NULL) return -1;
+    var_table = table;
+    var_cap = new_cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].entry != NULL) var_table[var_slot(old[i].entry, old[i].name_len)] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/* Function to free an exported entry once envp no longer points to it */
+static void var_retire(char *entry)
+{
+    if (retired_count == retired_cap) {
+        size_t cap = retired_cap ? retired_cap * 2 : 16;
+        char **list = realloc(retired, cap * sizeof *list);
+        if (list == NULL) return;  // leaked rather than freed under envp
+        retired = list;
+        retired_cap = cap;
+    }
+    retired[retired_count++] = entry;
+}
+
+/* Function to check that name[0..len) is a valid variable name */
+int var_name_ok(const char *name, size_t len)
+{
+    if (len == 0 || !(name[0] == '_' || (name[0] >= 'A' && name[0] <= 'Z') || (name[0] >= 'a' && name[0] <= 'z'))) {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++) {
+        char c = name[i];
+        if (!(c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))) return 0;
+    }
+    return 1;
+}
+
+/* Function to apply a new value of IFS: cached lines were split on the old one, so they go */
+static void ifs_changed(void)
+{
+    if (ifs_lexer == NULL) return;
+    const char *ifs = var_get("IFS");
+    lex_set_delim(ifs_lexer, ifs == NULL ? " \t\n" : ifs);  // IFS defaults to space, tab and newline when unset
+    line_cache_clear();
+}
+
+/*
+* Function to set name[0..len) to value. export is 1 to export the variable,
+* 0 to leave an existing variable as it was (a new one is not exported).
+* Returns 0 on success, -1 if memory could not be allocated.
+*/
+static int var_set_n(const char *name, size_t len, const char *value, int export)
+{
+    if (var_cap == 0 && var_grow() == -1) return -1;
+    size_t value_len = strlen(value);
+    char *entry = malloc(len + value_len + 2);
+    if (entry == NULL) return -1;
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, value_len + 1);
+
+    size_t i = var_slot(name, len);
+    if (var_table[i].entry == NULL) {
+        if ((var_count + 1) * 4 > var_cap * 3) {  // keep the load factor under 3/4
+            if (var_grow() == -1) {
+                free(entry);
+                return -1;
+            }
+            i = var_slot(name, len);
+        }
+        var_table[i].name_len = len;
+        var_table[i].exported = 0;
+        var_count++;
+    } else if (var_table[i].exported) {
+        var_retire(var_table[i].entry);
+    } else {
+        free(var_table[i].entry);
+    }
+    var_table[i].entry = entry;
+    if (export && !var_table[i].exported) {
+        var_table[i].exported = 1;
+        var_exported++;
+    }
+    if (var_table[i].exported) envp_dirty = 1;
+    if (len == 3 && memcmp(name, "IFS", 3) == 0) ifs_changed();
+    return 0;
+}
+
+/* Function to set name to value, see var_set_n() */
+int var_set(const char *name, const char *value, int export)
+{
+    return var_set_n(name, strlen(name), value, export);
+}
+
+/* Function to look up name[0..len), returns its value or NULL if it is not set */
+const char *var_lookup(const char *name, size_t len)
+{
+    if (var_cap == 0) return NULL;
+    struct var *v = &var_table[var_slot(name, len)];
+    return v->entry != NULL ? v->entry + len + 1 : NULL;
+}
+
+/* Function to look up name, returns its value or NULL if it is not set */
+const char *var_get(const char *name)
+{
+    return var_lookup(name, strlen(name));
+}
+
+/*
+* Function to remove name. Uses backward-shift deletion so no tombstones are left behind.
+*/
+void var_unset(const char *name)
+{
+    size_t len = strlen(name);
+    if (var_cap == 0) return;
+    size_t mask = var_cap - 1;
+    size_t i = var_slot(name, len);
+    if (var_table[i].entry == NULL) return;
+
+    if (var_table[i].exported) {
+        var_retire(var_table[i].entry);
+        var_exported--;
+        envp_dirty = 1;
+    } else {
+        free(var_table[i].entry);
+    }
+    var_table[i].entry = NULL;
+    var_count--;
+
+    // move later entries of the probe run back into the hole
+    for (size_t j = (i + 1) & mask; var_table[j].entry != NULL; j = (j + 1) & mask) {
+        size_t home = var_hash(var_table[j].entry, var_table[j].name_len) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            var_table[i] = var_table[j];
+            var_table[j].entry = NULL;
+            i = j;
+        }
+    }
+    if (strcmp(name, "IFS") == 0) ifs_changed();
+}
+
+/* Function to make lx split words on IFS from now on, following every change to it */
+void vars_track_ifs(struct lexer *lx)
+{
+    ifs_lexer = lx;
+    ifs_changed();
+}
+
+/*
+* Function to import the environment, every variable in it is exported.
+* Returns 0 on success, -1 if memory could not be allocated.
+*/
+int vars_init(void)
+{
+    for (char **env = environ; *env != NULL; env++) {
+        const char *eq = strchr(*env, '=');
+        if (eq == NULL) continue;
+        if (var_set_n(*env, eq - *env, eq + 1, 1) == -1) return -1;
+    }
+    return vars_environ() == NULL ? -1 : 0;
+}
+
+/*
+* Function to get the environment for a new command. envp (and environ, so
+* getenv() and the exec fallbacks agree with it) is rebuilt only when an
+* exported variable has changed since the last call.
+* Returns NULL if memory could not be allocated.
+*/
+char **vars_environ(void)
+{
+    if (!envp_dirty) return envp;
+    char **list = realloc(envp, (var_exported + 1) * sizeof *list);
+    if (list == NULL) return NULL;
+    envp = list;
+    size_t n = 0;
+    for (size_t i = 0; i < var_cap; i++) {
+        if (var_table[i].entry != NULL && var_table[i].exported) envp[n++] = var_table[i].entry;
+    }
+    envp[n] = NULL;
+    environ = envp;
+    envp_dirty = 0;
+
+    for (size_t i = 0; i < retired_count; i++) free(retired[i]);
+    retired_count = 0;
+    return envp;
+}
+
+/*
+* Function to run a word of the form NAME=value as an assignment.
+* Returns 1 if word was an assignment, 0 if it is not one, -1 if memory could not be allocated.
+*/
+int var_assign(const char *word)
+{
+    const char *eq = strchr(word, '=');
+    if (eq == NULL || !var_name_ok(word, eq - word)) return 0;
+    return var_set_n(word, eq - word, eq + 1, 0) == -1 ? -1 : 1;
+}
+
+/*
+* Function for the builtin command export.
+*   export                  list the exported variables
+*   export name[=value] ... export each name, setting it first when a value is given
+* Returns 0 on success, 1 if a name was not valid.
+*/
+int builtin_export(char **argv)
+{
+    int status = 0;
+    if (argv[1] == NULL) {
+        for (char **env = vars_environ(); env != NULL && *env != NULL; env++) printf("export %s\n", *env);
+        return 0;
+    }
+    for (int i = 1; argv[i] != NULL; i++) {
+        const char *eq = strchrnul(argv[i], '=');
+        size_t len = eq - argv[i];
+        if (!var_name_ok(argv[i], len)) {
+            fprintf(stderr, "export: %s: not a valid name\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        const char *value = *eq == '=' ? eq + 1 : var_lookup(argv[i], len);
+        if (var_set_n(argv[i], len, value == NULL ? "" : value, 1) == -1) {
+            perror("export");
+            return 1;
+        }
+    }
+    return status;
+}
+
+/* Builtin unset name ...: remove each variable */
+int builtin_unset(char **argv)
+{
+    for (int i = 1; argv[i] != NULL; i++) var_unset(argv[i]);
+    return 0;
+}
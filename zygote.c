@@ -0,0 +1,349 @@
+/* Prefork launcher ("zygote").
+* With SMALLSH_ZYGOTE set, a helper is forked at startup while the shell is
+* still small, and every launch is handed to it: the command's argv, cwd,
+* environment and redirections go over a SOCK_SEQPACKET socketpair, with the
+* pipe ends and terminal passed along as SCM_RIGHTS. The helper forks the
+* child (cheap, the helper never grows) and sends back its pid, then its wait
+* statuses and resource usage over a second socket that the job table polls
+* next to its SIGCHLD signalfd. So launching costs the same no matter how
+* big the shell has become.
+* Launches that don't fit in one message, or any launch after the helper has
+* gone away, go through the shell's own spawn path instead.
+*/
+
+#define _GNU_SOURCE
+#include "smallsh.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+
+#define ZYGOTE_MSG_MAX  65536   // largest launch request, bigger ones are spawned locally
+
+// which optional parts a request carries
+#define ZYGOTE_STDIN    0x01    // stdin pipe end passed as an fd
+#define ZYGOTE_STDOUT   0x02    // stdout pipe end passed as an fd
+#define ZYGOTE_TTY      0x04    // terminal passed as an fd
+
+// launch request, followed by the strings cwd, a "fd op flags src" and a file name per redirection
+// step, argv..., env...
+struct zygote_req {
+    int32_t pgid;
+    uint32_t flags;
+    uint32_t nredirs;
+    uint32_t argc;
+    uint32_t envc;
+};
+
+// reply to a launch request
+struct zygote_reply {
+    int32_t pid;      // -1 if the fork failed
+    int32_t err;
+};
+
+// a child of the zygote changed state
+struct zygote_event {
+    int32_t pid;
+    int32_t status;
+    struct rusage ru;
+};
+
+extern char **environ;
+
+static int zygote_ctl = -1;     // requests and replies
+static int zygote_events = -1;  // state changes of the children
+static pid_t zygote_pid = -1;
+
+static void zygote_main(int ctl, int events);
+
+/*
+* Function to fork the zygote if SMALLSH_ZYGOTE is set. Must be called after
+* jobs_init(), so SIGCHLD is already blocked in the helper.
+*/
+void zygote_start(void)
+{
+    int ctl[2], events[2];
+    const char *mode = getenv("SMALLSH_ZYGOTE");
+    if (mode == NULL || *mode == '\0' || strcmp(mode, "0") == 0) return;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ctl) == -1) {
+        perror("zygote socketpair() failed");
+        return;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, events) == -1) {
+        perror("zygote socketpair() failed");
+        close(ctl[0]);
+        close(ctl[1]);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("zygote fork() failed");
+        close(ctl[0]);
+        close(ctl[1]);
+        close(events[0]);
+        close(events[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(ctl[0]);
+        close(events[0]);
+        zygote_main(ctl[1], events[1]);
+    }
+    close(ctl[1]);
+    close(events[1]);
+    fcntl(events[0], F_SETFL, O_NONBLOCK);
+    zygote_ctl = ctl[0];
+    zygote_events = events[0];
+    zygote_pid = pid;
+    jobs_watch_fd(zygote_events);
+}
+
+/* Function to stop using the zygote, e.g. after it died */
+static void zygote_stop(void)
+{
+    close(zygote_ctl);
+    zygote_ctl = -1;
+    // keep the events socket until it is drained, its EOF is noticed by zygote_reap()
+}
+
+/*
+* Function to append s with its NUL to buf at *len, returns -1 if it doesn't fit
+* (the zygote receives into ZYGOTE_MSG_MAX - 1 bytes, keeping one for a terminator)
+*/
+static int put_str(char *buf, size_t *len, const char *s)
+{
+    size_t n = strlen(s) + 1;
+    if (*len + n >= ZYGOTE_MSG_MAX) return -1;
+    memcpy(buf + *len, s, n);
+    *len += n;
+    return 0;
+}
+
+/*
+* Function to launch cmd through the zygote.
+* Returns the pid of the child, -1 if it could not be started, or
+* ZYGOTE_UNAVAILABLE if there is no zygote or the request is too big for it.
+*/
+pid_t zygote_spawn(struct command *cmd)
+{
+    static char buf[ZYGOTE_MSG_MAX];
+    struct zygote_req *req = (struct zygote_req *) buf;
+    size_t len = sizeof *req;
+    int fds[3], nfds = 0;
+
+    if (zygote_ctl < 0) return ZYGOTE_UNAVAILABLE;
+
+    req->pgid = cmd->pgid;
+    req->flags = 0;
+    req->nredirs = cmd->nredirs;
+    req->argc = 0;
+    req->envc = 0;
+    if (cmd->stdin_fd >= 0) {
+        req->flags |= ZYGOTE_STDIN;
+        fds[nfds++] = cmd->stdin_fd;
+    }
+    if (cmd->stdout_fd >= 0) {
+        req->flags |= ZYGOTE_STDOUT;
+        fds[nfds++] = cmd->stdout_fd;
+    }
+    if (cmd->tty_fd >= 0) {
+        req->flags |= ZYGOTE_TTY;
+        fds[nfds++] = cmd->tty_fd;
+    }
+
+    // the child runs in our cwd, redirection is opened there by the child itself
+    if (getcwd(buf + len, ZYGOTE_MSG_MAX - 1 - len) == NULL) return ZYGOTE_UNAVAILABLE;
+    len += strlen(buf + len) + 1;
+    for (int i = 0; i < cmd->nredirs; i++) {
+        const struct redir *r = &cmd->redirs[i];
+        char step[64];
+        if (r->op == REDIR_PASS) return ZYGOTE_UNAVAILABLE;  // an fd only the shell has
+        snprintf(step, sizeof step, "%d %d %d %d", r->fd, r->op, r->flags, r->src);
+        if (put_str(buf, &len, step) == -1 || put_str(buf, &len, r->path != NULL ? r->path : "") == -1) {
+            return ZYGOTE_UNAVAILABLE;
+        }
+    }
+    for (char **arg = cmd->argv; *arg != NULL; arg++, req->argc++) {
+        if (put_str(buf, &len, *arg) == -1) return ZYGOTE_UNAVAILABLE;
+    }
+    for (char **env = environ; *env != NULL; env++, req->envc++) {
+        if (put_str(buf, &len, *env) == -1) return ZYGOTE_UNAVAILABLE;
+    }
+
+    struct iovec iov = { buf, len };
+    union {
+        struct cmsghdr align;
+        char data[CMSG_SPACE(sizeof fds)];
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (nfds > 0) {
+        msg.msg_control = control.data;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+    }
+
+    struct zygote_reply reply;
+    ssize_t n;
+    while ((n = sendmsg(zygote_ctl, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {}
+    if (n == -1) {
+        if (errno == EMSGSIZE) return ZYGOTE_UNAVAILABLE;
+        zygote_stop();  // it has gone away, launch locally from now on
+        return ZYGOTE_UNAVAILABLE;
+    }
+    while ((n = recv(zygote_ctl, &reply, sizeof reply, 0)) == -1 && errno == EINTR) {}
+    if (n != sizeof reply) {
+        zygote_stop();
+        return ZYGOTE_UNAVAILABLE;
+    }
+    if (reply.pid == -1) {
+        fprintf(stderr, "%s: %s\n", cmd->argv[0], strerror(reply.err));
+        return -1;
+    }
+    return reply.pid;
+}
+
+/*
+* Function to pass the state changes the zygote has sent on to the job table.
+* Returns the number of background jobs reported.
+*/
+int zygote_reap(void)
+{
+    struct zygote_event event;
+    int reported = 0;
+    ssize_t n;
+
+    if (zygote_events < 0) return 0;
+    while ((n = recv(zygote_events, &event, sizeof event, MSG_DONTWAIT)) == sizeof event) {
+        reported += job_changed(event.pid, event.status, &event.ru);
+    }
+    if (n == 0) {  // the zygote exited, it can't have children left to report
+        close(zygote_events);
+        zygote_events = -1;
+        if (zygote_ctl >= 0) zygote_stop();
+        waitpid(zygote_pid, NULL, WNOHANG);
+    }
+    return reported;
+}
+
+/*
+* The zygote itself: launch children on request and report their state
+* changes until the shell closes the request socket. Never returns.
+* Events that can't be sent right away are queued, so the zygote never blocks
+* on a shell that is itself waiting for a launch reply.
+*/
+static void zygote_main(int ctl, int events)
+{
+    static char buf[ZYGOTE_MSG_MAX];
+    char **own_environ = environ;  // put back after each launch, the request's env goes out of scope
+    struct zygote_event *backlog = NULL;
+    size_t backlog_len = 0, backlog_cap = 0;
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    fcntl(events, F_SETFL, O_NONBLOCK);
+
+    for (;;) {
+        struct pollfd pfd[3] = {
+            { ctl, POLLIN, 0 },
+            { sfd, POLLIN, 0 },
+            { events, backlog_len > 0 ? POLLOUT : 0, 0 },
+        };
+        if (poll(pfd, 3, -1) == -1) continue;
+
+        if (pfd[1].revents & POLLIN) {  // children changed state, queue their events
+            struct signalfd_siginfo info;
+            struct zygote_event event;
+            while (read(sfd, &info, sizeof info) > 0) {}
+            while ((event.pid = wait4(-1, &event.status, WNOHANG | WUNTRACED, &event.ru)) > 0) {
+                if (backlog_len == backlog_cap) {
+                    backlog_cap = backlog_cap ? backlog_cap * 2 : 64;
+                    backlog = realloc(backlog, backlog_cap * sizeof *backlog);
+                    if (backlog == NULL) _exit(1);
+                }
+                backlog[backlog_len++] = event;
+            }
+        }
+        // send as many queued events as the socket takes
+        size_t sent = 0;
+        while (sent < backlog_len && send(events, &backlog[sent], sizeof *backlog, MSG_NOSIGNAL) == sizeof *backlog) {
+            sent++;
+        }
+        if (sent > 0) {
+            memmove(backlog, backlog + sent, (backlog_len - sent) * sizeof *backlog);
+            backlog_len -= sent;
+        }
+
+        if (!(pfd[0].revents & (POLLIN | POLLHUP))) continue;
+
+        // a launch request
+        union {
+            struct cmsghdr align;
+            char data[CMSG_SPACE(3 * sizeof(int))];
+        } control;
+        struct iovec iov = { buf, sizeof buf - 1 };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.data, .msg_controllen = sizeof control.data };
+        ssize_t n = recvmsg(ctl, &msg, MSG_CMSG_CLOEXEC);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) _exit(0);  // the shell has exited
+        buf[n] = '\0';
+
+        int fds[3], nfds = 0;
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        if (cm != NULL && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
+        }
+
+        // unpack the request into a command
+        struct zygote_req *req = (struct zygote_req *) buf;
+        struct command cmd;
+        char *p = buf + sizeof *req;
+        char *argv[req->argc + 1], *env[req->envc + 1];
+        struct redir redirs[req->nredirs + 1];
+        int f = 0;
+        memset(&cmd, 0, sizeof cmd);
+        cmd.pgid = req->pgid;
+        cmd.stdin_fd = req->flags & ZYGOTE_STDIN ? fds[f++] : -1;
+        cmd.stdout_fd = req->flags & ZYGOTE_STDOUT ? fds[f++] : -1;
+        cmd.tty_fd = req->flags & ZYGOTE_TTY ? fds[f++] : -1;
+        const char *cwd = p;
+        p += strlen(p) + 1;
+        for (uint32_t i = 0; i < req->nredirs; i++) {
+            struct redir *r = &redirs[i];
+            sscanf(p, "%d %d %d %d", &r->fd, &r->op, &r->flags, &r->src);
+            p += strlen(p) + 1;
+            r->path = p;
+            p += strlen(p) + 1;
+        }
+        cmd.redirs = redirs;
+        cmd.nredirs = req->nredirs;
+        for (uint32_t i = 0; i < req->argc; i++, p += strlen(p) + 1) argv[i] = p;
+        argv[req->argc] = NULL;
+        for (uint32_t i = 0; i < req->envc; i++, p += strlen(p) + 1) env[i] = p;
+        env[req->envc] = NULL;
+        cmd.argv = argv;
+        environ = env;  // also lets path_lookup() notice a changed PATH
+        path_lookup(argv[0]);  // warm our own cache, the child inherits it
+
+        struct zygote_reply reply = { fork(), 0 };
+        if (reply.pid == 0) {
+            if (chdir(cwd) == -1) {
+                fprintf(stderr, "%s: %s\n", cwd, strerror(errno));
+                _exit(1);
+            }
+            exec_command(&cmd);
+        }
+        environ = own_environ;
+        if (reply.pid == -1) reply.err = errno;
+        else if (cmd.pgid >= 0) setpgid(reply.pid, cmd.pgid == 0 ? reply.pid : cmd.pgid);
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+        send(ctl, &reply, sizeof reply, MSG_NOSIGNAL);
+    }
+}